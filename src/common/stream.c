@@ -0,0 +1,70 @@
+/*
+ * $Id$
+ * Copyright (C) 2007  Klaus Reimer <k@ailis.de>
+ * See COPYING file for copying conditions
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "stream.h"
+
+
+/**
+ * Opens the specified input file for reading. "-" opens the standard input.
+ *
+ * @param filename
+ *            The filename or "-" for stdin
+ * @return The opened stream or NULL on failure
+ */
+
+FILE * streamOpenInput(char *filename)
+{
+    if (!strcmp(filename, "-")) return stdin;
+    return fopen(filename, "rb");
+}
+
+
+/**
+ * Closes an input stream opened with streamOpenInput(). The standard input
+ * is left open.
+ *
+ * @param stream
+ *            The stream to close
+ */
+
+void streamCloseInput(FILE *stream)
+{
+    if (stream != stdin) fclose(stream);
+}
+
+
+/**
+ * Opens the specified output file for writing. "-" opens the standard
+ * output.
+ *
+ * @param filename
+ *            The filename or "-" for stdout
+ * @return The opened stream or NULL on failure
+ */
+
+FILE * streamOpenOutput(char *filename)
+{
+    if (!strcmp(filename, "-")) return stdout;
+    return fopen(filename, "wb");
+}
+
+
+/**
+ * Closes an output stream opened with streamOpenOutput(). The standard
+ * output is only flushed.
+ *
+ * @param stream
+ *            The stream to close
+ * @return 1 on success, 0 on failure
+ */
+
+int streamCloseOutput(FILE *stream)
+{
+    if (stream == stdout) return !fflush(stream);
+    return !fclose(stream);
+}
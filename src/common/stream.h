@@ -0,0 +1,23 @@
+/*
+ * $Id$
+ * Copyright (C) 2007  Klaus Reimer <k@ailis.de>
+ * See COPYING file for copying conditions
+ */
+
+#ifndef STREAM_H
+#define STREAM_H
+
+/**
+ * \file stream.h
+ * Utility functions to open the input and output files of the tools. The
+ * filename "-" stands for the standard input or output.
+ */
+
+#include <stdio.h>
+
+FILE * streamOpenInput(char *filename);
+void   streamCloseInput(FILE *stream);
+FILE * streamOpenOutput(char *filename);
+int    streamCloseOutput(FILE *stream);
+
+#endif
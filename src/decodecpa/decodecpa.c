@@ -15,6 +15,7 @@
 #include <gd.h>
 #include <errno.h>
 #include "../libwasteland/wasteland.h"
+#include "../common/stream.h"
 #include "config.h"
 
 #ifdef WIN32
@@ -32,6 +33,8 @@ static void display_usage(void)
 {
     printf("Usage: wl_decodecpa [OPTION]... CPAFILE GIFFILE\n");
     printf("Decodes CPA animation file into an animated GIF image.\n");
+    printf("Use - as CPAFILE to read from stdin and - as GIFFILE to write to\n");
+    printf("stdout.\n");
     printf("\nOptions\n");
     printf("  -h, --help              Display help and exit\n");
     printf("  -V, --version           Display version and exit\n");
@@ -114,30 +117,41 @@ static void check_options(int argc, char *argv[])
 
 
 /**
- * Creates a GD image from the specified wasteland image 
+ * Creates a GD image from the specified area of a wasteland image. If a
+ * previous frame is specified then all pixels which have not changed since
+ * this frame are made transparent so they don't need to be encoded again.
  * 
  * @param image
  *            The wasteland image
+ * @param prevFrame
+ *            The previous frame. NULL to create an opaque image.
+ * @param area
+ *            The area to copy into the GD image
  * @return The GD image
  */
 
-static gdImagePtr createImage(wlImage image)
+static gdImagePtr createImage(wlImage image, wlImage prevFrame, wlRect area)
 {    
     gdImagePtr output;
-    int x, y, i;
+    int x, y, i, offset, transparent, color;
 
-    output = gdImageCreate(288, 128);
+    output = gdImageCreate(area->width, area->height);
     for (i = 0; i < 16; i++)
     {
         gdImageColorAllocate(output, wlPalette[i].red, wlPalette[i].green,
                 wlPalette[i].blue);
     }
-    gdImageColorTransparent(output, gdImageColorAllocate(output, 0, 0, 0));
-    for (y = 0; y < 128; y++)       
+    transparent = gdImageColorAllocate(output, 0, 0, 0);
+    gdImageColorTransparent(output, transparent);
+    for (y = 0; y < area->height; y++)       
     {
-        for (x = 0; x < 288; x++)
+        for (x = 0; x < area->width; x++)
         {
-            gdImageSetPixel(output, x, y, image->pixels[y * 288 + x]);
+            offset = (area->y + y) * image->width + area->x + x;
+            color = image->pixels[offset];
+            if (prevFrame && prevFrame->pixels[offset] == color)
+                color = transparent;
+            gdImageSetPixel(output, x, y, color);
         }
     }    
     return output;
@@ -145,7 +159,9 @@ static gdImagePtr createImage(wlImage image)
 
 
 /**
- * Writes animation data into the specified output directory.
+ * Writes animation data into the specified output directory. Only the area
+ * changed by each animation frame is written into the GIF so the encoder
+ * doesn't have to process the whole picture again and again.
  * 
  * @param outputDir
  *            The output directory
@@ -155,48 +171,70 @@ static gdImagePtr createImage(wlImage image)
 
 static void writeGif(char *filename, wlCpaAnimation *animation)
 {
-    int i;
-    wlImage frame;
-    gdImagePtr image, prevImage; 
+    int i, y;
+    wlImage frame, prevFrame;
+    wlRectStruct area;
+    gdImagePtr image; 
     FILE *file;
     
-    file = fopen(filename, "wb");
-    
-    // Create a copy of the base frame
-    frame = (wlImage) malloc(sizeof(wlPixel) * 288 * 128);
-    memcpy(frame, animation->baseFrame, sizeof(wlPixel) * 288 * 128);
+    file = streamOpenOutput(filename);
+    if (!file)
+    {
+        die("Unable to write GIF to %s: %s\n", filename, strerror(errno));
+    }
     
-    image = createImage(frame);
-    prevImage = NULL;
+    // Create a copy of the base frame and write it as the first GIF frame
+    frame = wlImageClone(animation->baseFrame);
+    prevFrame = wlImageClone(animation->baseFrame);
+    area.x = 0;
+    area.y = 0;
+    area.width = frame->width;
+    area.height = frame->height;
+    image = createImage(frame, NULL, &area);
     gdImageGifAnimBegin(image, file, 1, -1);
     gdImageGifAnimAdd(image, file, 0, 0, 0, animation->frames[0]->delay * 8,
             gdDisposalNone, NULL);
+    gdImageDestroy(image);
     
     // Cycle through all animation frames, apply the frame updates to our frame
-    // and then write the frame PNG
+    // and then write the changed area of the frame
     for (i = 0; i < animation->quantity; i++)
     {
-        wlCpaApplyFrame(frame, animation->frames[i]);
-        if (prevImage) gdImageDestroy(prevImage);
-        prevImage = image;
-        image = createImage(frame); 
-        gdImageGifAnimAdd(image, file, 0, 0, 0,
+        wlCpaApplyFrame(frame, animation->frames[i], &area);
+
+        // Frames without changes still need a (single transparent) pixel
+        // for the delay
+        if (!area.width) wlRectAdd(&area, 0, 0, 1, 1);
+
+        image = createImage(frame, prevFrame, &area);
+        gdImageGifAnimAdd(image, file, 0, area.x, area.y,
                 (i + 1 == animation->quantity) ? 0 :
                     animation->frames[i + 1]->delay * 8,
-                gdDisposalNone, prevImage);
+                gdDisposalNone, NULL);
+        gdImageDestroy(image);
+
+        // Remember the changed area for the next frame
+        for (y = area.y; y < area.y + area.height; y++)
+        {
+            memcpy(&prevFrame->pixels[y * frame->width + area.x],
+                &frame->pixels[y * frame->width + area.x],
+                sizeof(wlPixel) * area.width);
+        }
     }
     gdImageGifAnimEnd(file);
-    fclose(file);
+    if (!streamCloseOutput(file))
+    {
+        die("Unable to write GIF to %s: %s\n", filename, strerror(errno));
+    }
     
     // Free resources
-    gdImageDestroy(prevImage);
-    gdImageDestroy(image);
-    free(frame);
+    wlImageFree(prevFrame);
+    wlImageFree(frame);
 }
 
 
 /**
- * Main method
+ * Main method of wl_decodecpa. Called by the wl multi-call program.
  *
  * @param argc
  *            The number of arguments
@@ -205,10 +243,11 @@ static void writeGif(char *filename, wlCpaAnimation *animation)
  * @return Exit value
  */
 
-int main(int argc, char *argv[])
+int decodecpa_main(int argc, char *argv[])
 {  
     char *source, *dest;
     wlCpaAnimation *animation;
+    FILE *file;
     
     /* Process options and reset argument pointer */
     check_options(argc, argv);
@@ -223,7 +262,13 @@ int main(int argc, char *argv[])
     dest = argv[1];
     
     /* Read the animation */
-    animation = wlCpaReadFile(source);
+    file = streamOpenInput(source);
+    if (!file)
+    {
+        die("Unable to open CPA file %s: %s\n", source, strerror(errno));
+    }
+    animation = wlCpaReadStream(file);
+    streamCloseInput(file);
     if (!animation)
     {
         die("Unable to read CPA animation from %s: %s\n", source,
@@ -4,7 +4,10 @@
  * See COPYING file for copying conditions
  */
 
+#include <sys/mman.h>
 #include <getopt.h>
+#include <limits.h>
+#include <time.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdarg.h>
@@ -15,9 +18,30 @@
 #include "../libwasteland/wasteland.h"
 #include "config.h"
 
+/** The size of the output buffer */
+#define BUFFER_SIZE 65536
+
 /** The maximum number of bytes to read. 0 = Infinite */
 static size_t maxBytes = 0;
 
+/** The number of input bytes to skip before the huffman stream starts */
+static long offset = 0;
+
+/** The number of additional bits to skip before the huffman stream starts */
+static long bitOffset = 0;
+
+/** The number of decoder threads. 1 = Streaming decoder */
+static int jobs = 1;
+
+/** If decoding times of the streaming and the parallel decoder are compared */
+static int benchmark = 0;
+
+/** The backend of the streaming decoder */
+static int backend = WL_HUFFMAN_TREE;
+
+/** The names of the decoder backends */
+static char *backends[] = { "bits", "tree", "fsm" };
+
 
 /**
  * Displays the usage text.
@@ -29,6 +53,15 @@ static void display_usage(void)
     printf("Huffman-decodes data from STDIN and writes it to STDOUT.\n");
     printf("\nOptions\n");
     printf("  -m, --max BYTES      The maximum number of bytes to read.\n");
+    printf("  -o, --offset BYTES   The input offset of the huffman stream\n");
+    printf("  -b, --bit-offset BITS\n");
+    printf("                       Additional bits to skip after the offset\n");
+    printf("  -j, --jobs=N         Decode the stream in memory with N threads\n");
+    printf("                       (0 = One per CPU, Default: 1 = Streaming)\n");
+    printf("  -d, --decoder=NAME   The backend of the streaming decoder: bits,\n");
+    printf("                       tree or fsm (Default: tree)\n");
+    printf("      --benchmark      Compare all streaming backends and the\n");
+    printf("                       parallel decoder and report the speedups\n");
     printf("  -h, --help           Display help and exit\n");
     printf("  -V, --version        Display version and exit\n");
     printf("\nReport bugs to %s <%s>\n", AUTHOR, EMAIL);
@@ -82,12 +115,18 @@ static void check_options(int argc, char *argv[])
     int index;
     static struct option options[]={
         {"max", 1, NULL, 'm'},
+        {"offset", 1, NULL, 'o'},
+        {"bit-offset", 1, NULL, 'b'},
+        {"jobs", 1, NULL, 'j'},
+        {"benchmark", 0, NULL, 'B'},
+        {"decoder", 1, NULL, 'd'},
         {"help", 0, NULL, 'h'},
-        {"version", 0, NULL, 'V'}
+        {"version", 0, NULL, 'V'},
+        {NULL, 0, NULL, 0}
     };
     
     opterr = 0;
-    while((opt = getopt_long(argc, argv, "hVm:", options, &index)) != -1)
+    while((opt = getopt_long(argc, argv, "hVm:o:b:j:d:", options, &index)) != -1)
     {
         switch(opt) 
         {                
@@ -95,6 +134,31 @@ static void check_options(int argc, char *argv[])
                 maxBytes = atol(optarg);
                 break;
                 
+            case 'o':
+                offset = atol(optarg);
+                if (offset < 0) die("Invalid offset: %s\n", optarg);
+                break;
+                
+            case 'b':
+                bitOffset = atol(optarg);
+                if (bitOffset < 0) die("Invalid bit offset: %s\n", optarg);
+                break;
+                
+            case 'j':
+                jobs = atoi(optarg);
+                if (jobs < 0) die("Invalid number of jobs: %s\n", optarg);
+                break;
+                
+            case 'B':
+                benchmark = 1;
+                break;
+                
+            case 'd':
+                for (backend = WL_HUFFMAN_FSM; backend >= 0; backend--)
+                    if (!strcmp(optarg, backends[backend])) break;
+                if (backend < 0) die("Unknown decoder: %s\n", optarg);
+                break;
+                
             case 'V':
                 display_version();
                 exit(1);
@@ -115,7 +179,244 @@ static void check_options(int argc, char *argv[])
 
 
 /**
- * Main method
+ * Skips the specified number of bytes in the input stream. Seekable input
+ * is positioned directly, other input is read and discarded.
+ *
+ * @param stream
+ *            The input stream
+ * @param bytes
+ *            The number of bytes to skip
+ */
+
+static void skipBytes(FILE *stream, long bytes)
+{
+    unsigned char buffer[BUFFER_SIZE];
+    size_t read;
+
+    if (!bytes || !fseek(stream, bytes, SEEK_CUR)) return;
+    while (bytes)
+    {
+        read = fread(buffer, 1, bytes < BUFFER_SIZE ? bytes : BUFFER_SIZE,
+            stream);
+        if (!read) die("Input ends before offset\n");
+        bytes -= read;
+    }
+}
+
+
+/**
+ * Writes the specified data to the output file descriptor. Partial writes
+ * are continued until all data is written.
+ *
+ * @param fd
+ *            The output file descriptor
+ * @param data
+ *            The data to write
+ * @param size
+ *            The number of bytes to write
+ */
+
+static void writeData(int fd, unsigned char *data, size_t size)
+{
+    ssize_t written;
+
+    while (size)
+    {
+        written = write(fd, data, size);
+        if (written < 0)
+        {
+            if (errno == EINTR) continue;
+            die("Unable to write output data: %s\n", strerror(errno));
+        }
+        data += written;
+        size -= written;
+    }
+}
+
+
+/**
+ * Reads the rest of the input stream into memory. Remember to free the
+ * returned data when no longer needed.
+ *
+ * @param stream
+ *            The input stream
+ * @param size
+ *            The number of read bytes is stored into this variable
+ * @return The read data
+ */
+
+static unsigned char * readInput(FILE *stream, size_t *size)
+{
+    unsigned char *data;
+    size_t capacity, read;
+
+    capacity = BUFFER_SIZE;
+    data = malloc(capacity);
+    *size = 0;
+    while ((read = fread(data + *size, 1, capacity - *size, stream)) > 0)
+    {
+        *size += read;
+        if (*size == capacity)
+        {
+            capacity *= 2;
+            data = realloc(data, capacity);
+        }
+    }
+    if (ferror(stream))
+        die("Unable to read input data: %s\n", strerror(errno));
+    return data;
+}
+
+
+/**
+ * Returns the current time in seconds.
+ *
+ * @return The current time
+ */
+
+static double now(void)
+{
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1000000000.0;
+}
+
+
+/**
+ * Decodes the specified number of bytes from the in-memory huffman stream
+ * with the specified streaming decoder backend, compares the result with
+ * the specified block and returns the decoding time. The time includes
+ * the creation of the decoder.
+ *
+ * @param rootNode
+ *            The root node of the huffman tree
+ * @param backend
+ *            The decoder backend
+ * @param data
+ *            The huffman stream
+ * @param size
+ *            The size of the huffman stream
+ * @param skip
+ *            The number of bits to skip in the first byte
+ * @param block
+ *            The expected decoded bytes
+ * @param count
+ *            The number of bytes to decode
+ * @return The decoding time in seconds
+ */
+
+static double benchmarkDecoder(wlHuffmanNode *rootNode, int backend,
+    unsigned char *data, size_t size, int skip, unsigned char *block,
+    int count)
+{
+    wlHuffmanDecoder decoder;
+    unsigned char *check;
+    unsigned char dataByte, dataMask;
+    double start, time;
+    FILE *stream;
+    int read;
+
+    check = malloc(count ? count : 1);
+    stream = fmemopen(data, size ? size : 1, "rb");
+    if (!stream) die("Unable to open input data: %s\n", strerror(errno));
+    dataByte = 0;
+    dataMask = 0;
+    if (skip)
+    {
+        dataByte = fgetc(stream);
+        dataMask = 0x80 >> skip;
+    }
+    start = now();
+    if (!(decoder = wlHuffmanDecoderCreate(rootNode, backend)))
+        die("Unable to create %s decoder\n", backends[backend]);
+    read = wlHuffmanDecoderDecode(decoder, stream, check, count, &dataByte,
+        &dataMask);
+    wlHuffmanDecoderFree(decoder);
+    time = now() - start;
+    fclose(stream);
+    if (read != count || memcmp(check, block, count))
+        die("Output of %s decoder differs from parallel decoder\n",
+            backends[backend]);
+    free(check);
+    return time;
+}
+
+
+/**
+ * Decodes the rest of the huffman stream in memory with the parallel
+ * decoder and writes it to stdout. When benchmarking then the stream is
+ * decoded with all streaming decoder backends too, the results are
+ * compared and the times and speedups are reported on stderr. The speedups
+ * are relative to the bits backend which decodes the stream with
+ * wlHuffmanReadByte().
+ *
+ * @param rootNode
+ *            The root node of the huffman tree
+ * @param dataByte
+ *            The last read byte
+ * @param dataMask
+ *            The bit mask of the next bit in the last read byte
+ */
+
+static void decodeParallel(wlHuffmanNode *rootNode, unsigned char dataByte,
+    unsigned char dataMask)
+{
+    unsigned char *data, *block;
+    size_t size, quantity;
+    int skip, count, i;
+    double start, parallelTime, times[3];
+
+    // Read the rest of the stream and put the partially read byte in front
+    data = readInput(stdin, &size);
+    skip = 0;
+    if (dataMask)
+    {
+        data = realloc(data, size + 1);
+        memmove(data + 1, data, size++);
+        data[0] = dataByte;
+        for (skip = 8; dataMask; dataMask >>= 1) skip--;
+    }
+
+    // Without a maximum the stream can't hold more bytes than bits. The
+    // output block is only backed by memory where it is written.
+    quantity = maxBytes ? maxBytes : size * 8;
+    if (quantity > INT_MAX) quantity = INT_MAX;
+    block = mmap(NULL, quantity ? quantity : 1, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (block == MAP_FAILED)
+        die("Unable to allocate output buffer: %s\n", strerror(errno));
+
+    // Decode the stream
+    start = now();
+    count = wlHuffmanDecodeParallel(data, size, skip, rootNode, block,
+        quantity, jobs);
+    if (count < 0) die("Unable to start threads: %s\n", strerror(errno));
+    parallelTime = now() - start;
+
+    // Decode the same number of bytes with the streaming decoders
+    if (benchmark)
+    {
+        for (i = WL_HUFFMAN_BITS; i <= WL_HUFFMAN_FSM; i++)
+            times[i] = benchmarkDecoder(rootNode, i, data, size, skip, block,
+                count);
+        fprintf(stderr, "Block of %i bytes (%lu input bytes):\n", count,
+            (unsigned long) size);
+        for (i = WL_HUFFMAN_BITS; i <= WL_HUFFMAN_FSM; i++)
+            fprintf(stderr, "  %-8s %8.3f s  speedup %6.2f\n", backends[i],
+                times[i], times[i] > 0 ? times[0] / times[i] : 0);
+        fprintf(stderr, "  %-8s %8.3f s  speedup %6.2f\n", "parallel",
+            parallelTime, parallelTime > 0 ? times[0] / parallelTime : 0);
+    }
+
+    writeData(fileno(stdout), block, count);
+    munmap(block, quantity ? quantity : 1);
+    free(data);
+}
+
+
+/**
+ * Main method of wl_decodehuffman. Called by the wl multi-call program.
  *
  * @param argc
  *            The number of arguments
@@ -124,11 +425,13 @@ static void check_options(int argc, char *argv[])
  * @return Exit value
  */
 
-int main(int argc, char *argv[])
+int decodehuffman_main(int argc, char *argv[])
 {  
     wlHuffmanNode *rootNode;
+    wlHuffmanDecoder decoder;
     unsigned char dataByte, dataMask;
-    int b;
+    unsigned char buffer[BUFFER_SIZE];
+    int size, read;
     size_t bytes;
     
     /* Process options and reset argument pointer */
@@ -139,22 +442,47 @@ int main(int argc, char *argv[])
     /* Terminate if wrong number of parameters are specified */
     if (argc != 0) die("Wrong number of parameters.\nUse --help to show syntax.\n");
 
-    /* Open huffman stream */
+    /* Skip to the start of the huffman stream */
+    skipBytes(stdin, offset + bitOffset / 8);
     dataByte = 0;
     dataMask = 0;
+    if (bitOffset % 8)
+    {
+        if (fread(&dataByte, 1, 1, stdin) != 1)
+            die("Input ends before offset\n");
+        dataMask = 0x80 >> (bitOffset % 8);
+    }
+
+    /* Open huffman stream */
     if (!(rootNode = wlHuffmanReadNode(stdin, &dataByte, &dataMask)))
         die("Unable to read huffman root node.\n");
     
-    /* Read bytes and print them to STDOUT */
+    /* Decode in memory with the parallel decoder */
+    if (jobs != 1 || benchmark)
+    {
+        decodeParallel(rootNode, dataByte, dataMask);
+        wlHuffmanFreeNode(rootNode);
+        return 0;
+    }
+
+    /* Decode blocks and write them to STDOUT */
+    if (!(decoder = wlHuffmanDecoderCreate(rootNode, backend)))
+        die("Unable to create %s decoder\n", backends[backend]);
     bytes = 0;
-    while ((b = wlHuffmanReadByte(stdin, rootNode, &dataByte, &dataMask)) != EOF)
+    do
     {
-        fputc(b, stdout);
-        bytes++;
-        if (maxBytes && bytes >= maxBytes) break;
+        size = BUFFER_SIZE;
+        if (maxBytes && maxBytes - bytes < size) size = maxBytes - bytes;
+        read = wlHuffmanDecoderDecode(decoder, stdin, buffer, size, &dataByte,
+            &dataMask);
+        writeData(fileno(stdout), buffer, read);
+        bytes += read;
     }
+    while (read == size && (!maxBytes || bytes < maxBytes));
+    if (ferror(stdin)) die("Unable to read input data: %s\n", strerror(errno));
         
     /* Close huffman stream */
+    wlHuffmanDecoderFree(decoder);
     wlHuffmanFreeNode(rootNode);
     
     /* Success */
@@ -9,11 +9,17 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
-#include <gd.h>
 #include <errno.h>
 #include "../libwasteland/wasteland.h"
+#include "../common/stream.h"
 #include "config.h"
 
+/** The factor by which the written PNG images are scaled */
+static int scale = 1;
+
+/** The scale method (WL_SCALE_NEAREST or WL_SCALE_EPX) */
+static int scaleMethod = WL_SCALE_NEAREST;
+
 
 /**
  * Displays the usage text.
@@ -23,7 +29,12 @@ static void display_usage(void)
 {
     printf("Usage: wl_decodepic [OPTION]... PICFILE PNGFILE\n");
     printf("Converts a wasteland PIC image file into a PNG image file.\n");
+    printf("Use - as PICFILE to read from stdin and - as PNGFILE to write to\n");
+    printf("stdout.\n");
     printf("\nOptions\n");
+    printf("  -s, --scale=FACTOR   Scale the images by an integer FACTOR\n");
+    printf("  -e, --epx            Scale with EPX (Scale2x/3x/4x) instead of\n");
+    printf("                       nearest neighbour\n");
     printf("  -h, --help           Display help and exit\n");
     printf("  -V, --version        Display version and exit\n");
     printf("\nReport bugs to %s <%s>\n", AUTHOR, EMAIL);
@@ -76,15 +87,26 @@ static void check_options(int argc, char *argv[])
     char opt;
     int index;
     static struct option options[]={
+        {"scale", 1, NULL, 's'},
+        {"epx", 0, NULL, 'e'},
         {"help", 0, NULL, 'h'},
-        {"version", 0, NULL, 'V'}
+        {"version", 0, NULL, 'V'},
+        {NULL, 0, NULL, 0}
     };
     
     opterr = 0;
-    while((opt = getopt_long(argc, argv, "hV", options, &index)) != -1)
+    while((opt = getopt_long(argc, argv, "s:ehV", options, &index)) != -1)
     {
         switch(opt) 
         {                
+            case 's':
+                scale = atoi(optarg);
+                break;
+
+            case 'e':
+                scaleMethod = WL_SCALE_EPX;
+                break;
+
             case 'V':
                 display_version();
                 exit(1);
@@ -101,6 +123,9 @@ static void check_options(int argc, char *argv[])
                 break;
         }
     }
+    if (scale < 1) die("Invalid scale factor: %i\n", scale);
+    if (scaleMethod == WL_SCALE_EPX && (scale < 2 || scale > 4))
+        die("EPX only supports the scale factors 2, 3 and 4\n");
 }
 
 
@@ -108,44 +133,26 @@ static void check_options(int argc, char *argv[])
  * Writes the pic into the specified file in PNG format.
  * 
  * @param filename
- *            The output filename
+ *            The output filename or "-" for stdout
  * @param pic
  *            The wasteland pic
  */
 
 static void writePng(char *filename, wlImage pic)
 {
-    gdImagePtr output;
-    int x, y, i;
-    int palette[16];
     FILE *file;
 
-    output = gdImageCreate(pic->width, pic->height);
-    for (i = 0; i < 16; i++)
-    {
-        palette[i] = gdImageColorAllocate(output, wlPalette[i].red,
-                wlPalette[i].green, wlPalette[i].blue);
-    }
-    for (y = 0; y < pic->height; y++)       
-    {
-        for (x = 0; x < pic->width; x++)
-        {
-            gdImageSetPixel(output, x, y, palette[pic->pixels[y * pic->width + x]]);
-        }
-    }    
-    file = fopen(filename, "wb");
-    if (!file)
+    file = streamOpenOutput(filename);
+    if (!file || !wlPngWriteScaledStream(pic, file, -1, WL_PNG_FILTER_NONE,
+        scale, scaleMethod) || !streamCloseOutput(file))
     {
         die("Unable to write PNG to %s: %s\n", filename, strerror(errno));
     }
-    gdImagePng(output, file);
-    gdImageDestroy(output);
-    fclose(file);    
 }
 
 
 /**
- * Main method
+ * Main method of wl_decodepic. Called by the wl multi-call program.
  *
  * @param argc
  *            The number of arguments
@@ -154,10 +161,11 @@ static void writePng(char *filename, wlImage pic)
  * @return Exit value
  */
 
-int main(int argc, char *argv[])
+int decodepic_main(int argc, char *argv[])
 {  
     char *source, *dest;
     wlImage pic;
+    FILE *file;
     
     /* Process options and reset argument pointer */
     check_options(argc, argv);
@@ -172,7 +180,13 @@ int main(int argc, char *argv[])
     dest = argv[1];
     
     /* Read the pic file */
-    pic = wlPicReadFile(source);
+    file = streamOpenInput(source);
+    if (!file)
+    {
+        die("Unable to open PIC file %s: %s\n", source, strerror(errno));
+    }
+    pic = wlPicReadStream(file);
+    streamCloseInput(file);
     if (!pic)
     {
         die("Unable to read PIC file %s: %s\n", source, strerror(errno));
@@ -4,7 +4,11 @@
  * See COPYING file for copying conditions
  */
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <getopt.h>
+#include <limits.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdarg.h>
@@ -15,6 +19,12 @@
 #include "../libwasteland/wasteland.h"
 #include "config.h"
 
+/** The size of the input copy buffer */
+#define BUFFER_SIZE 65536
+
+/** The maximum length of a huffman code. 0 for no limit */
+static int maxBits = 0;
+
 
 /**
  * Displays the usage text.
@@ -24,7 +34,12 @@ static void display_usage(void)
 {
     printf("Usage: wl_encodehuffman [OPTION]... <INPUT >OUTPUT\n");
     printf("Huffman-encodes data from STDIN and writes it to STDOUT.\n");
+    printf("\nThe input is mapped into memory if it is a regular file and is "
+            "copied into a\ntemporary file otherwise, so large inputs are "
+            "never buffered on the heap.\n");
     printf("\nOptions\n");
+    printf("  -l, --max-bits=BITS  Limits the length of the huffman codes to the\n");
+    printf("                       specified number of bits (1-31)\n");
     printf("  -h, --help           Display help and exit\n");
     printf("  -V, --version        Display version and exit\n");
     printf("\nReport bugs to %s <%s>\n", AUTHOR, EMAIL);
@@ -78,11 +93,13 @@ static void check_options(int argc, char *argv[])
     int index;
     static struct option options[]={
         {"help", 0, NULL, 'h'},
-        {"version", 0, NULL, 'V'}
+        {"version", 0, NULL, 'V'},
+        {"max-bits", 1, NULL, 'l'},
+        {NULL, 0, NULL, 0}
     };
     
     opterr = 0;
-    while((opt = getopt_long(argc, argv, "hV", options, &index)) != -1)
+    while((opt = getopt_long(argc, argv, "hVl:", options, &index)) != -1)
     {
         switch(opt) 
         {                
@@ -96,6 +113,12 @@ static void check_options(int argc, char *argv[])
                 exit(1);
                 break;
                 
+            case 'l':
+                maxBits = atoi(optarg);
+                if (maxBits < 1 || maxBits > 31)
+                    die("Invalid maximum code length: %s\n", optarg);
+                break;
+                
             default:
                 die("Unknown option: %s\nUse --help to show valid options.\n",
                         argv[optind - 1]);
@@ -106,60 +129,71 @@ static void check_options(int argc, char *argv[])
 
 
 /**
- * Reads all data from stdin and returns it as a byte array. Remember
- * to free this array when no longer needed.
- * 
- * @param stream
- *            The file stream to read the data from.
+ * Maps the input data into memory. If the input is not a regular file (A pipe
+ * for example) then it is copied into a temporary file first. The mapping
+ * is kept until the process exits. An empty input results in NULL.
+ *
+ * @param fd
+ *            The file descriptor of the input
  * @param size
- *            The array size is stored into this variable.
- * @return The read data as a byte array.
+ *            The size of the input data is stored into this variable
+ * @return The mapped input data
  */
- 
-static unsigned char *readData(FILE *stream, size_t *size)
+
+static unsigned char * mapData(int fd, size_t *size)
 {
-    unsigned char *result = NULL;
-    size_t offset = 0;
-    int bufferSize = 256;
-    size_t read;
-    unsigned char buffer[bufferSize];
-    
-    *size = 0;
-    while ((read = fread(buffer, 1, bufferSize, stream)) > 0)
+    struct stat st;
+    unsigned char buffer[BUFFER_SIZE];
+    unsigned char *data;
+    FILE *spill;
+    ssize_t read;
+    off_t offset;
+
+    // Spill non-regular input into a temporary file
+    if (fstat(fd, &st)) die("Unable to read input data: %s\n", strerror(errno));
+    offset = 0;
+    spill = NULL;
+    if (S_ISREG(st.st_mode))
     {
-        /* Create result array if not already done. */
-        if (!*size)
-        {
-            *size = read;
-            result = (unsigned char *) malloc(*size);
-        }
-        
-        /* or else enlarge the result array. */
-        else
+        offset = lseek(fd, 0, SEEK_CUR);
+        if (offset < 0) offset = 0;
+    }
+    else
+    {
+        spill = tmpfile();
+        if (!spill)
+            die("Unable to create temporary file: %s\n", strerror(errno));
+        while ((read = fread(buffer, 1, BUFFER_SIZE, stdin)) > 0)
         {
-            *size += read;
-            result = (unsigned char *) realloc(result, *size);
+            if (fwrite(buffer, 1, read, spill) != read)
+                die("Unable to write temporary file: %s\n", strerror(errno));
         }
-        
-        
-        /* Copy buffer into result array. */
-        memcpy(&result[offset], buffer, read);
-        
-        /** Remember current capacity as offset for writing next block. */
-        offset = *size;
+        if (ferror(stdin))
+            die("Unable to read input data: %s\n", strerror(errno));
+        if (fflush(spill))
+            die("Unable to write temporary file: %s\n", strerror(errno));
+        fd = fileno(spill);
+        if (fstat(fd, &st))
+            die("Unable to read temporary file: %s\n", strerror(errno));
     }
-    
-    /* Check for errors. */
-    if (ferror(stream))
-        die("Unable to read input data: %s\n", strerror(errno));
-        
-    /* Return the result array. */
-    return result;
+
+    // Map the data. The mapping stays valid after closing the file.
+    *size = st.st_size - offset;
+    data = NULL;
+    if (*size)
+    {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+            die("Unable to map input data: %s\n", strerror(errno));
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+    }
+    if (spill) fclose(spill);
+    return data ? data + offset : NULL;
 }
 
 
 /**
- * Main method
+ * Main method of wl_encodehuffman. Called by the wl multi-call program.
  *
  * @param argc
  *            The number of arguments
@@ -168,11 +202,12 @@ static unsigned char *readData(FILE *stream, size_t *size)
  * @return Exit value
  */
 
-int main(int argc, char *argv[])
+int encodehuffman_main(int argc, char *argv[])
 {  
     unsigned char *data;
     wlHuffmanNode *rootNode, **nodeIndex;
-    int i;
+    wlHuffmanEncoder encoder;
+    int usage[256];
     size_t size;
     unsigned char dataByte, dataMask;
     
@@ -184,25 +219,36 @@ int main(int argc, char *argv[])
     /* Terminate if wrong number of parameters are specified */
     if (argc != 0) die("Wrong number of parameters.\nUse --help to show syntax.\n");
 
-    /* Read data from stdin. */    
-    data = readData(stdin, &size);
+    /* Map data from stdin. */    
+    data = mapData(fileno(stdin), &size);
+    if (!size) die("No input data\n");
+    if (size > INT_MAX) die("Input data is too large\n");
+
+    /* First pass: Count the usage of every byte */
+    wlHistogram256(data, size, usage);
     
     /* Build huffman tree and write it to stdout */
-    rootNode = wlHuffmanBuildTree(data, size, &nodeIndex);
+    if (maxBits)
+        rootNode = wlHuffmanBuildLimitedTree(usage, maxBits, &nodeIndex);
+    else
+        rootNode = wlHuffmanBuildTreeFromUsage(usage, &nodeIndex);
+    if (!rootNode)
+        die("Too many different bytes for a maximum code length of %i\n",
+            maxBits);
     dataByte = 0;
     dataMask = 0;
     if (!wlHuffmanWriteNode(rootNode, stdout, &dataByte, &dataMask))
         die("Unable to write huffman root node\n");
-    for (i = 0; i < size; i++)
-        wlHuffmanWriteByte(data[i], stdout, nodeIndex, &dataByte, &dataMask);
 
-    /* Make sure last byte is written */
-    if (!wlFillByte(0, stdout, &dataByte, &dataMask)) return 0;
+    /* Second pass: Encode the data */
+    encoder = wlHuffmanEncoderCreate(nodeIndex, stdout, dataByte, dataMask);
+    if (!wlHuffmanEncodeBlock(encoder, data, size)
+        || !wlHuffmanEncoderFinish(encoder) || fflush(stdout))
+        die("Unable to write output data: %s\n", strerror(errno));
                
     /* Free stuff */ 
     wlHuffmanFreeNode(rootNode);
     free(nodeIndex);
-    free(data);
 
     /* Success */
     return 0;
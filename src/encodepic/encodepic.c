@@ -12,8 +12,12 @@
 #include <gd.h>
 #include <errno.h>
 #include "../libwasteland/wasteland.h"
+#include "../common/stream.h"
 #include "config.h"
 
+/** If colors which are not in the palette are dithered */
+static int dither = 0;
+
 
 /**
  * Displays the usage text.
@@ -23,9 +27,12 @@ static void display_usage(void)
 {
     printf("Usage: wl_encodepic [OPTION]... PNGFILE PICFILE\n");
     printf("Converts a PNG image file into a PIC image file.\n");
+    printf("Use - as PNGFILE to read from stdin and - as PICFILE to write to\n");
+    printf("stdout.\n");
     printf("\nThe PNG file can have any dimension and colors. It is "
             "automatically converted.\n");               
     printf("\nOptions\n");
+    printf("  -d, --dither        Dither colors which are not in the palette\n");
     printf("  -h, --help          Display help and exit\n");
     printf("  -V, --version       Display version and exit\n");
     printf("\nReport bugs to %s <%s>\n", AUTHOR, EMAIL);
@@ -78,15 +85,21 @@ static void check_options(int argc, char *argv[])
     char opt;
     int index;
     static struct option options[]={
+        {"dither", 0, NULL, 'd'},
         {"help", 0, NULL, 'h'},
-        {"version", 0, NULL, 'V'}
+        {"version", 0, NULL, 'V'},
+        {NULL, 0, NULL, 0}
     };
     
     opterr = 0;
-    while((opt = getopt_long(argc, argv, "hV", options, &index)) != -1)
+    while((opt = getopt_long(argc, argv, "dhV", options, &index)) != -1)
     {
         switch(opt) 
         {
+            case 'd':
+                dither = 1;
+                break;
+
             case 'V':
                 display_version();
                 exit(1);
@@ -103,55 +116,105 @@ static void check_options(int argc, char *argv[])
 }
 
 
+/**
+ * Converts the specified GD image into RGBA pixels (Four bytes per pixel) of
+ * the specified size. The image is only resampled if its size differs from
+ * the requested size. The returned buffer must be freed by the caller.
+ *
+ * @param image
+ *            The GD image
+ * @param width
+ *            The width of the RGBA pixels
+ * @param height
+ *            The height of the RGBA pixels
+ * @return The RGBA pixels
+ */
+
+static unsigned char * createRGBA(gdImagePtr image, int width, int height)
+{
+    gdImagePtr scaled;
+    unsigned char *rgba, *pixel;
+    int x, y, color, alpha;
+
+    // Resample the image to the requested size if needed
+    scaled = NULL;
+    if (gdImageSX(image) != width || gdImageSY(image) != height)
+    {
+        scaled = gdImageCreateTrueColor(width, height);
+        gdImageAlphaBlending(scaled, 0);
+        gdImageSaveAlpha(scaled, 1);
+        gdImageCopyResampled(scaled, image, 0, 0, 0, 0, width, height,
+                gdImageSX(image), gdImageSY(image));
+        image = scaled;
+    }
+
+    // Read the pixels directly from the pixel rows of the image
+    rgba = (unsigned char *) malloc(width * height * 4);
+    pixel = rgba;
+    for (y = 0; y < height; y++)
+    {
+        for (x = 0; x < width; x++, pixel += 4)
+        {
+            if (gdImageTrueColor(image))
+            {
+                color = gdImageTrueColorPixel(image, x, y);
+                alpha = gdTrueColorGetAlpha(color);
+            }
+            else
+            {
+                color = gdImagePalettePixel(image, x, y);
+                alpha = color == gdImageGetTransparent(image) ?
+                        gdAlphaTransparent : gdImageAlpha(image, color);
+            }
+            pixel[0] = gdImageRed(image, color);
+            pixel[1] = gdImageGreen(image, color);
+            pixel[2] = gdImageBlue(image, color);
+            pixel[3] = (gdAlphaMax - alpha) * 255 / gdAlphaMax;
+        }
+    }
+    if (scaled) gdImageDestroy(scaled);
+    return rgba;
+}
+
+
 /**
  * Writes the pic into the specified file in PNG format.
  * 
  * @param filename
- *            The output filename
+ *            The output filename or "-" for stdout
  * @param pic
  *            The wasteland pic
  */
 
 static void writePic(char *filename, gdImagePtr image)
 {
-    gdImagePtr output;
-    int x, y, i;
+    wlQuantizer quantizer;
+    unsigned char *rgba;
     wlImage pic;
+    FILE *file;
     
-    /* Create a temporary second image for palette conversion */
-    output = gdImageCreate(288, 128);
-    for (i = 0; i < 16; i++)
-    {
-        gdImageColorAllocate(output, wlPalette[i].red,
-                wlPalette[i].green, wlPalette[i].blue);
-    }
-    for (i = 16; i < 256; i++) gdImageColorAllocate(output, 0, 0, 0);
-    gdImageCopyResampled(output, image, 0, 0, 0, 0, 288, 128, gdImageSX(image),
-            gdImageSY(image));
-    
-    /* Create the pic */
+    /* Map the pixels onto the palette */
+    rgba = createRGBA(image, 288, 128);
     pic = wlImageCreate(288, 128);
+    quantizer = wlQuantizerCreate(NULL);
+    wlQuantizerMap(quantizer, rgba, 0, pic, -1, dither);
     
-    /* Copy pixels from image to pic */
-    for (y = 0; y < pic->height; y++)       
+    /* Write the pic file */
+    file = streamOpenOutput(filename);
+    if (!file || !wlPicWriteStream(pic, file) || !streamCloseOutput(file))
     {
-        for (x = 0; x < pic->width; x++)
-        {
-            pic->pixels[y * pic->width + x] = gdImageGetPixel(output, x, y);
-        }
+        die("Unable to write PIC to %s: %s\n", filename, strerror(errno));
     }
-    
-    /* Write the pic file */
-    wlPicWriteFile(pic, filename);
 
     /* Free resources */
+    wlQuantizerFree(quantizer);
     wlImageFree(pic);
-    gdImageDestroy(output);
+    free(rgba);
 }
 
 
 /**
- * Main method
+ * Main method of wl_encodepic. Called by the wl multi-call program.
  *
  * @param argc
  *            The number of arguments
@@ -160,7 +223,7 @@ static void writePic(char *filename, gdImagePtr image)
  * @return Exit value
  */
 
-int main(int argc, char *argv[])
+int encodepic_main(int argc, char *argv[])
 {  
     char *source, *dest;
     gdImagePtr image;
@@ -179,13 +242,13 @@ int main(int argc, char *argv[])
     dest = argv[1];
     
     /* Read the PNG file */
-    file = fopen(source, "rb");
+    file = streamOpenInput(source);
     if (!file)
     {
         die("Unable to read PNG file %s: %s\n", source, strerror(errno));
     }
     image = gdImageCreateFromPng(file);
-    fclose(file);
+    streamCloseInput(file);
     
     /* Write the PIC file */
     writePic(dest, image);
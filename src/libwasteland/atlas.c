@@ -0,0 +1,394 @@
+/*
+ * $Id$
+ * Copyright (C) 2007  Klaus Reimer <k@ailis.de>
+ * See COPYING file for copying conditions
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include "wasteland.h"
+
+
+/**
+ * Builds an atlas from a list of images. See wlAtlasBuild() for details.
+ *
+ * @param images
+ *            The images
+ * @param quantity
+ *            The number of images
+ * @param columns
+ *            The number of columns. 0 to create a roughly square atlas
+ * @param dedupe
+ *            1 to store identical images only once, 0 to store every image
+ * @return The atlas
+ */
+
+static wlAtlas build(wlImage *images, int quantity, int columns, int dedupe)
+{
+    wlAtlas atlas;
+    wlImage image;
+    wlTileIndex index;
+    int *cells, *owners;
+    int i, y, unique, cellWidth, cellHeight, rows, cell;
+
+    atlas = malloc(sizeof(wlAtlasStruct));
+    atlas->quantity = quantity;
+    atlas->rects = malloc(sizeof(wlRectStruct) * (quantity ? quantity : 1));
+    atlas->tilesets = 0;
+    atlas->offsets = NULL;
+
+    // Assign a cell to each image. When deduplicating then identical images
+    // are found through a tile index and share one cell.
+    cells = malloc(sizeof(int) * (quantity ? quantity : 1));
+    owners = malloc(sizeof(int) * (quantity ? quantity : 1));
+    index = dedupe ? wlTileIndexCreate() : NULL;
+    unique = 0;
+    cellWidth = 1;
+    cellHeight = 1;
+    for (i = 0; i < quantity; i++)
+    {
+        image = images[i];
+        if (image->width > cellWidth) cellWidth = image->width;
+        if (image->height > cellHeight) cellHeight = image->height;
+        if (index && (cell = wlTileIndexAdd(index, image)) < unique)
+        {
+            cells[i] = cell;
+            continue;
+        }
+        owners[unique] = i;
+        cells[i] = unique++;
+    }
+    if (index) wlTileIndexFree(index);
+    atlas->unique = unique;
+
+    // Arrange the cells in a grid and copy the images into it. Unused
+    // pixels are transparent.
+    if (columns <= 0)
+    {
+        columns = 1;
+        while (columns * columns < unique) columns++;
+    }
+    if (columns > unique) columns = unique;
+    if (columns < 1) columns = 1;
+    rows = (unique + columns - 1) / columns;
+    if (rows < 1) rows = 1;
+    atlas->columns = columns;
+    atlas->image = wlImageCreate(columns * cellWidth, rows * cellHeight);
+    memset(atlas->image->pixels, 16,
+        atlas->image->width * atlas->image->height);
+    for (cell = 0; cell < unique; cell++)
+    {
+        image = images[owners[cell]];
+        for (y = 0; y < image->height; y++)
+        {
+            memcpy(&atlas->image->pixels[((cell / columns) * cellHeight + y)
+                * atlas->image->width + (cell % columns) * cellWidth],
+                &image->pixels[y * image->width], image->width);
+        }
+    }
+    for (i = 0; i < quantity; i++)
+    {
+        atlas->rects[i].x = (cells[i] % columns) * cellWidth;
+        atlas->rects[i].y = (cells[i] / columns) * cellHeight;
+        atlas->rects[i].width = images[i]->width;
+        atlas->rects[i].height = images[i]->height;
+    }
+    free(cells);
+    free(owners);
+    return atlas;
+}
+
+
+/**
+ * Packs all the specified images into a single atlas image. The images are
+ * arranged in a grid with cells as large as the largest image. Pixels
+ * not covered by an image are transparent (16). The position of each
+ * image can be looked up in constant time with wlAtlasGetRect(). If
+ * deduplication is enabled then identical images are stored only once
+ * and share the same rectangle. You have to free the atlas with
+ * wlAtlasFree() when you no longer need it.
+ *
+ * @param images
+ *            The images to pack
+ * @param columns
+ *            The number of grid columns. 0 to create a roughly square atlas
+ * @param dedupe
+ *            1 to store identical images only once, 0 to store every image
+ * @return The atlas
+ */
+
+wlAtlas wlAtlasBuild(wlImages images, int columns, int dedupe)
+{
+    assert(images != NULL);
+    return build(images->images, images->quantity, columns, dedupe);
+}
+
+
+/**
+ * Packs all tiles of all the specified tilesets into a single atlas image.
+ * The tiles are numbered continuously over all tilesets. Use
+ * wlAtlasGetTileRect() to look up a tile by tileset and tile index. See
+ * wlAtlasBuild() for details.
+ *
+ * @param tilesets
+ *            The tilesets to pack
+ * @param columns
+ *            The number of grid columns. 0 to create a roughly square atlas
+ * @param dedupe
+ *            1 to store identical tiles only once, 0 to store every tile
+ * @return The atlas
+ */
+
+wlAtlas wlAtlasBuildTilesets(wlTilesets tilesets, int columns, int dedupe)
+{
+    wlAtlas atlas;
+    wlImage *images;
+    wlImages tiles;
+    int i, j, quantity, *offsets;
+
+    assert(tilesets != NULL);
+    offsets = malloc(sizeof(int) * (tilesets->quantity + 1));
+    quantity = 0;
+    for (i = 0; i < tilesets->quantity; i++)
+    {
+        offsets[i] = quantity;
+        quantity += tilesets->tilesets[i]->quantity;
+    }
+    offsets[i] = quantity;
+    images = malloc(sizeof(wlImage) * (quantity ? quantity : 1));
+    for (i = 0; i < tilesets->quantity; i++)
+    {
+        tiles = tilesets->tilesets[i];
+        for (j = 0; j < tiles->quantity; j++)
+            images[offsets[i] + j] = tiles->images[j];
+    }
+    atlas = build(images, quantity, columns, dedupe);
+    atlas->tilesets = tilesets->quantity;
+    atlas->offsets = offsets;
+    free(images);
+    return atlas;
+}
+
+
+/**
+ * Releases all the memory allocated for the specified atlas.
+ *
+ * @param atlas
+ *            The atlas to free
+ */
+
+void wlAtlasFree(wlAtlas atlas)
+{
+    assert(atlas != NULL);
+    wlImageFree(atlas->image);
+    free(atlas->rects);
+    free(atlas->offsets);
+    free(atlas);
+}
+
+
+/**
+ * Returns the rectangle of the specified image within the atlas image.
+ *
+ * @param atlas
+ *            The atlas
+ * @param index
+ *            The image index
+ * @return The rectangle. It is owned by the atlas
+ */
+
+wlRect wlAtlasGetRect(wlAtlas atlas, int index)
+{
+    assert(atlas != NULL);
+    assert(index >= 0 && index < atlas->quantity);
+    return &atlas->rects[index];
+}
+
+
+/**
+ * Returns the rectangle of the specified tile within the atlas image. The
+ * atlas must have been built with wlAtlasBuildTilesets().
+ *
+ * @param atlas
+ *            The atlas
+ * @param tileset
+ *            The tileset index
+ * @param tile
+ *            The tile index within the tileset
+ * @return The rectangle. It is owned by the atlas
+ */
+
+wlRect wlAtlasGetTileRect(wlAtlas atlas, int tileset, int tile)
+{
+    assert(atlas != NULL);
+    assert(tileset >= 0 && tileset < atlas->tilesets);
+    assert(tile >= 0 && atlas->offsets[tileset] + tile
+        < atlas->offsets[tileset + 1]);
+    return &atlas->rects[atlas->offsets[tileset] + tile];
+}
+
+
+/**
+ * Writes the coordinate table of the specified atlas to the specified file
+ * in JSON format. See wlAtlasWriteJsonStream() for details.
+ *
+ * @param atlas
+ *            The atlas
+ * @param filename
+ *            The filename of the JSON file to write
+ * @param imageName
+ *            The filename of the atlas image to reference in the table
+ * @param scale
+ *            The factor by which the atlas image was scaled
+ * @return 1 on success, 0 on failure
+ */
+
+int wlAtlasWriteJsonFile(wlAtlas atlas, char *filename, char *imageName,
+    int scale)
+{
+    FILE *file;
+    int result;
+
+    assert(atlas != NULL);
+    assert(filename != NULL);
+    file = fopen(filename, "wt");
+    if (!file) return 0;
+    result = wlAtlasWriteJsonStream(atlas, file, imageName, scale);
+    if (fclose(file)) result = 0;
+    return result;
+}
+
+
+/**
+ * Writes the coordinate table of the specified atlas to the specified
+ * stream in JSON format. The table contains the name and the size of the
+ * atlas image, an "images" array with the rectangle of each image and
+ * (When built from tilesets) a "tilesets" array with the index of the
+ * first image of each tileset. All coordinates are multiplied with the
+ * scale factor.
+ *
+ * @param atlas
+ *            The atlas
+ * @param stream
+ *            The stream to write the table to
+ * @param imageName
+ *            The filename of the atlas image to reference in the table
+ * @param scale
+ *            The factor by which the atlas image was scaled
+ * @return 1 on success, 0 on failure
+ */
+
+int wlAtlasWriteJsonStream(wlAtlas atlas, FILE *stream, char *imageName,
+    int scale)
+{
+    wlRect rect;
+    char *c;
+    int i;
+
+    assert(atlas != NULL);
+    assert(stream != NULL);
+    assert(imageName != NULL);
+    assert(scale > 0);
+    fprintf(stream, "{\n  \"image\": \"");
+    for (c = imageName; *c; c++)
+    {
+        if (*c == '"' || *c == '\\') fputc('\\', stream);
+        fputc(*c, stream);
+    }
+    fprintf(stream, "\",\n  \"width\": %i,\n  \"height\": %i,\n",
+        atlas->image->width * scale, atlas->image->height * scale);
+    fprintf(stream, "  \"images\": [");
+    for (i = 0; i < atlas->quantity; i++)
+    {
+        rect = &atlas->rects[i];
+        fprintf(stream, "%s\n    { \"x\": %i, \"y\": %i, \"width\": %i, "
+            "\"height\": %i }", i ? "," : "", rect->x * scale,
+            rect->y * scale, rect->width * scale, rect->height * scale);
+    }
+    fprintf(stream, "\n  ]");
+    if (atlas->offsets)
+    {
+        fprintf(stream, ",\n  \"tilesets\": [");
+        for (i = 0; i < atlas->tilesets; i++)
+            fprintf(stream, "%s %i", i ? "," : "", atlas->offsets[i]);
+        fprintf(stream, " ]");
+    }
+    fprintf(stream, "\n}\n");
+    return !ferror(stream);
+}
+
+
+/**
+ * Writes the coordinate table of the specified atlas to the specified file
+ * in binary format. See wlAtlasWriteTableStream() for details.
+ *
+ * @param atlas
+ *            The atlas
+ * @param filename
+ *            The filename of the table file to write
+ * @param scale
+ *            The factor by which the atlas image was scaled
+ * @return 1 on success, 0 on failure
+ */
+
+int wlAtlasWriteTableFile(wlAtlas atlas, char *filename, int scale)
+{
+    FILE *file;
+    int result;
+
+    assert(atlas != NULL);
+    assert(filename != NULL);
+    file = fopen(filename, "wb");
+    if (!file) return 0;
+    result = wlAtlasWriteTableStream(atlas, file, scale);
+    if (fclose(file)) result = 0;
+    return result;
+}
+
+
+/**
+ * Writes the coordinate table of the specified atlas to the specified
+ * stream in binary format. All values are 32 bit little endian integers:
+ * The number of images, the number of tilesets, the width and the height
+ * of the atlas image, then x, y, width and height of each image and
+ * finally the index of the first image of each tileset. All coordinates
+ * are multiplied with the scale factor.
+ *
+ * @param atlas
+ *            The atlas
+ * @param stream
+ *            The stream to write the table to
+ * @param scale
+ *            The factor by which the atlas image was scaled
+ * @return 1 on success, 0 on failure
+ */
+
+int wlAtlasWriteTableStream(wlAtlas atlas, FILE *stream, int scale)
+{
+    wlRect rect;
+    int i;
+
+    assert(atlas != NULL);
+    assert(stream != NULL);
+    assert(scale > 0);
+    if (!wlWriteDWord(atlas->quantity, stream)) return 0;
+    if (!wlWriteDWord(atlas->tilesets, stream)) return 0;
+    if (!wlWriteDWord(atlas->image->width * scale, stream)) return 0;
+    if (!wlWriteDWord(atlas->image->height * scale, stream)) return 0;
+    for (i = 0; i < atlas->quantity; i++)
+    {
+        rect = &atlas->rects[i];
+        if (!wlWriteDWord(rect->x * scale, stream)) return 0;
+        if (!wlWriteDWord(rect->y * scale, stream)) return 0;
+        if (!wlWriteDWord(rect->width * scale, stream)) return 0;
+        if (!wlWriteDWord(rect->height * scale, stream)) return 0;
+    }
+    for (i = 0; i < atlas->tilesets; i++)
+    {
+        if (!wlWriteDWord(atlas->offsets[i], stream)) return 0;
+    }
+    return 1;
+}
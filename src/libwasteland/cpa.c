@@ -66,29 +66,37 @@ void wlCpaFree(wlCpaAnimation *animation)
 
 
 /**
- * Applies a single CPA animation frame on the specified image.
+ * Applies a single CPA animation frame on the specified image. If a
+ * rectangle is specified then it is set to the bounding box of all pixels
+ * touched by the frame so callers can limit further processing to this
+ * area. The bounding box is empty (width and height are 0) if the frame has
+ * no updates.
  *
  * @param image
  *           The image where you want the frame to apply
  * @param frame
  *           The CPA animation frame to apply
+ * @param dirty
+ *           Receives the changed area. NULL if not needed.
  */
 
-void wlCpaApplyFrame(wlImage image, wlCpaFrame *frame)
+void wlCpaApplyFrame(wlImage image, wlCpaFrame *frame, wlRect dirty)
 {
-    int i, x;
+    int i, x, offset;
     wlCpaUpdate *update;
 
     assert(image != NULL);
     assert(frame != NULL);
+    if (dirty) wlRectClear(dirty);
     for (i = 0; i < frame->quantity; i++)
     {
         update = frame->updates[i];
+        offset = update->y * image->width + update->x;
         for (x = 0; x < 8; x++)
         {
-            image->pixels[update->y * image->width + update->x + x] =
-                update->pixels[x];
+            image->pixels[offset + x] = update->pixels[x];
         }
+        if (dirty) wlRectAddRun(dirty, image, offset, 8);
     }
 }
 
@@ -134,9 +142,11 @@ wlCpaAnimation * wlCpaReadFile(char *filename)
 wlCpaAnimation * wlCpaReadStream(FILE *stream)
 {
     wlCpaAnimation *animation;
-    int x, y, w, h;
-    int b;
+    int x;
     unsigned char dataByte, dataMask;
+    unsigned char packed[4];
+    u_int16_t word;
+    wlHuffmanDecoder decoder;
     wlHuffmanNode *rootNode;
     wlCpaFrame *frame;
     wlCpaUpdate *update;
@@ -158,33 +168,25 @@ wlCpaAnimation * wlCpaReadStream(FILE *stream)
     // Initialize huffman stream
     dataByte = 0;
     dataMask = 0;
-    if (!(rootNode = wlHuffmanReadNode(stream, &dataByte, &dataMask)))
+    if (!(decoder = wlHuffmanCacheRead(stream, WL_HUFFMAN_TREE, &dataByte,
+        &dataMask)))
         return NULL;
+    rootNode = decoder->rootNode;
 
     // Create the animation container
     animation = wlCpaCreate(288, 128);
 
     // Read pixels from huffman stream
-    w = animation->baseFrame->width;
-    h = animation->baseFrame->height;
-    for (y = 0; y < h; y++)
+    if (!wlImageDecodeHuffman(animation->baseFrame, stream, rootNode,
+        &dataByte, &dataMask))
     {
-        for (x = 0; x < w; x+= 2)
-        {
-            b = wlHuffmanReadByte(stream, rootNode, &dataByte, &dataMask);
-            if (b == -1)
-            {
-                wlHuffmanFreeNode(rootNode);
-                wlCpaFree(animation);
-                return NULL;
-            }
-            animation->baseFrame->pixels[y * w + x] = b >> 4;
-            animation->baseFrame->pixels[y * w + x + 1] = b & 0x0f;
-        }
+        wlHuffmanCacheRelease(decoder);
+        wlCpaFree(animation);
+        return NULL;
     }
 
     // Release resources
-    wlHuffmanFreeNode(rootNode);
+    wlHuffmanCacheRelease(decoder);
 
     // Decode baseframe (VXOR)
     wlImageVXorDecode(animation->baseFrame);
@@ -207,16 +209,19 @@ wlCpaAnimation * wlCpaReadStream(FILE *stream)
     // Initialize huffman stream
     dataByte = 0;
     dataMask = 0;
-    if (!(rootNode = wlHuffmanReadNode(stream, &dataByte, &dataMask)))
+    if (!(decoder = wlHuffmanCacheRead(stream, WL_HUFFMAN_TREE, &dataByte,
+        &dataMask)))
     {
         wlCpaFree(animation);
         return NULL;
     }
+    rootNode = decoder->rootNode;
 
     // Skip the animation data size
-    if (wlHuffmanReadWord(stream, rootNode, &dataByte, &dataMask) == -1)
+    if (!wlHuffmanDecodeWords(stream, &word, 1, rootNode, &dataByte,
+        &dataMask))
     {
-        wlHuffmanFreeNode(rootNode);
+        wlHuffmanCacheRelease(decoder);
         wlCpaFree(animation);
         return NULL;
     }
@@ -226,13 +231,14 @@ wlCpaAnimation * wlCpaReadStream(FILE *stream)
     {
         // Read delay value. If it's 0xffff then we reached the end of the
         // animation data
-        delay = wlHuffmanReadWord(stream, rootNode, &dataByte, &dataMask);
-        if (delay == -1)
+        if (!wlHuffmanDecodeWords(stream, &word, 1, rootNode, &dataByte,
+            &dataMask))
         {
-            wlHuffmanFreeNode(rootNode);
+            wlHuffmanCacheRelease(decoder);
             wlCpaFree(animation);
             return NULL;
         }
+        delay = word;
         if (delay == 0xffff) break;
 
         // Read animation frame
@@ -248,30 +254,32 @@ wlCpaAnimation * wlCpaReadStream(FILE *stream)
         // Read animation frame update block until an offset of 0 has been read
         while (1)
         {
-            offset = wlHuffmanReadWord(stream, rootNode, &dataByte, &dataMask);
-            if (offset == -1)
+            if (!wlHuffmanDecodeWords(stream, &word, 1, rootNode, &dataByte,
+                &dataMask))
             {
-                wlHuffmanFreeNode(rootNode);
+                wlHuffmanCacheRelease(decoder);
                 wlCpaFree(animation);
                 return NULL;
             }
+            offset = word;
             if (offset == 0xffff) break;
 
             // Read the update sequence
             update = (wlCpaUpdate *) malloc(sizeof(wlCpaUpdate));
             update->x = offset * 8 % 320;
             update->y = offset * 8 / 320;
+            if (wlHuffmanDecodeBlock(stream, packed, 4, rootNode, &dataByte,
+                &dataMask) < 4)
+            {
+                free(update);
+                wlHuffmanCacheRelease(decoder);
+                wlCpaFree(animation);
+                return NULL;
+            }
             for (x = 0; x < 8; x += 2)
             {
-                b = wlHuffmanReadByte(stream, rootNode, &dataByte, &dataMask);
-                if (b == -1)
-                {
-                    wlHuffmanFreeNode(rootNode);
-                    wlCpaFree(animation);
-                    return NULL;
-                }
-                update->pixels[x] = b >> 4;
-                update->pixels[x + 1] = b & 0x0f;
+                update->pixels[x] = packed[x / 2] >> 4;
+                update->pixels[x + 1] = packed[x / 2] & 0x0f;
             }
             frame->quantity++;
             frame->updates = (wlCpaUpdate **) realloc(frame->updates,
@@ -281,7 +289,7 @@ wlCpaAnimation * wlCpaReadStream(FILE *stream)
     }
 
     // Release resources
-    wlHuffmanFreeNode(rootNode);
+    wlHuffmanCacheRelease(decoder);
 
     return animation;
 }
@@ -387,11 +395,12 @@ static unsigned char * buildAnimationData(wlCpaAnimation *animation, int *size)
 
 int wlCpaWriteStream(wlCpaAnimation *animation, FILE *stream)
 {
-    int x, y, i, size;
+    int x, y, size, result;
     wlPixel encodedPixels[288 * 128];
     unsigned char *data;
     wlHuffmanNode *rootNode;
     wlHuffmanNode **nodeIndex;
+    wlHuffmanEncoder encoder;
     unsigned char dataByte, dataMask;
 
     assert(animation != NULL);
@@ -405,7 +414,7 @@ int wlCpaWriteStream(wlCpaAnimation *animation, FILE *stream)
     if (fputc(0, stream) == EOF) return 0;
 
     // Encode the pixels of the base frame
-    memcpy(encodedPixels, animation->baseFrame, sizeof(wlPixel) * 288 * 128);
+    memcpy(encodedPixels, animation->baseFrame->pixels, sizeof(wlPixel) * 288 * 128);
     wlVXorEncode(encodedPixels, 288, 128);
 
     // Write encoded pixels to data block
@@ -425,20 +434,16 @@ int wlCpaWriteStream(wlCpaAnimation *animation, FILE *stream)
     dataMask = 0;
     if (!wlHuffmanWriteNode(rootNode, stream, &dataByte, &dataMask)) return 0;
 
-    // Write encoded pixel data
-    for (i = 0; i < 288 * 128 / 2; i++)
-    {
-        if (!wlHuffmanWriteByte(data[i], stream, nodeIndex, &dataByte,
-                &dataMask)) return 0;
-    }
+    // Write encoded pixel data and make sure the last byte is written
+    encoder = wlHuffmanEncoderCreate(nodeIndex, stream, dataByte, dataMask);
+    result = wlHuffmanEncodeBlock(encoder, data, 288 * 128 / 2);
+    if (!wlHuffmanEncoderFinish(encoder)) result = 0;
 
     // Release the huffman tree and the node index and the base frame data
     wlHuffmanFreeNode(rootNode);
     free(nodeIndex);
     free(data);
-
-    // Make sure last byte is written
-    if (!wlFillByte(0, stream, &dataByte, &dataMask)) return 0;
+    if (!result) return 0;
 
     // Encode the animation data
     data = buildAnimationData(animation, &size);
@@ -458,20 +463,16 @@ int wlCpaWriteStream(wlCpaAnimation *animation, FILE *stream)
     dataMask = 0;
     if (!wlHuffmanWriteNode(rootNode, stream, &dataByte, &dataMask)) return 0;
 
-    // Write encoded animation data
-    for (i = 0; i < size; i++)
-    {
-        if (!wlHuffmanWriteByte(data[i], stream, nodeIndex, &dataByte,
-                &dataMask)) return 0;
-    }
+    // Write encoded animation data and make sure the last byte is written
+    encoder = wlHuffmanEncoderCreate(nodeIndex, stream, dataByte, dataMask);
+    result = wlHuffmanEncodeBlock(encoder, data, size);
+    if (!wlHuffmanEncoderFinish(encoder)) result = 0;
 
     // Release the huffman tree and the node index and the animation data
     wlHuffmanFreeNode(rootNode);
     free(nodeIndex);
     free(data);
-
-    // Make sure last byte is written
-    if (!wlFillByte(0, stream, &dataByte, &dataMask)) return 0;
+    if (!result) return 0;
 
     // Report success
     return 1;
@@ -89,6 +89,7 @@ wlImages wlCursorsReadStream(FILE *stream)
     for (cursor = 0; cursor < cursors->quantity; cursor++)
     {
         image = cursors->images[cursor];
+        memset(image->pixels, 0, image->width * image->height);
         
         for (bit = 0; bit < 4; bit++)
         {
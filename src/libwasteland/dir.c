@@ -0,0 +1,568 @@
+/*
+ * $Id$
+ * Copyright (C) 2007  Klaus Reimer <k@ailis.de>
+ * See COPYING file for copying conditions
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include "../common/list.h"
+#include "wasteland.h"
+
+/** The size of a tar block */
+#define BLOCK_SIZE 512
+
+
+/**
+ * Writes an octal number into a tar header field. The field is terminated
+ * with a null byte.
+ *
+ * @param field
+ *            The header field
+ * @param size
+ *            The size of the field
+ * @param value
+ *            The value to write
+ */
+
+static void putOctal(char *field, int size, unsigned long value)
+{
+    int i;
+
+    field[size - 1] = 0;
+    for (i = size - 2; i >= 0; i--)
+    {
+        field[i] = '0' + (value & 7);
+        value >>= 3;
+    }
+}
+
+
+/**
+ * Returns the position at which the specified entry name must be split
+ * into the ustar prefix field (155 bytes) and the name field (100 bytes).
+ * The name is split at a slash which is not written.
+ *
+ * @param name
+ *            The entry name
+ * @return The position of the slash, 0 if the name fits into the name
+ *         field or -1 if the name is too long for a ustar header
+ */
+
+static int splitName(char *name)
+{
+    int length, i;
+
+    length = strlen(name);
+    if (length <= 100) return 0;
+    for (i = length - 101; i <= 155 && i < length - 1; i++)
+        if (i > 0 && name[i] == '/') return i;
+    return -1;
+}
+
+
+/**
+ * Writes a tar header block into the tar stream of the directory. Long
+ * names are split into the prefix and the name field (See splitName()).
+ *
+ * @param dir
+ *            The directory
+ * @param name
+ *            The entry name
+ * @param type
+ *            The entry type ('0' for files, '5' for directories)
+ * @param size
+ *            The size of the entry data
+ * @return 1 on success, 0 on failure
+ */
+
+static int writeHeader(wlDir dir, char *name, char type, size_t size)
+{
+    unsigned char header[BLOCK_SIZE];
+    unsigned int checksum;
+    int i, split;
+
+    if ((split = splitName(name)) < 0)
+    {
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+    memset(header, 0, BLOCK_SIZE);
+    if (split)
+    {
+        memcpy(header + 345, name, split);
+        name += split + 1;
+    }
+    memcpy(header, name, strlen(name));
+    putOctal((char *) header + 100, 8, type == '5' ? 0755 : 0644);
+    putOctal((char *) header + 108, 8, 0);
+    putOctal((char *) header + 116, 8, 0);
+    putOctal((char *) header + 124, 12, size);
+    putOctal((char *) header + 136, 12, 0);
+    memset(header + 148, ' ', 8);
+    header[156] = type;
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+    checksum = 0;
+    for (i = 0; i < BLOCK_SIZE; i++) checksum += header[i];
+    putOctal((char *) header + 148, 7, checksum);
+    return fwrite(header, BLOCK_SIZE, 1, dir->tar) == 1;
+}
+
+
+/**
+ * Parses an octal number from a tar header field.
+ *
+ * @param field
+ *            The header field
+ * @param size
+ *            The size of the field
+ * @return The value
+ */
+
+static unsigned long getOctal(unsigned char *field, int size)
+{
+    unsigned long value;
+    int i;
+
+    value = 0;
+    for (i = 0; i < size && field[i] == ' '; i++);
+    for (; i < size && field[i] >= '0' && field[i] <= '7'; i++)
+        value = (value << 3) | (field[i] - '0');
+    return value;
+}
+
+
+/**
+ * Reads all file entries of the tar stream of the directory into memory.
+ *
+ * @param dir
+ *            The directory
+ * @return 1 on success, 0 on failure
+ */
+
+static int readTar(wlDir dir)
+{
+    unsigned char header[BLOCK_SIZE];
+    wlDirEntry entry;
+    size_t size, padded;
+    char *name, *data;
+    int i;
+
+    while (fread(header, BLOCK_SIZE, 1, dir->tar) == 1)
+    {
+        // Two zero blocks terminate the archive. One is enough for us.
+        for (i = 0; i < BLOCK_SIZE && !header[i]; i++);
+        if (i == BLOCK_SIZE) return 1;
+
+        size = getOctal(header + 124, 12);
+        padded = (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        data = malloc(padded ? padded : 1);
+        if (padded && fread(data, padded, 1, dir->tar) != 1)
+        {
+            free(data);
+            errno = EIO;
+            return 0;
+        }
+
+        // Only regular files are used. Directories and extended headers
+        // are skipped.
+        if (header[156] != '0' && header[156] != 0)
+        {
+            free(data);
+            continue;
+        }
+        // Prefix (155), separator (1), name (100) and terminator (1)
+        name = malloc(257);
+        if (header[345])
+        {
+            snprintf(name, 257, "%.155s/%.100s", header + 345, header);
+        }
+        else
+        {
+            snprintf(name, 257, "%.100s", header);
+        }
+        if (!strncmp(name, "./", 2)) memmove(name, name + 2, strlen(name) - 1);
+        entry = malloc(sizeof(wlDirEntryStruct));
+        entry->name = name;
+        entry->data = data;
+        entry->size = size;
+        entry->stream = NULL;
+        listAdd(dir->entries, entry, &dir->quantity);
+    }
+
+    // An archive without end blocks is accepted, too
+    if (ferror(dir->tar))
+    {
+        errno = EIO;
+        return 0;
+    }
+    return 1;
+}
+
+
+/**
+ * Opens a directory for reading or writing files. If the path is "-" then
+ * the files are read from a tar archive on stdin or are written as a tar
+ * archive to stdout. This allows the tools to be chained through pipes.
+ * Otherwise the path must be an existing directory. The files are accessed
+ * relative to a directory file descriptor so the working directory of the
+ * process is never changed.
+ *
+ * When reading a tar archive then the whole archive is read into memory
+ * by this function. You have to close the directory with wlDirClose() when
+ * you no longer need it. If the directory can't be opened then NULL is
+ * returned and errno is set.
+ *
+ * @param path
+ *            The directory path or "-" for a tar archive on stdin/stdout
+ * @param write
+ *            1 to write files, 0 to read files
+ * @return The directory or NULL if it could not be opened
+ */
+
+wlDir wlDirOpen(char *path, int write)
+{
+    wlDir dir;
+
+    assert(path != NULL);
+    dir = malloc(sizeof(wlDirStruct));
+    dir->write = write;
+    dir->fd = -1;
+    dir->tar = NULL;
+    listCreate(dir->entries, &dir->quantity);
+    if (!strcmp(path, "-"))
+    {
+        dir->tar = write ? stdout : stdin;
+        if (!write && !readTar(dir))
+        {
+            wlDirClose(dir);
+            return NULL;
+        }
+    }
+    else
+    {
+        dir->fd = open(path, O_RDONLY | O_DIRECTORY);
+        if (dir->fd < 0)
+        {
+            listFree(dir->entries);
+            free(dir);
+            return NULL;
+        }
+    }
+    return dir;
+}
+
+
+/**
+ * Closes the specified directory. When writing a tar archive then the
+ * end of the archive is written and the stream is flushed.
+ *
+ * @param dir
+ *            The directory to close
+ * @return 1 on success, 0 on failure
+ */
+
+int wlDirClose(wlDir dir)
+{
+    char end[BLOCK_SIZE * 2];
+    int result, i;
+
+    assert(dir != NULL);
+    result = 1;
+    if (dir->tar && dir->write)
+    {
+        memset(end, 0, sizeof(end));
+        if (fwrite(end, sizeof(end), 1, dir->tar) != 1) result = 0;
+        if (fflush(dir->tar)) result = 0;
+    }
+    if (dir->fd >= 0 && close(dir->fd)) result = 0;
+    for (i = 0; i < dir->quantity; i++)
+    {
+        if (dir->entries[i]->stream) fclose(dir->entries[i]->stream);
+        free(dir->entries[i]->name);
+        free(dir->entries[i]->data);
+        free(dir->entries[i]);
+    }
+    listFree(dir->entries);
+    free(dir);
+    return result;
+}
+
+
+/**
+ * Used by qsort for sorting filenames.
+ */
+
+static int sortFilenames(const void *p1, const void *p2)
+{
+    return strcmp(* (char * const *) p1, * (char * const *) p2);
+}
+
+
+/**
+ * Returns the alphabetically sorted names of all files in the specified
+ * directory which end with the specified suffix (Case is ignored). Files
+ * in sub directories are not listed. You have to free the list and the
+ * names with listFreeWithItems() when you no longer need them.
+ *
+ * @param dir
+ *            The directory
+ * @param suffix
+ *            The filename suffix (For example ".png")
+ * @param quantity
+ *            Storage for the number of returned names
+ * @return The list of names
+ */
+
+char ** wlDirList(wlDir dir, char *suffix, int *quantity)
+{
+    DIR *handle;
+    struct dirent *entry;
+    char **names;
+    char *name;
+    int i, fd;
+
+    assert(dir != NULL);
+    assert(suffix != NULL);
+    assert(quantity != NULL);
+    listCreate(names, quantity);
+    if (dir->tar)
+    {
+        for (i = 0; i < dir->quantity; i++)
+        {
+            name = dir->entries[i]->name;
+            if (strchr(name, '/') || strlen(name) < strlen(suffix)
+                || strcasecmp(name + strlen(name) - strlen(suffix), suffix))
+                continue;
+            listAdd(names, strdup(name), quantity);
+        }
+    }
+    else
+    {
+        fd = dup(dir->fd);
+        handle = fd < 0 ? NULL : fdopendir(fd);
+        if (!handle)
+        {
+            if (fd >= 0) close(fd);
+            return names;
+        }
+        rewinddir(handle);
+        while ((entry = readdir(handle)))
+        {
+            name = entry->d_name;
+            if (strlen(name) < strlen(suffix)
+                || strcasecmp(name + strlen(name) - strlen(suffix), suffix))
+                continue;
+            listAdd(names, strdup(name), quantity);
+        }
+        closedir(handle);
+    }
+    qsort(names, *quantity, sizeof(char *), sortFilenames);
+    return names;
+}
+
+
+/**
+ * Opens a file of the specified directory for reading. The returned stream
+ * must be closed with fclose(). If the file can't be opened then NULL is
+ * returned and errno is set.
+ *
+ * @param dir
+ *            The directory
+ * @param filename
+ *            The filename relative to the directory
+ * @return The stream or NULL if the file could not be opened
+ */
+
+FILE * wlDirOpenFile(wlDir dir, char *filename)
+{
+    int i, fd;
+    FILE *stream;
+
+    assert(dir != NULL);
+    assert(filename != NULL);
+    if (dir->tar)
+    {
+        for (i = 0; i < dir->quantity; i++)
+        {
+            if (strcmp(dir->entries[i]->name, filename)) continue;
+            if (!dir->entries[i]->size) return fopen("/dev/null", "rb");
+            return fmemopen(dir->entries[i]->data, dir->entries[i]->size,
+                "rb");
+        }
+        errno = ENOENT;
+        return NULL;
+    }
+    fd = openat(dir->fd, filename, O_RDONLY);
+    if (fd < 0) return NULL;
+    stream = fdopen(fd, "rb");
+    if (!stream) close(fd);
+    return stream;
+}
+
+
+/**
+ * Writes a file with the specified content into the directory.
+ *
+ * @param dir
+ *            The directory
+ * @param filename
+ *            The filename relative to the directory
+ * @param data
+ *            The file content
+ * @param size
+ *            The size of the file content
+ * @return 1 on success, 0 on failure
+ */
+
+int wlDirWriteFile(wlDir dir, char *filename, void *data, size_t size)
+{
+    static char padding[BLOCK_SIZE];
+    size_t written;
+    ssize_t result;
+    int fd;
+
+    assert(dir != NULL);
+    assert(filename != NULL);
+    if (dir->tar)
+    {
+        if (!writeHeader(dir, filename, '0', size)) return 0;
+        if (size && fwrite(data, size, 1, dir->tar) != 1) return 0;
+        if (size % BLOCK_SIZE && fwrite(padding,
+            BLOCK_SIZE - size % BLOCK_SIZE, 1, dir->tar) != 1) return 0;
+        return 1;
+    }
+    fd = openat(dir->fd, filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) return 0;
+    for (written = 0; written < size; written += result)
+    {
+        result = write(fd, (char *) data + written, size - written);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+            {
+                result = 0;
+                continue;
+            }
+            close(fd);
+            return 0;
+        }
+    }
+    return !close(fd);
+}
+
+
+/**
+ * Creates a file in the specified directory and returns a stream to write
+ * its content. The stream must be closed with wlDirCloseFile(). When
+ * writing a tar archive then the content is collected in memory and the
+ * file is written into the archive when it is closed.
+ *
+ * @param dir
+ *            The directory
+ * @param filename
+ *            The filename relative to the directory
+ * @return The stream or NULL if the file could not be created
+ */
+
+FILE * wlDirCreateFile(wlDir dir, char *filename)
+{
+    wlDirEntry entry;
+    FILE *stream;
+    int fd;
+
+    assert(dir != NULL);
+    assert(filename != NULL);
+    if (dir->tar)
+    {
+        entry = malloc(sizeof(wlDirEntryStruct));
+        entry->name = strdup(filename);
+        entry->data = NULL;
+        entry->size = 0;
+        entry->stream = open_memstream(&entry->data, &entry->size);
+        if (!entry->stream)
+        {
+            free(entry->name);
+            free(entry);
+            return NULL;
+        }
+        listAdd(dir->entries, entry, &dir->quantity);
+        return entry->stream;
+    }
+    fd = openat(dir->fd, filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) return NULL;
+    stream = fdopen(fd, "wb");
+    if (!stream) close(fd);
+    return stream;
+}
+
+
+/**
+ * Closes a stream created with wlDirCreateFile().
+ *
+ * @param dir
+ *            The directory
+ * @param stream
+ *            The stream to close
+ * @return 1 on success, 0 on failure
+ */
+
+int wlDirCloseFile(wlDir dir, FILE *stream)
+{
+    wlDirEntry entry;
+    int i, result;
+
+    assert(dir != NULL);
+    assert(stream != NULL);
+    if (!dir->tar) return !fclose(stream);
+    for (i = 0; i < dir->quantity && dir->entries[i]->stream != stream; i++);
+    assert(i < dir->quantity);
+    entry = dir->entries[i];
+    result = !fclose(stream);
+    result = wlDirWriteFile(dir, entry->name, entry->data, entry->size)
+        && result;
+    free(entry->name);
+    free(entry->data);
+    free(entry);
+    listRemove(dir->entries, i, &dir->quantity);
+    return result;
+}
+
+
+/**
+ * Creates a sub directory in the specified directory. An already existing
+ * directory is not an error.
+ *
+ * @param dir
+ *            The directory
+ * @param name
+ *            The name of the sub directory
+ * @return 1 on success, 0 on failure
+ */
+
+int wlDirMkdir(wlDir dir, char *name)
+{
+    char *entryName;
+    int result;
+
+    assert(dir != NULL);
+    assert(name != NULL);
+    if (dir->tar)
+    {
+        entryName = malloc(strlen(name) + 2);
+        sprintf(entryName, "%s/", name);
+        result = writeHeader(dir, entryName, '5', 0);
+        free(entryName);
+        return result;
+    }
+    return !mkdirat(dir->fd, name, 0755) || errno == EEXIST;
+}
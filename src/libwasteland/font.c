@@ -72,6 +72,7 @@ wlImages wlFontReadStream(FILE *stream)
     for (glyph = 0; glyph < 172; glyph++)
     {
         image = font->images[glyph];
+        memset(image->pixels, 0, image->width * image->height);
         for (bit = 0; bit < 4; bit++)
         {
             for (y = 0; y < image->height; y++)
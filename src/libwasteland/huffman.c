@@ -6,9 +6,19 @@
 
 #include <assert.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <string.h>
 #include "wasteland.h"
 
+/** An item of the package-merge algorithm. Either a leaf or a package */
+typedef struct
+{
+    u_int64_t weight;
+    int symbol;
+    int left;
+    int right;
+} wlHuffmanItem;
+
 
 /**
  * Reads a huffman tree node (and all it's sub nodes) from the specified stream.
@@ -195,13 +205,11 @@ int wlHuffmanWriteByte(unsigned char byte, FILE *file,
 int wlHuffmanReadWord(FILE *stream, wlHuffmanNode *rootNode,
         unsigned char *dataByte, unsigned char *dataMask)
 {
-    int low, high;
+    u_int16_t word;
 
-    low = wlHuffmanReadByte(stream, rootNode, dataByte, dataMask);
-    if (low == -1) return -1;
-    high = wlHuffmanReadByte(stream, rootNode, dataByte, dataMask);
-    if (high == -1) return -1;
-    return high << 8 | low;
+    if (!wlHuffmanDecodeWords(stream, &word, 1, rootNode, dataByte, dataMask))
+        return -1;
+    return word;
 }
 
 
@@ -231,16 +239,120 @@ int wlHuffmanReadWord(FILE *stream, wlHuffmanNode *rootNode,
 unsigned char * wlHuffmanReadBlock(FILE *stream, unsigned char *block, int size,
     wlHuffmanNode *rootNode, unsigned char *dataByte, unsigned char *dataMask)
 {
-    int i, byte;
+    unsigned char *data;
 
-    if (!block) block = (unsigned char *) malloc(sizeof(unsigned char) * size);
+    data = block ? block : (unsigned char *) malloc(sizeof(unsigned char)
+        * size);
+    if (wlHuffmanDecodeBlock(stream, data, size, rootNode, dataByte, dataMask)
+        < size)
+    {
+        if (!block) free(data);
+        return NULL;
+    }
+    return data;
+}
+
+
+/**
+ * Decodes up to the specified number of bytes from the huffman stream into
+ * the specified block. In contrast to wlHuffmanReadBlock() the bit state is
+ * kept in local variables while decoding, there are no error checks per
+ * symbol and the input bytes are read with a single unlocked getc() per
+ * byte instead of calling wlReadBit() for every bit. The stream is locked
+ * once for the whole block. When the end of the stream is reached then the
+ * number of bytes decoded so far is returned. A symbol which was only
+ * partially read at the end of the stream is discarded.
+ *
+ * @param stream
+ *            The stream to read the huffman data from
+ * @param block
+ *            The byte array in which the decoded bytes are stored
+ * @param size
+ *            The maximum number of bytes to decode
+ * @param rootNode
+ *            The root node of the huffman tree
+ * @param dataByte
+ *            Storage for last read byte
+ * @param dataMask
+ *            Storage for last bit mask
+ * @return The number of decoded bytes
+ */
+
+int wlHuffmanDecodeBlock(FILE *stream, unsigned char *block, int size,
+    wlHuffmanNode *rootNode, unsigned char *dataByte, unsigned char *dataMask)
+{
+    wlHuffmanNode *node;
+    unsigned int byte, mask;
+    int i, c;
+
+    assert(stream != NULL);
+    assert(block != NULL);
+    assert(rootNode != NULL);
+    byte = *dataByte;
+    mask = *dataMask;
+    flockfile(stream);
     for (i = 0; i < size; i++)
     {
-        byte = wlHuffmanReadByte(stream, rootNode, dataByte, dataMask);
-        if (byte == -1) return NULL;
-        block[i] = byte;
+        node = rootNode;
+        while (node->left)
+        {
+            if (!mask)
+            {
+                if ((c = getc_unlocked(stream)) == EOF) break;
+                byte = c;
+                mask = 0x80;
+            }
+            node = (byte & mask) ? node->right : node->left;
+            mask >>= 1;
+        }
+        if (node->left) break;
+        block[i] = node->payload;
     }
-    return block;
+    funlockfile(stream);
+    *dataByte = byte;
+    *dataMask = mask;
+    return i;
+}
+
+
+/**
+ * Decodes up to the specified number of 16 bit little-endian values from
+ * the huffman stream into the specified array. The bytes are decoded with
+ * wlHuffmanDecodeBlock(). When the end of the stream is reached then the
+ * number of complete words decoded so far is returned.
+ *
+ * @param stream
+ *            The stream to read the huffman data from
+ * @param words
+ *            The array in which the decoded words are stored
+ * @param quantity
+ *            The maximum number of words to decode
+ * @param rootNode
+ *            The root node of the huffman tree
+ * @param dataByte
+ *            Storage for last read byte
+ * @param dataMask
+ *            Storage for last bit mask
+ * @return The number of decoded words
+ */
+
+int wlHuffmanDecodeWords(FILE *stream, u_int16_t *words, int quantity,
+    wlHuffmanNode *rootNode, unsigned char *dataByte, unsigned char *dataMask)
+{
+    unsigned char *bytes;
+    int i;
+
+    assert(words != NULL);
+    assert(quantity >= 0);
+
+    // The bytes are decoded into the word array and then converted in
+    // place. Each word is only written after its own two bytes were read.
+    bytes = (unsigned char *) words;
+    quantity = wlHuffmanDecodeBlock(stream, bytes, quantity * 2, rootNode,
+        dataByte, dataMask) / 2;
+    for (i = 0; i < quantity; i++)
+        words[i] = bytes[i * 2] | bytes[i * 2 + 1] << 8;
+    return quantity;
 }
 
 
@@ -398,43 +510,105 @@ void wlHuffmanDumpNode(wlHuffmanNode *node, int indent)
 
 wlHuffmanNode * wlHuffmanBuildTree(unsigned char *data, int size,
     wlHuffmanNode ***nodeIndex)
+{
+    int usage[256];
+
+    wlHistogram256(data, size, usage);
+    return wlHuffmanBuildTreeFromUsage(usage, nodeIndex);
+}
+
+
+/**
+ * Counts the usage of every byte value in the specified data. Runs of equal
+ * bytes would make each increment wait for the previous store to the same
+ * counter, so four interleaved count tables are used (One per byte position
+ * modulo 4) and are merged at the end. The counts are stored in the
+ * specified array, previous content is overwritten. The data size must not
+ * exceed INT_MAX so the counts fit into int values.
+ *
+ * @param data
+ *            The data
+ * @param size
+ *            The data size
+ * @param usage
+ *            The array of 256 counts to fill
+ */
+
+void wlHistogram256(unsigned char *data, size_t size, int *usage)
+{
+    u_int32_t counts[4][256];
+    size_t i;
+    int j;
+
+    assert(data != NULL || !size);
+    assert(usage != NULL);
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i + 4 <= size; i += 4)
+    {
+        counts[0][data[i]]++;
+        counts[1][data[i + 1]]++;
+        counts[2][data[i + 2]]++;
+        counts[3][data[i + 3]]++;
+    }
+    for (; i < size; i++) counts[0][data[i]]++;
+    for (j = 0; j < 256; j++)
+        usage[j] = counts[0][j] + counts[1][j] + counts[2][j] + counts[3][j];
+}
+
+
+/**
+ * Builds a huffman tree from the usage counts of the 256 byte values. This
+ * allows building the tree for data which is not completely in memory.
+ * Byte values with a usage of 0 get no node. The tree is identical to the
+ * one built by wlHuffmanBuildTree() for data with the same usage counts.
+ * See wlHuffmanBuildTree() for the node index and for releasing the tree.
+ * Returns NULL if all usage counts are 0.
+ *
+ * @param usage
+ *            The usage counts of the 256 byte values
+ * @param nodeIndex
+ *            Pointer to a list of huffman nodes where the node index will
+ *            be stored
+ * @return The root node of the huffman tree or NULL if there is no data
+ */
+
+wlHuffmanNode * wlHuffmanBuildTreeFromUsage(int *usage,
+    wlHuffmanNode ***nodeIndex)
 {
     wlHuffmanNode **nodes, *node, *left, *right;
     int i;
-    unsigned char payload;
+
+    assert(usage != NULL);
+    assert(nodeIndex != NULL);
 
     // Initialize the list of huffman nodes
     nodes = (wlHuffmanNode **) malloc(sizeof(wlHuffmanNode *) * 256);
     memset(nodes, 0, sizeof(wlHuffmanNode *) * 256);
 
-    // Cycle through data and create huffman nodes for every used data byte
-    // and count the usage
+    // Create huffman nodes for every used data byte
     node = NULL;
-    for (i = 0; i < size; i++)
+    for (i = 0; i < 256; i++)
     {
-        payload = data[i];
-        node = nodes[payload];
-        if (!node)
-        {
-            node = (wlHuffmanNode *) malloc(sizeof(wlHuffmanNode));
-            node->parent = NULL;
-            node->left = NULL;
-            node->right = NULL;
-            node->payload = payload;
-            node->usage = 1;
-            node->key = 0;
-            node->keyBits = 0;
-            nodes[payload] = node;
-        }
-        else
-        {
-            node->usage++;
-        }
+        if (!usage[i]) continue;
+        node = (wlHuffmanNode *) malloc(sizeof(wlHuffmanNode));
+        node->parent = NULL;
+        node->left = NULL;
+        node->right = NULL;
+        node->payload = i;
+        node->usage = usage[i];
+        node->key = 0;
+        node->keyBits = 0;
+        nodes[i] = node;
     }
 
     // Save current state of the list as node index
     *nodeIndex = (wlHuffmanNode **) malloc(sizeof(wlHuffmanNode *) * 256);
     memcpy(*nodeIndex, nodes, sizeof(wlHuffmanNode *) * 256);
+    if (!node)
+    {
+        free(nodes);
+        return NULL;
+    }
 
     // Now sort the list by usage
     qsort(nodes, 256, sizeof(wlHuffmanNode *), compareNode);
@@ -473,3 +647,252 @@ wlHuffmanNode * wlHuffmanBuildTree(unsigned char *data, int size,
     free(nodes);
     return node;
 }
+
+
+/**
+ * Returns the depth of the specified huffman tree. This is the length of
+ * the longest huffman code.
+ *
+ * @param node
+ *            The root node of the huffman tree
+ * @return The depth of the tree
+ */
+
+static int getDepth(wlHuffmanNode *node)
+{
+    int left, right;
+
+    if (!node->left) return 0;
+    left = getDepth(node->left);
+    right = getDepth(node->right);
+    return 1 + (left > right ? left : right);
+}
+
+
+/**
+ * Compares two package-merge items by weight.
+ *
+ * @param a
+ *            The first item
+ * @param b
+ *            The second item
+ * @return -1, 0 or 1
+ */
+
+static int compareItem(const void *a, const void *b)
+{
+    const wlHuffmanItem *item1, *item2;
+
+    item1 = (const wlHuffmanItem *) a;
+    item2 = (const wlHuffmanItem *) b;
+    if (item1->weight == item2->weight) return item1->symbol - item2->symbol;
+    return item1->weight < item2->weight ? -1 : 1;
+}
+
+
+/**
+ * Increments the code length of all symbols in the specified package-merge
+ * item.
+ *
+ * @param items
+ *            The pool of all items
+ * @param item
+ *            The index of the item
+ * @param lengths
+ *            The code lengths of the symbols
+ */
+
+static void countItem(wlHuffmanItem *items, int item, int *lengths)
+{
+    while (items[item].symbol < 0)
+    {
+        countItem(items, items[item].left, lengths);
+        item = items[item].right;
+    }
+    lengths[items[item].symbol]++;
+}
+
+
+/**
+ * Releases the inner nodes of the specified huffman tree. The leaf nodes are
+ * kept.
+ *
+ * @param node
+ *            The root node of the huffman tree
+ */
+
+static void freeInnerNodes(wlHuffmanNode *node)
+{
+    if (!node->left) return;
+    freeInnerNodes(node->left);
+    freeInnerNodes(node->right);
+    free(node);
+}
+
+
+/**
+ * Inserts a leaf node for the specified symbol into the huffman tree. The
+ * inner nodes on the path of the code are created when needed.
+ *
+ * @param rootNode
+ *            The root node of the huffman tree
+ * @param leaf
+ *            The leaf node to insert
+ * @param code
+ *            The huffman code of the symbol
+ * @param length
+ *            The length of the huffman code
+ */
+
+static void insertNode(wlHuffmanNode *rootNode, wlHuffmanNode *leaf, int code,
+    int length)
+{
+    wlHuffmanNode *node, **child;
+    int i;
+
+    node = rootNode;
+    for (i = length - 1; i >= 0; i--)
+    {
+        node->usage += leaf->usage;
+        child = (code >> i) & 1 ? &node->right : &node->left;
+        if (!i)
+            *child = leaf;
+        else if (!*child)
+        {
+            *child = (wlHuffmanNode *) malloc(sizeof(wlHuffmanNode));
+            memset(*child, 0, sizeof(wlHuffmanNode));
+        }
+        (*child)->parent = node;
+        node = *child;
+    }
+}
+
+
+/**
+ * Builds a huffman tree from the usage counts of the 256 byte values in
+ * which no huffman code is longer than the specified number of bits. If
+ * the tree built by wlHuffmanBuildTreeFromUsage() fits into the limit then
+ * this tree is returned. Otherwise the code lengths are calculated with
+ * the package-merge algorithm which finds the optimal code lengths under
+ * the limit and the tree is built from canonical codes (Shorter codes
+ * first, codes of the same length ordered by byte value). The tree has
+ * the normal shape so it can be written with wlHuffmanWriteNode() and
+ * read by the game. A decoder can look up each code in a single table of
+ * 2^maxBits entries. See wlHuffmanBuildTree() for the node index and for
+ * releasing the tree.
+ *
+ * Returns NULL if all usage counts are 0. Returns NULL and sets errno to
+ * EINVAL if more byte values are used than fit into the number of bits.
+ *
+ * @param usage
+ *            The usage counts of the 256 byte values
+ * @param maxBits
+ *            The maximum length of a huffman code (1-31)
+ * @param nodeIndex
+ *            Pointer to a list of huffman nodes where the node index will
+ *            be stored
+ * @return The root node of the huffman tree or NULL if there is no data or
+ *         the limit is too small
+ */
+
+wlHuffmanNode * wlHuffmanBuildLimitedTree(int *usage, int maxBits,
+    wlHuffmanNode ***nodeIndex)
+{
+    wlHuffmanNode *rootNode;
+    wlHuffmanItem *items, *leaves;
+    int *list, *merged;
+    int lengths[256], order[256];
+    int symbols, level, quantity, packages, pool, i, j, k, code, length;
+
+    assert(usage != NULL);
+    assert(maxBits > 0 && maxBits < 32);
+    assert(nodeIndex != NULL);
+
+    // Use the unlimited tree if it already fits
+    rootNode = wlHuffmanBuildTreeFromUsage(usage, nodeIndex);
+    if (!rootNode || getDepth(rootNode) <= maxBits) return rootNode;
+    symbols = 0;
+    for (i = 0; i < 256; i++) if (usage[i]) symbols++;
+    if (maxBits < 8 && symbols > 1 << maxBits)
+    {
+        wlHuffmanFreeNode(rootNode);
+        free(*nodeIndex);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // The pool holds the leaves and the packages of all levels. A package
+    // references its two items in the pool.
+    items = (wlHuffmanItem *) malloc(sizeof(wlHuffmanItem) * symbols * 2
+        * (maxBits + 1));
+    leaves = items;
+    for (i = 0, j = 0; i < 256; i++)
+    {
+        if (!usage[i]) continue;
+        leaves[j].weight = usage[i];
+        leaves[j].symbol = i;
+        leaves[j].left = leaves[j].right = -1;
+        j++;
+    }
+    qsort(leaves, symbols, sizeof(wlHuffmanItem), compareItem);
+    pool = symbols;
+
+    // The list of each level references items in the pool. Packages of the
+    // previous level are merged with the leaves. Leaves come first on equal
+    // weight.
+    list = (int *) malloc(sizeof(int) * symbols * 2);
+    merged = (int *) malloc(sizeof(int) * symbols * 2);
+    for (i = 0; i < symbols; i++) list[i] = i;
+    quantity = symbols;
+    for (level = 1; level < maxBits; level++)
+    {
+        packages = quantity / 2;
+        for (i = 0; i < packages; i++)
+        {
+            items[pool + i].weight = items[list[i * 2]].weight
+                + items[list[i * 2 + 1]].weight;
+            items[pool + i].symbol = -1;
+            items[pool + i].left = list[i * 2];
+            items[pool + i].right = list[i * 2 + 1];
+        }
+        for (i = 0, j = 0, k = 0; j < symbols || k < packages; i++)
+        {
+            if (k == packages || (j < symbols
+                && leaves[j].weight <= items[pool + k].weight))
+                merged[i] = j++;
+            else
+                merged[i] = pool + k++;
+        }
+        pool += packages;
+        quantity = i;
+        memcpy(list, merged, sizeof(int) * quantity);
+    }
+
+    // Each of the first 2n-2 items adds one bit to the codes of its leaves
+    memset(lengths, 0, sizeof(lengths));
+    for (i = 0; i < symbols * 2 - 2; i++) countItem(items, list[i], lengths);
+    free(merged);
+    free(list);
+    free(items);
+
+    // Sort the byte values by code length and value
+    for (i = 0, k = 0; k <= maxBits; k++)
+        for (j = 0; j < 256; j++)
+            if (usage[j] && lengths[j] == k) order[i++] = j;
+
+    // Replace the unlimited tree with a tree of canonical codes and reuse
+    // the leaf nodes of the node index
+    freeInnerNodes(rootNode);
+    rootNode = (wlHuffmanNode *) malloc(sizeof(wlHuffmanNode));
+    memset(rootNode, 0, sizeof(wlHuffmanNode));
+    code = 0;
+    length = lengths[order[0]];
+    for (i = 0; i < symbols; i++)
+    {
+        code <<= lengths[order[i]] - length;
+        length = lengths[order[i]];
+        insertNode(rootNode, (*nodeIndex)[order[i]], code++, length);
+    }
+    buildKeys(rootNode, 0, 0);
+    return rootNode;
+}
@@ -0,0 +1,347 @@
+/*
+ * $Id$
+ * Copyright (C) 2007  Klaus Reimer <k@ailis.de>
+ * See COPYING file for copying conditions
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "wasteland.h"
+
+/** The number of hash buckets */
+#define BUCKETS 1024
+
+/** The number of unreferenced decoders kept in the cache */
+#define CAPACITY 256
+
+/**
+ * The maximum size of a serialized huffman tree in bytes. A tree with 256
+ * leaves needs 256 * 9 bits for the leaves and 255 * 2 bits for the inner
+ * nodes
+ */
+#define KEY_SIZE 352
+
+typedef struct wlHuffmanCacheEntry_s
+{
+    struct wlHuffmanCacheEntry_s *next;
+    struct wlHuffmanCacheEntry_s *nextDecoder;
+    unsigned char key[KEY_SIZE];
+    int bits;
+    int backend;
+    unsigned int hash;
+    wlHuffmanNode *rootNode;
+    wlHuffmanDecoder decoder;
+    int references;
+    int hits;
+} wlHuffmanCacheEntry;
+
+/** The cache entries hashed by serialized tree and backend */
+static wlHuffmanCacheEntry *entries[BUCKETS];
+
+/** The cache entries hashed by decoder */
+static wlHuffmanCacheEntry *decoders[BUCKETS];
+
+/** The number of cache entries */
+static int quantity = 0;
+
+/** The number of requests which were answered from the cache */
+static int hits = 0;
+
+/** The number of requests which needed a new decoder */
+static int misses = 0;
+
+/** The mutex which protects the cache */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * Reads the serialized huffman tree node (and all its sub nodes) from the
+ * stream and appends the raw bits to the key.
+ *
+ * @param stream
+ *            The stream to read from
+ * @param dataByte
+ *            Storage for last read byte
+ * @param dataMask
+ *            Storage for last bit mask
+ * @param key
+ *            The key to append the bits to
+ * @param bits
+ *            The number of bits in the key. Is increased by the read bits
+ * @return 1 on success, 0 if the stream ended or the tree is too large
+ */
+
+static int readKey(FILE *stream, unsigned char *dataByte,
+    unsigned char *dataMask, unsigned char *key, int *bits)
+{
+    int bit, i, leaf;
+
+    // Read the leaf flag and the payload of a leaf or the separator bit of
+    // an inner node
+    if ((leaf = wlReadBit(stream, dataByte, dataMask)) == -1) return 0;
+    for (i = 0; i < (leaf ? 9 : 1); i++)
+    {
+        if (*bits == KEY_SIZE * 8) return 0;
+        bit = i ? wlReadBit(stream, dataByte, dataMask) : leaf;
+        if (bit == -1) return 0;
+        if (bit) key[*bits >> 3] |= 0x80 >> (*bits & 7);
+        (*bits)++;
+    }
+    if (leaf) return 1;
+    if (!readKey(stream, dataByte, dataMask, key, bits)) return 0;
+    if ((bit = wlReadBit(stream, dataByte, dataMask)) == -1) return 0;
+    if (*bits == KEY_SIZE * 8) return 0;
+    if (bit) key[*bits >> 3] |= 0x80 >> (*bits & 7);
+    (*bits)++;
+    return readKey(stream, dataByte, dataMask, key, bits);
+}
+
+
+/**
+ * Builds the huffman tree node (and all its sub nodes) from the serialized
+ * tree in the key.
+ *
+ * @param key
+ *            The serialized tree
+ * @param pos
+ *            The bit position in the key. Is moved behind the node
+ * @return The huffman tree node
+ */
+
+static wlHuffmanNode * buildNode(unsigned char *key, int *pos)
+{
+    wlHuffmanNode *node;
+    int i;
+
+    node = (wlHuffmanNode *) malloc(sizeof(wlHuffmanNode));
+    memset(node, 0, sizeof(wlHuffmanNode));
+    if ((key[*pos >> 3] >> (7 - (*pos & 7))) & 1)
+    {
+        (*pos)++;
+        for (i = 0; i < 8; i++, (*pos)++)
+            node->payload = (node->payload << 1)
+                | ((key[*pos >> 3] >> (7 - (*pos & 7))) & 1);
+        return node;
+    }
+    (*pos)++;
+    node->left = buildNode(key, pos);
+    node->left->parent = node;
+    (*pos)++;
+    node->right = buildNode(key, pos);
+    node->right->parent = node;
+    return node;
+}
+
+
+/**
+ * Removes the specified entry from both hash tables and releases it.
+ *
+ * @param entry
+ *            The entry to remove
+ */
+
+static void removeEntry(wlHuffmanCacheEntry *entry)
+{
+    wlHuffmanCacheEntry **link;
+
+    for (link = &entries[entry->hash % BUCKETS]; *link != entry;
+        link = &(*link)->next);
+    *link = entry->next;
+    for (link = &decoders[((size_t) entry->decoder >> 4) % BUCKETS];
+        *link != entry; link = &(*link)->nextDecoder);
+    *link = entry->nextDecoder;
+    wlHuffmanDecoderFree(entry->decoder);
+    wlHuffmanFreeNode(entry->rootNode);
+    free(entry);
+    quantity--;
+}
+
+
+/**
+ * Removes the unreferenced entry with the fewest hits if the cache holds
+ * more entries than its capacity. Must be called with the locked mutex.
+ */
+
+static void evictEntry(void)
+{
+    wlHuffmanCacheEntry *entry, *victim;
+    int i;
+
+    if (quantity <= CAPACITY) return;
+    victim = NULL;
+    for (i = 0; i < BUCKETS; i++)
+        for (entry = entries[i]; entry; entry = entry->next)
+            if (!entry->references && (!victim || entry->hits < victim->hits))
+                victim = entry;
+    if (victim) removeEntry(victim);
+}
+
+
+/**
+ * Reads a huffman tree from the stream and returns a decoder for it from
+ * the process-wide decoder cache. The cache is keyed by the raw bits of the
+ * serialized tree and the backend, so all MSQ blocks using the same tree
+ * share a single decoder and the tree and the decoding tables (See
+ * wlHuffmanDecoderCreate()) are only built once. The cache is thread-safe.
+ *
+ * The returned decoder and its tree are shared and must not be modified.
+ * Decoding with it is thread-safe. Release it with wlHuffmanCacheRelease()
+ * when no longer needed. Unreferenced decoders are kept for later requests
+ * until the cache exceeds its capacity. Returns NULL if the stream ended
+ * within the tree or the tree is invalid.
+ *
+ * @param stream
+ *            The stream to read the huffman tree from
+ * @param backend
+ *            The decoder backend (WL_HUFFMAN_BITS, WL_HUFFMAN_TREE or
+ *            WL_HUFFMAN_FSM)
+ * @param dataByte
+ *            Storage for last read byte
+ * @param dataMask
+ *            Storage for last bit mask
+ * @return The shared huffman decoder or NULL on failure
+ */
+
+wlHuffmanDecoder wlHuffmanCacheRead(FILE *stream, int backend,
+    unsigned char *dataByte, unsigned char *dataMask)
+{
+    wlHuffmanCacheEntry *entry;
+    unsigned char key[KEY_SIZE];
+    unsigned int hash;
+    int bits, pos, i;
+
+    assert(stream != NULL);
+    assert(backend >= WL_HUFFMAN_BITS && backend <= WL_HUFFMAN_FSM);
+
+    // Read the serialized tree
+    memset(key, 0, sizeof(key));
+    bits = 0;
+    if (!readKey(stream, dataByte, dataMask, key, &bits))
+    {
+        if (bits == KEY_SIZE * 8) wlError("Huffman tree is too large");
+        return NULL;
+    }
+    hash = 2166136261u ^ backend;
+    for (i = 0; i < (bits + 7) / 8; i++) hash = (hash ^ key[i]) * 16777619u;
+
+    // Look up the decoder
+    pthread_mutex_lock(&mutex);
+    for (entry = entries[hash % BUCKETS]; entry; entry = entry->next)
+    {
+        if (entry->hash == hash && entry->bits == bits
+            && entry->backend == backend
+            && !memcmp(entry->key, key, (bits + 7) / 8)) break;
+    }
+    if (entry)
+    {
+        entry->hits++;
+        entry->references++;
+        hits++;
+        pthread_mutex_unlock(&mutex);
+        return entry->decoder;
+    }
+    misses++;
+    pthread_mutex_unlock(&mutex);
+
+    // Build the decoder outside of the lock. If another thread has added
+    // the same tree in the meantime then both entries are kept, which is
+    // harmless
+    entry = malloc(sizeof(wlHuffmanCacheEntry));
+    memcpy(entry->key, key, sizeof(key));
+    entry->bits = bits;
+    entry->backend = backend;
+    entry->hash = hash;
+    pos = 0;
+    entry->rootNode = buildNode(key, &pos);
+    entry->decoder = wlHuffmanDecoderCreate(entry->rootNode, backend);
+    if (!entry->decoder)
+    {
+        wlHuffmanFreeNode(entry->rootNode);
+        free(entry);
+        return NULL;
+    }
+    entry->references = 1;
+    entry->hits = 0;
+
+    // Add the decoder to the cache
+    pthread_mutex_lock(&mutex);
+    entry->next = entries[hash % BUCKETS];
+    entries[hash % BUCKETS] = entry;
+    i = ((size_t) entry->decoder >> 4) % BUCKETS;
+    entry->nextDecoder = decoders[i];
+    decoders[i] = entry;
+    quantity++;
+    evictEntry();
+    pthread_mutex_unlock(&mutex);
+    return entry->decoder;
+}
+
+
+/**
+ * Releases a decoder returned by wlHuffmanCacheRead(). The decoder stays in
+ * the cache for later requests.
+ *
+ * @param decoder
+ *            The decoder to release
+ */
+
+void wlHuffmanCacheRelease(wlHuffmanDecoder decoder)
+{
+    wlHuffmanCacheEntry *entry;
+
+    assert(decoder != NULL);
+    pthread_mutex_lock(&mutex);
+    for (entry = decoders[((size_t) decoder >> 4) % BUCKETS];
+        entry && entry->decoder != decoder; entry = entry->nextDecoder);
+    assert(entry != NULL);
+    entry->references--;
+    evictEntry();
+    pthread_mutex_unlock(&mutex);
+}
+
+
+/**
+ * Removes all unreferenced decoders from the cache.
+ */
+
+void wlHuffmanCacheClear(void)
+{
+    wlHuffmanCacheEntry *entry, *next;
+    int i;
+
+    pthread_mutex_lock(&mutex);
+    for (i = 0; i < BUCKETS; i++)
+    {
+        for (entry = entries[i]; entry; entry = next)
+        {
+            next = entry->next;
+            if (!entry->references) removeEntry(entry);
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+
+/**
+ * Returns the statistics of the decoder cache. Each pointer may be NULL if
+ * the value is not needed.
+ *
+ * @param cached
+ *            Storage for the number of cached decoders
+ * @param hitCount
+ *            Storage for the number of requests answered from the cache
+ * @param missCount
+ *            Storage for the number of requests which needed a new decoder
+ */
+
+void wlHuffmanCacheStats(int *cached, int *hitCount, int *missCount)
+{
+    pthread_mutex_lock(&mutex);
+    if (cached) *cached = quantity;
+    if (hitCount) *hitCount = hits;
+    if (missCount) *missCount = misses;
+    pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,291 @@
+/*
+ * $Id$
+ * Copyright (C) 2007  Klaus Reimer <k@ailis.de>
+ * See COPYING file for copying conditions
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wasteland.h"
+
+/** The maximum number of FSM states. A tree with 256 symbols has 255 */
+#define MAX_STATES 255
+
+
+/**
+ * Counts the inner nodes of the specified huffman tree. Counting stops as
+ * soon as the specified limit is exceeded.
+ *
+ * @param node
+ *            The node to count
+ * @param limit
+ *            The maximum number of inner nodes of interest
+ * @return The number of inner nodes or a number larger than the limit
+ */
+
+static int countNodes(wlHuffmanNode *node, int limit)
+{
+    int count;
+
+    if (!node->left) return 0;
+    count = 1 + countNodes(node->left, limit - 1);
+    if (count > limit) return count;
+    return count + countNodes(node->right, limit - count);
+}
+
+
+/**
+ * Numbers the specified inner node and all its inner sub nodes and stores
+ * the children of each numbered node. A child which is a leaf is stored as
+ * the negative payload minus 1.
+ *
+ * @param decoder
+ *            The decoder
+ * @param node
+ *            The inner node to number
+ * @return The number of the node
+ */
+
+static int numberNodes(wlHuffmanDecoder decoder, wlHuffmanNode *node)
+{
+    int state, child;
+
+    state = decoder->states++;
+    child = node->left->left ? numberNodes(decoder, node->left)
+        : -node->left->payload - 1;
+    decoder->children[state * 2] = child;
+    child = node->right->left ? numberNodes(decoder, node->right)
+        : -node->right->payload - 1;
+    decoder->children[state * 2 + 1] = child;
+    return state;
+}
+
+
+/**
+ * Builds the transition table of the finite state machine. For each state
+ * (An inner node of the tree, 0 is the root) and each input byte the
+ * decoded symbols and the state after the byte are stored.
+ *
+ * @param decoder
+ *            The decoder
+ */
+
+static void buildTransitions(wlHuffmanDecoder decoder)
+{
+    wlHuffmanTransition *transition;
+    int state, byte, bit, next, child;
+
+    decoder->transitions = malloc(sizeof(wlHuffmanTransition)
+        * decoder->states * 256);
+    for (state = 0; state < decoder->states; state++)
+    {
+        for (byte = 0; byte < 256; byte++)
+        {
+            transition = &decoder->transitions[state * 256 + byte];
+            transition->quantity = 0;
+            next = state;
+            for (bit = 7; bit >= 0; bit--)
+            {
+                child = decoder->children[next * 2 + ((byte >> bit) & 1)];
+                if (child < 0)
+                {
+                    transition->symbols[transition->quantity++] = -child - 1;
+                    next = 0;
+                }
+                else
+                    next = child;
+            }
+            transition->next = next;
+        }
+    }
+}
+
+
+/**
+ * Creates a huffman decoder for the specified huffman tree. The decoder
+ * only references the tree, so the tree must not be freed before the
+ * decoder. The backend selects how the data is decoded:
+ *
+ * WL_HUFFMAN_BITS reads each byte with wlHuffmanReadByte() which walks the
+ * tree bit by bit with a wlReadBit() call for every bit. WL_HUFFMAN_TREE
+ * uses wlHuffmanDecodeBlock() which walks the tree too but keeps the bit
+ * state in local variables. WL_HUFFMAN_FSM uses a finite state machine
+ * with one state per inner node of the tree. For each state and each
+ * input byte a precomputed transition holds the decoded symbols and the
+ * next state, so a whole input byte is decoded with a single table lookup.
+ * The table needs 12 bytes per state and input byte, so building it is
+ * only worth it for larger blocks. All backends return the same data.
+ *
+ * A valid huffman tree has at most 255 inner nodes. Larger trees (Which
+ * can only be built with duplicate symbols) are read by
+ * wlHuffmanReadNode() too but can't be decoded with WL_HUFFMAN_FSM, so
+ * NULL is returned for them.
+ *
+ * @param rootNode
+ *            The root node of the huffman tree
+ * @param backend
+ *            The backend (WL_HUFFMAN_BITS, WL_HUFFMAN_TREE or WL_HUFFMAN_FSM)
+ * @return The huffman decoder or NULL if the tree is too large for the
+ *         finite state machine
+ */
+
+wlHuffmanDecoder wlHuffmanDecoderCreate(wlHuffmanNode *rootNode, int backend)
+{
+    wlHuffmanDecoder decoder;
+
+    assert(rootNode != NULL);
+    assert(backend >= WL_HUFFMAN_BITS && backend <= WL_HUFFMAN_FSM);
+    if (backend == WL_HUFFMAN_FSM
+        && countNodes(rootNode, MAX_STATES) > MAX_STATES)
+    {
+        wlError("Huffman tree has too many nodes for the FSM decoder");
+        return NULL;
+    }
+    decoder = malloc(sizeof(wlHuffmanDecoderStruct));
+    decoder->backend = backend;
+    decoder->rootNode = rootNode;
+    decoder->states = 0;
+    decoder->children = NULL;
+    decoder->transitions = NULL;
+
+    // A tree with a single symbol doesn't consume any bits and needs no
+    // state machine
+    if (backend == WL_HUFFMAN_FSM && rootNode->left)
+    {
+        decoder->children = malloc(sizeof(int) * 2 * MAX_STATES);
+        numberNodes(decoder, rootNode);
+        buildTransitions(decoder);
+    }
+    return decoder;
+}
+
+
+/**
+ * Releases the memory allocated for the specified huffman decoder. The
+ * huffman tree is not freed.
+ *
+ * @param decoder
+ *            The decoder to free
+ */
+
+void wlHuffmanDecoderFree(wlHuffmanDecoder decoder)
+{
+    assert(decoder != NULL);
+    free(decoder->children);
+    free(decoder->transitions);
+    free(decoder);
+}
+
+
+/**
+ * Decodes bytes with the finite state machine. See wlHuffmanDecoderDecode().
+ * Whole input bytes are decoded with a single transition as long as more
+ * symbols are needed after the byte. Bytes which are partially used (At
+ * the start and at the end of the block) are decoded bit by bit, so the
+ * bit state is left exactly behind the last decoded symbol.
+ *
+ * @param decoder
+ *            The decoder
+ * @param stream
+ *            The stream to read the huffman data from
+ * @param block
+ *            The byte array in which the decoded bytes are stored
+ * @param size
+ *            The maximum number of bytes to decode
+ * @param dataByte
+ *            Storage for last read byte
+ * @param dataMask
+ *            Storage for last bit mask
+ * @return The number of decoded bytes
+ */
+
+static int decodeFsm(wlHuffmanDecoder decoder, FILE *stream,
+    unsigned char *block, int size, unsigned char *dataByte,
+    unsigned char *dataMask)
+{
+    wlHuffmanTransition *transition;
+    unsigned int byte, mask;
+    int i, c, state, child;
+
+    byte = *dataByte;
+    mask = *dataMask;
+    state = 0;
+    i = 0;
+    while (i < size)
+    {
+        if (!mask)
+        {
+            if ((c = getc(stream)) == EOF) break;
+            transition = &decoder->transitions[state * 256 + c];
+            if (transition->quantity < size - i)
+            {
+                memcpy(block + i, transition->symbols, transition->quantity);
+                i += transition->quantity;
+                state = transition->next;
+                continue;
+            }
+            byte = c;
+            mask = 0x80;
+        }
+        child = decoder->children[state * 2 + ((byte & mask) ? 1 : 0)];
+        mask >>= 1;
+        if (child < 0)
+        {
+            block[i++] = -child - 1;
+            state = 0;
+        }
+        else
+            state = child;
+    }
+    *dataByte = byte;
+    *dataMask = mask;
+    return i;
+}
+
+
+/**
+ * Decodes up to the specified number of bytes from the huffman stream with
+ * the backend of the decoder. When the end of the stream is reached then
+ * the number of bytes decoded so far is returned. See wlHuffmanDecodeBlock()
+ * for details.
+ *
+ * @param decoder
+ *            The decoder
+ * @param stream
+ *            The stream to read the huffman data from
+ * @param block
+ *            The byte array in which the decoded bytes are stored
+ * @param size
+ *            The maximum number of bytes to decode
+ * @param dataByte
+ *            Storage for last read byte
+ * @param dataMask
+ *            Storage for last bit mask
+ * @return The number of decoded bytes
+ */
+
+int wlHuffmanDecoderDecode(wlHuffmanDecoder decoder, FILE *stream,
+    unsigned char *block, int size, unsigned char *dataByte,
+    unsigned char *dataMask)
+{
+    int i, byte;
+
+    assert(decoder != NULL);
+    assert(stream != NULL);
+    assert(block != NULL);
+    if (decoder->backend == WL_HUFFMAN_FSM && decoder->transitions)
+        return decodeFsm(decoder, stream, block, size, dataByte, dataMask);
+    if (decoder->backend != WL_HUFFMAN_BITS)
+        return wlHuffmanDecodeBlock(stream, block, size, decoder->rootNode,
+            dataByte, dataMask);
+    for (i = 0; i < size; i++)
+    {
+        byte = wlHuffmanReadByte(stream, decoder->rootNode, dataByte,
+            dataMask);
+        if (byte == -1) break;
+        block[i] = byte;
+    }
+    return i;
+}
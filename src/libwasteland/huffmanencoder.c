@@ -0,0 +1,175 @@
+/*
+ * $Id$
+ * Copyright (C) 2007  Klaus Reimer <k@ailis.de>
+ * See COPYING file for copying conditions
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include "wasteland.h"
+
+/** The size of the output buffer */
+#define BUFFER_SIZE 65536
+
+
+/**
+ * Writes the buffered bytes of the encoder to its stream.
+ *
+ * @param encoder
+ *            The encoder
+ * @return 1 on success, 0 on failure
+ */
+
+static int flushBuffer(wlHuffmanEncoder encoder)
+{
+    if (encoder->size && fwrite(encoder->buffer, 1, encoder->size,
+        encoder->stream) != encoder->size) return 0;
+    encoder->size = 0;
+    return 1;
+}
+
+
+/**
+ * Creates a huffman encoder which writes to the specified stream. The code
+ * table is built once from the specified node index by walking from each
+ * leaf up to the root, so the tree may be freed right after this call.
+ * Usage counts are int values so no code is longer than 45 bits and a code
+ * always fits into the 64 bit accumulator together with the pending bits.
+ *
+ * Usually the huffman tree has just been written with wlHuffmanWriteNode()
+ * so the pending bits of this call are passed to the encoder and the
+ * encoded data continues right behind the tree. You have to call
+ * wlHuffmanEncoderFinish() to write the last byte and to release the
+ * encoder.
+ *
+ * @param nodeIndex
+ *            The huffman node index as provided by wlHuffmanBuildTree()
+ * @param stream
+ *            The stream to write the encoded data to
+ * @param dataByte
+ *            The pending bits of the last written byte
+ * @param dataMask
+ *            The bit mask of the last written bit
+ * @return The huffman encoder
+ */
+
+wlHuffmanEncoder wlHuffmanEncoderCreate(wlHuffmanNode **nodeIndex,
+    FILE *stream, unsigned char dataByte, unsigned char dataMask)
+{
+    wlHuffmanEncoder encoder;
+    wlHuffmanNode *node;
+    int i;
+
+    assert(nodeIndex != NULL);
+    assert(stream != NULL);
+    encoder = malloc(sizeof(wlHuffmanEncoderStruct));
+    encoder->stream = stream;
+
+    // Build the code table. A tree with a single symbol uses a 1 bit code
+    for (i = 0; i < 256; i++)
+    {
+        encoder->codes[i] = 0;
+        encoder->lengths[i] = 0;
+        if (!nodeIndex[i]) continue;
+        for (node = nodeIndex[i]; node->parent; node = node->parent)
+        {
+            if (node == node->parent->right)
+                encoder->codes[i] |= (u_int64_t) 1 << encoder->lengths[i];
+            encoder->lengths[i]++;
+        }
+        if (!encoder->lengths[i]) encoder->lengths[i] = 1;
+    }
+
+    // Continue with the pending bits
+    encoder->bits = dataByte;
+    encoder->count = 0;
+    while (dataMask)
+    {
+        encoder->count++;
+        dataMask >>= 1;
+    }
+    encoder->buffer = malloc(BUFFER_SIZE);
+    encoder->size = 0;
+    return encoder;
+}
+
+
+/**
+ * Encodes the specified data and appends it to the stream of the encoder.
+ * Each code is appended to a 64 bit accumulator with a single shift and
+ * the whole bytes are moved into a buffer which is written with a single
+ * fwrite() when it is full. All bytes of the data must be present in the
+ * node index the encoder was created with.
+ *
+ * @param encoder
+ *            The encoder
+ * @param data
+ *            The data to encode
+ * @param size
+ *            The size of the data
+ * @return 1 on success, 0 on failure
+ */
+
+int wlHuffmanEncodeBlock(wlHuffmanEncoder encoder, unsigned char *data,
+    size_t size)
+{
+    u_int64_t bits;
+    int count, length;
+    size_t i;
+
+    assert(encoder != NULL);
+    assert(data != NULL || !size);
+    bits = encoder->bits;
+    count = encoder->count;
+    for (i = 0; i < size; i++)
+    {
+        length = encoder->lengths[data[i]];
+        assert(length);
+        bits = (bits << length) | encoder->codes[data[i]];
+        count += length;
+        while (count >= 8)
+        {
+            count -= 8;
+            encoder->buffer[encoder->size++] = bits >> count;
+            if (encoder->size == BUFFER_SIZE && !flushBuffer(encoder))
+            {
+                encoder->bits = bits;
+                encoder->count = count;
+                return 0;
+            }
+        }
+    }
+    encoder->bits = bits;
+    encoder->count = count;
+    return 1;
+}
+
+
+/**
+ * Fills the last byte with 0 bits, writes all buffered bytes and releases
+ * the encoder. The stream is not flushed or closed.
+ *
+ * @param encoder
+ *            The encoder
+ * @return 1 on success, 0 on failure
+ */
+
+int wlHuffmanEncoderFinish(wlHuffmanEncoder encoder)
+{
+    int result;
+
+    assert(encoder != NULL);
+
+    // The buffer is only full here if writing it has failed before
+    result = encoder->size < BUFFER_SIZE || flushBuffer(encoder);
+    if (result && encoder->count)
+        encoder->buffer[encoder->size++] = encoder->bits
+            << (8 - encoder->count);
+    if (result) result = flushBuffer(encoder);
+    free(encoder->buffer);
+    free(encoder);
+    return result;
+}
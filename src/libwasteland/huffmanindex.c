@@ -0,0 +1,196 @@
+/*
+ * $Id$
+ * Copyright (C) 2007  Klaus Reimer <k@ailis.de>
+ * See COPYING file for copying conditions
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wasteland.h"
+
+/** The size of the buffer for skipped bytes */
+#define SKIP_SIZE 4096
+
+
+/**
+ * Decodes and discards the specified number of bytes.
+ *
+ * @param stream
+ *            The stream to read the huffman data from
+ * @param rootNode
+ *            The root node of the huffman tree
+ * @param quantity
+ *            The number of bytes to skip
+ * @param dataByte
+ *            Storage for last read byte
+ * @param dataMask
+ *            Storage for last bit mask
+ * @return The number of skipped bytes
+ */
+
+static int skipBytes(FILE *stream, wlHuffmanNode *rootNode, int quantity,
+    unsigned char *dataByte, unsigned char *dataMask)
+{
+    unsigned char buffer[SKIP_SIZE];
+    int skipped, size, read;
+
+    skipped = 0;
+    while (skipped < quantity)
+    {
+        size = quantity - skipped < SKIP_SIZE ? quantity - skipped : SKIP_SIZE;
+        read = wlHuffmanDecodeBlock(stream, buffer, size, rootNode, dataByte,
+            dataMask);
+        skipped += read;
+        if (read < size) break;
+    }
+    return skipped;
+}
+
+
+/**
+ * Decodes the specified number of bytes from the huffman stream and creates
+ * a checkpoint index for them. Every <var>interval</var> decoded bytes the
+ * output position, the input position of the stream and the bit state
+ * (dataByte/dataMask) are recorded so the data can later be read from any
+ * position with wlHuffmanIndexRead() by resuming at the nearest checkpoint
+ * instead of decoding from the start. A read then decodes at most
+ * <var>interval</var> - 1 bytes which are not needed.
+ *
+ * The stream must be seekable and positioned behind the huffman tree (See
+ * wlHuffmanReadNode()). The index only references the tree, so the tree must
+ * not be freed before the index. When the stream ends before
+ * <var>size</var> bytes are decoded then the index covers the decoded bytes
+ * only. The index must be freed with wlHuffmanIndexFree().
+ *
+ * @param stream
+ *            The stream to read the huffman data from
+ * @param rootNode
+ *            The root node of the huffman tree
+ * @param block
+ *            The byte array in which the decoded bytes are stored. Can be
+ *            NULL if only the index is needed
+ * @param size
+ *            The number of bytes to decode
+ * @param interval
+ *            The number of bytes between two checkpoints
+ * @param dataByte
+ *            Storage for last read byte
+ * @param dataMask
+ *            Storage for last bit mask
+ * @return The checkpoint index or NULL if the stream position could not be
+ *         determined
+ */
+
+wlHuffmanIndex wlHuffmanIndexCreate(FILE *stream, wlHuffmanNode *rootNode,
+    unsigned char *block, int size, int interval, unsigned char *dataByte,
+    unsigned char *dataMask)
+{
+    wlHuffmanIndex index;
+    wlHuffmanCheckpoint *checkpoint;
+    int chunk, read;
+    long input;
+
+    assert(stream != NULL);
+    assert(rootNode != NULL);
+    assert(size >= 0);
+    assert(interval > 0);
+
+    index = malloc(sizeof(wlHuffmanIndexStruct));
+    index->rootNode = rootNode;
+    index->interval = interval;
+    index->quantity = 0;
+    index->checkpoints = malloc(sizeof(wlHuffmanCheckpoint)
+        * (size / interval + 2));
+    index->size = 0;
+    while (1)
+    {
+        // Record the checkpoint for the current output position
+        if ((input = ftell(stream)) == -1)
+        {
+            wlHuffmanIndexFree(index);
+            return NULL;
+        }
+        checkpoint = &index->checkpoints[index->quantity++];
+        checkpoint->output = index->size;
+        checkpoint->input = input;
+        checkpoint->dataByte = *dataByte;
+        checkpoint->dataMask = *dataMask;
+        if (index->size == size) break;
+
+        // Decode the bytes up to the next checkpoint
+        chunk = size - index->size < interval ? size - index->size : interval;
+        if (block)
+            read = wlHuffmanDecodeBlock(stream, block + index->size, chunk,
+                rootNode, dataByte, dataMask);
+        else
+            read = skipBytes(stream, rootNode, chunk, dataByte, dataMask);
+        index->size += read;
+        if (read < chunk) break;
+    }
+    return index;
+}
+
+
+/**
+ * Releases the memory allocated for the specified checkpoint index. The
+ * huffman tree is not freed.
+ *
+ * @param index
+ *            The index to free
+ */
+
+void wlHuffmanIndexFree(wlHuffmanIndex index)
+{
+    assert(index != NULL);
+    free(index->checkpoints);
+    free(index);
+}
+
+
+/**
+ * Reads decoded bytes from the specified output position of the huffman
+ * stream the index was created for. The stream is positioned at the
+ * nearest checkpoint before the position, the bytes up to the position are
+ * decoded and discarded and then the requested bytes are decoded. Reading
+ * beyond the data covered by the index returns fewer bytes.
+ *
+ * @param index
+ *            The checkpoint index
+ * @param stream
+ *            The stream the index was created for
+ * @param offset
+ *            The output position to read from
+ * @param block
+ *            The byte array in which the decoded bytes are stored
+ * @param size
+ *            The maximum number of bytes to read
+ * @return The number of read bytes or -1 if seeking the stream failed
+ */
+
+int wlHuffmanIndexRead(wlHuffmanIndex index, FILE *stream, int offset,
+    unsigned char *block, int size)
+{
+    wlHuffmanCheckpoint *checkpoint;
+    unsigned char dataByte, dataMask;
+
+    assert(index != NULL);
+    assert(stream != NULL);
+    assert(offset >= 0);
+    assert(block != NULL);
+    assert(size >= 0);
+
+    if (offset >= index->size) return 0;
+    if (size > index->size - offset) size = index->size - offset;
+
+    // Resume at the nearest checkpoint
+    checkpoint = &index->checkpoints[offset / index->interval];
+    if (fseek(stream, checkpoint->input, SEEK_SET)) return -1;
+    dataByte = checkpoint->dataByte;
+    dataMask = checkpoint->dataMask;
+    skipBytes(stream, index->rootNode, offset - checkpoint->output,
+        &dataByte, &dataMask);
+    return wlHuffmanDecodeBlock(stream, block, size, index->rootNode,
+        &dataByte, &dataMask);
+}
@@ -0,0 +1,301 @@
+/*
+ * $Id$
+ * Copyright (C) 2007  Klaus Reimer <k@ailis.de>
+ * See COPYING file for copying conditions
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "wasteland.h"
+
+/** The minimum number of input bits per chunk */
+#define MIN_CHUNK_BITS 65536
+
+typedef struct
+{
+    unsigned char *data;
+    size_t start;
+    size_t end;
+    size_t limit;
+    wlHuffmanNode *rootNode;
+    u_int64_t *marks;
+    unsigned char *symbols;
+    int capacity;
+    int quantity;
+    size_t stop;
+    int truncated;
+} wlHuffmanChunk;
+
+
+/**
+ * Decodes a single symbol at the specified bit position of the in-memory
+ * huffman stream.
+ *
+ * @param data
+ *            The huffman stream
+ * @param limit
+ *            The number of bits in the stream
+ * @param rootNode
+ *            The root node of the huffman tree
+ * @param pos
+ *            The bit position. It is moved behind the decoded symbol
+ * @return The symbol or -1 if the stream ends within the symbol
+ */
+
+static int decodeSymbol(unsigned char *data, size_t limit,
+    wlHuffmanNode *rootNode, size_t *pos)
+{
+    wlHuffmanNode *node;
+    unsigned int byte;
+    size_t p;
+
+    node = rootNode;
+    p = *pos;
+    byte = p < limit ? data[p >> 3] << (p & 7) : 0;
+    while (node->left)
+    {
+        if (p >= limit) return -1;
+        if (!(p & 7)) byte = data[p >> 3];
+        node = byte & 0x80 ? node->right : node->left;
+        byte <<= 1;
+        p++;
+    }
+    *pos = p;
+    return node->payload;
+}
+
+
+/**
+ * Decodes all symbols which start within the bit range of the specified
+ * chunk. The start position of each symbol is marked in the chunk's bitmap
+ * (if present) so the stitching can find the position where the
+ * speculative decoding of the chunk lines up with the real one.
+ *
+ * @param data
+ *            The chunk
+ * @return Always NULL
+ */
+
+static void * decodeChunk(void *data)
+{
+    wlHuffmanChunk *chunk;
+    size_t pos, start;
+    int symbol;
+
+    chunk = (wlHuffmanChunk *) data;
+    chunk->quantity = 0;
+    chunk->truncated = 0;
+    pos = chunk->start;
+    while (pos < chunk->end && chunk->quantity < chunk->capacity)
+    {
+        start = pos;
+        symbol = decodeSymbol(chunk->data, chunk->limit, chunk->rootNode,
+            &pos);
+        if (symbol < 0)
+        {
+            pos = start;
+            chunk->truncated = 1;
+            break;
+        }
+        if (chunk->marks)
+            chunk->marks[start >> 6] |= (u_int64_t) 1 << (start & 63);
+        chunk->symbols[chunk->quantity++] = symbol;
+    }
+    chunk->stop = pos;
+    return NULL;
+}
+
+
+/**
+ * Checks if the speculative decoding of the specified chunk has started a
+ * symbol at the specified bit position.
+ *
+ * @param chunk
+ *            The chunk
+ * @param pos
+ *            The bit position
+ * @return 1 if a symbol started there, 0 if not
+ */
+
+static int isMarked(wlHuffmanChunk *chunk, size_t pos)
+{
+    if (pos < chunk->start || pos >= chunk->stop) return 0;
+    return (chunk->marks[pos >> 6] >> (pos & 63)) & 1;
+}
+
+
+/**
+ * Returns the number of symbols the speculative decoding of the specified
+ * chunk has started before the specified bit position.
+ *
+ * @param chunk
+ *            The chunk
+ * @param pos
+ *            The bit position
+ * @return The number of symbols
+ */
+
+static int countMarks(wlHuffmanChunk *chunk, size_t pos)
+{
+    size_t p;
+    int count;
+
+    count = 0;
+    for (p = chunk->start; p < pos; p++)
+        count += (chunk->marks[p >> 6] >> (p & 63)) & 1;
+    return count;
+}
+
+
+/**
+ * Decodes a huffman stream which is completely in memory with multiple
+ * threads. The stream is split into chunks of equal bit length. The first
+ * chunk is decoded from the real start, all other chunks are decoded
+ * speculatively from the start of their bit range which usually is in the
+ * middle of a code. Huffman codes synchronize themselves after a few
+ * symbols, so when stitching the chunks together only the first symbols
+ * of each chunk have to be decoded again from the position where the
+ * previous chunk really ended until a symbol boundary is reached which the
+ * speculative decoding of the chunk has seen too. The result is identical
+ * to decoding the stream with wlHuffmanReadBlock().
+ *
+ * @param data
+ *            The huffman stream (Without the huffman tree)
+ * @param size
+ *            The size of the huffman stream in bytes
+ * @param bitOffset
+ *            The number of bits to skip in the first byte (0-7)
+ * @param rootNode
+ *            The root node of the huffman tree
+ * @param block
+ *            The byte array in which the decoded bytes are stored
+ * @param quantity
+ *            The maximum number of bytes to decode
+ * @param threads
+ *            The number of threads. 0 to use one thread per CPU
+ * @return The number of decoded bytes. Less than quantity if the stream
+ *         ended before. -1 if the threads could not be started (errno is
+ *         set then)
+ */
+
+int wlHuffmanDecodeParallel(unsigned char *data, size_t size, int bitOffset,
+    wlHuffmanNode *rootNode, unsigned char *block, int quantity, int threads)
+{
+    wlHuffmanChunk *chunks, *chunk;
+    pthread_t *workers;
+    u_int64_t *marks;
+    size_t bits, pos;
+    int i, count, symbol, sync, ended, error;
+
+    assert(data != NULL || !size);
+    assert(bitOffset >= 0 && bitOffset < 8);
+    assert(rootNode != NULL);
+    assert(block != NULL);
+    assert(quantity >= 0);
+
+    // A tree with a single symbol doesn't consume any bits
+    if (!rootNode->left)
+    {
+        memset(block, rootNode->payload, quantity);
+        return quantity;
+    }
+
+    // Determine the number of chunks
+    if (!threads) threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+    bits = size * 8 > bitOffset ? size * 8 - bitOffset : 0;
+    if (threads > bits / MIN_CHUNK_BITS) threads = bits / MIN_CHUNK_BITS;
+    if (threads < 1) threads = 1;
+
+    // Set up the chunks. The first chunk decodes directly into the block.
+    // The bit ranges of the other chunks start at 64 bit boundaries so
+    // each chunk marks symbol starts in its own bitmap words.
+    chunks = malloc(sizeof(wlHuffmanChunk) * threads);
+    marks = threads > 1 ? calloc((size * 8 + 63) / 64, sizeof(u_int64_t))
+        : NULL;
+    for (i = 0; i < threads; i++)
+    {
+        chunk = &chunks[i];
+        chunk->data = data;
+        chunk->limit = size * 8;
+        chunk->rootNode = rootNode;
+        chunk->start = i ? ((bitOffset + bits * i / threads) & ~63) :
+            bitOffset;
+        if (i) chunks[i - 1].end = chunk->start;
+        chunk->marks = i ? marks : NULL;
+    }
+    chunks[threads - 1].end = size * 8;
+    for (i = 0; i < threads; i++)
+    {
+        chunk = &chunks[i];
+        bits = chunk->end > chunk->start ? chunk->end - chunk->start : 0;
+        chunk->capacity = bits < quantity ? bits : quantity;
+        chunk->symbols = i ? malloc(chunk->capacity + 1) : block;
+    }
+
+    // Decode the chunks in parallel
+    workers = malloc(sizeof(pthread_t) * threads);
+    error = 0;
+    for (i = 1; i < threads; i++)
+    {
+        error = pthread_create(&workers[i], NULL, decodeChunk, &chunks[i]);
+        if (error) break;
+    }
+    count = i;
+    decodeChunk(&chunks[0]);
+    for (i = 1; i < count; i++) pthread_join(workers[i], NULL);
+    free(workers);
+
+    // Stitch the chunks together. Starting at the position where the
+    // previous chunk really ended, symbols are decoded until the
+    // speculative decoding of the chunk is in sync. The rest of the chunk
+    // is copied.
+    count = chunks[0].quantity;
+    pos = chunks[0].stop;
+    for (i = 1; !error && i < threads && count < quantity
+        && !chunks[i - 1].truncated; i++)
+    {
+        chunk = &chunks[i];
+        sync = 0;
+        ended = 0;
+        while (count < quantity && pos < chunk->end)
+        {
+            if ((sync = isMarked(chunk, pos))) break;
+            symbol = decodeSymbol(data, size * 8, rootNode, &pos);
+            if (symbol < 0)
+            {
+                ended = 1;
+                break;
+            }
+            block[count++] = symbol;
+        }
+        if (sync)
+        {
+            sync = countMarks(chunk, pos);
+            if (chunk->quantity - sync > quantity - count)
+                chunk->quantity = sync + quantity - count;
+            memcpy(block + count, chunk->symbols + sync,
+                chunk->quantity - sync);
+            count += chunk->quantity - sync;
+            pos = chunk->stop;
+        }
+        else
+            chunk->truncated = ended;
+    }
+
+    // Free resources
+    for (i = 1; i < threads; i++) free(chunks[i].symbols);
+    free(chunks);
+    free(marks);
+    if (error)
+    {
+        errno = error;
+        return -1;
+    }
+    return count;
+}
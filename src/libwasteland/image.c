@@ -96,3 +96,154 @@ void wlImageVXorDecode(wlImage image)
 {
 	wlVXorDecode(image->pixels, image->width, image->height);
 }
+
+
+/**
+ * Reads the pixels of the specified image from a huffman stream. Each
+ * decoded byte holds two pixels (High nibble first). The bytes are decoded
+ * with a single wlHuffmanDecodeBlock() call into the second half of the
+ * pixel array and are then expanded in place. The image is not vxor
+ * decoded.
+ *
+ * @param image
+ *            The image to fill. The width must be even
+ * @param stream
+ *            The stream to read the huffman data from
+ * @param rootNode
+ *            The root node of the huffman tree
+ * @param dataByte
+ *            Storage for last read byte
+ * @param dataMask
+ *            Storage for last bit mask
+ * @return 1 on success, 0 if the stream ended too early
+ */
+
+int wlImageDecodeHuffman(wlImage image, FILE *stream, wlHuffmanNode *rootNode,
+    unsigned char *dataByte, unsigned char *dataMask)
+{
+    wlPixel *packed;
+    int size, i, b;
+
+    assert(image != NULL);
+    size = image->width * image->height / 2;
+    packed = image->pixels + size;
+    if (wlHuffmanDecodeBlock(stream, packed, size, rootNode, dataByte,
+        dataMask) < size) return 0;
+
+    // Pixel pair i is written to 2i and 2i+1 which is never behind the
+    // packed byte size+i, so no unread byte is overwritten
+    for (i = 0; i < size; i++)
+    {
+        b = packed[i];
+        image->pixels[i * 2] = b >> 4;
+        image->pixels[i * 2 + 1] = b & 0x0f;
+    }
+    return 1;
+}
+
+
+/**
+ * Rotates a 64 bit value to the left.
+ *
+ * @param value
+ *            The value to rotate
+ * @param bits
+ *            The number of bits to rotate
+ * @return The rotated value
+ */
+
+static u_int64_t rotate(u_int64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+
+/**
+ * Reads eight pixels as a little endian 64 bit word so the hash is the same
+ * on all platforms. Compilers turn this into a single load on little endian
+ * CPUs.
+ *
+ * @param pixels
+ *            The pixels to read
+ * @return The word
+ */
+
+static u_int64_t readWord(wlPixel *pixels)
+{
+    return (u_int64_t) pixels[0] | ((u_int64_t) pixels[1] << 8)
+        | ((u_int64_t) pixels[2] << 16) | ((u_int64_t) pixels[3] << 24)
+        | ((u_int64_t) pixels[4] << 32) | ((u_int64_t) pixels[5] << 40)
+        | ((u_int64_t) pixels[6] << 48) | ((u_int64_t) pixels[7] << 56);
+}
+
+
+/**
+ * Mixes an eight byte word into a hash lane.
+ *
+ * @param lane
+ *            The current lane value
+ * @param word
+ *            The word to mix in
+ * @return The new lane value
+ */
+
+static u_int64_t mixLane(u_int64_t lane, u_int64_t word)
+{
+    return rotate(lane + word * 0xc2b2ae3d27d4eb4full, 31)
+        * 0x9e3779b185ebca87ull;
+}
+
+
+/**
+ * Calculates a 64 bit content hash over the size and the pixels of the
+ * specified image. Identical images always have the same hash so it can
+ * be used to find duplicate images. Different images may collide (which is
+ * very unlikely) so compare the pixels when you need to be sure. The hash
+ * does not depend on the byte order of the platform so it can be stored.
+ *
+ * The pixels are processed in 32 byte blocks with four independent lanes
+ * so the compiler can keep the multiplications of the lanes in flight
+ * at the same time (or put them into vector registers). A 16x16 tile is
+ * hashed in eight blocks.
+ *
+ * @param image
+ *            The image to hash
+ * @return The hash
+ */
+
+u_int64_t wlImageHash(wlImage image)
+{
+    u_int64_t lanes[4], hash;
+    wlPixel *pixels;
+    int size, i, j;
+
+    assert(image != NULL);
+    pixels = image->pixels;
+    size = image->width * image->height;
+    lanes[0] = 0x60ea27eeadc0b5d6ull;
+    lanes[1] = 0xc2b2ae3d27d4eb4full;
+    lanes[2] = 0;
+    lanes[3] = 0x61c8864e7a143579ull;
+    for (i = 0; i + 32 <= size; i += 32)
+    {
+        for (j = 0; j < 4; j++)
+            lanes[j] = mixLane(lanes[j], readWord(pixels + i + j * 8));
+    }
+
+    // Merge the lanes and add the size and the remaining pixels
+    hash = rotate(lanes[0], 1) + rotate(lanes[1], 7) + rotate(lanes[2], 12)
+        + rotate(lanes[3], 18);
+    hash ^= ((u_int64_t) image->width << 32) | (unsigned int) image->height;
+    hash *= 0x9e3779b185ebca87ull;
+    for (; i < size; i++)
+        hash = rotate(hash ^ (pixels[i] * 0x27d4eb2f165667c5ull), 11)
+            * 0x9e3779b185ebca87ull;
+
+    // Final avalanche so all bits depend on all input bits
+    hash ^= hash >> 33;
+    hash *= 0xc2b2ae3d27d4eb4full;
+    hash ^= hash >> 29;
+    hash *= 0x165667b19e3779f9ull;
+    hash ^= hash >> 32;
+    return hash;
+}
@@ -0,0 +1,380 @@
+/*
+ * $Id$
+ * Copyright (C) 2007  Klaus Reimer <k@ailis.de>
+ * See COPYING file for copying conditions
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "wasteland.h"
+
+/** The size of the MSQ header of a compressed block */
+#define HEADER_SIZE 8
+
+typedef struct
+{
+    unsigned char *header;
+    unsigned char *data;
+    size_t size;
+    unsigned char *decoded;
+    int quantity;
+    char *encoded;
+    size_t encodedSize;
+} wlMsqBlock;
+
+typedef struct
+{
+    wlMsqBlock *blocks;
+    int quantity;
+    int next;
+    pthread_mutex_t mutex;
+} wlMsqOptimizer;
+
+
+/**
+ * Reads the whole stream into memory.
+ *
+ * @param stream
+ *            The stream to read
+ * @param size
+ *            The number of read bytes is stored here
+ * @return The read data or NULL if reading failed
+ */
+
+static unsigned char * readStream(FILE *stream, size_t *size)
+{
+    unsigned char *data;
+    size_t capacity, read;
+
+    capacity = 65536;
+    data = malloc(capacity);
+    *size = 0;
+    while ((read = fread(data + *size, 1, capacity - *size, stream)) > 0)
+    {
+        *size += read;
+        if (*size == capacity)
+        {
+            capacity *= 2;
+            data = realloc(data, capacity);
+        }
+    }
+    if (ferror(stream))
+    {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+
+/**
+ * Checks if the specified data starts with the header of a huffman
+ * compressed MSQ block (A compressed block or the animation block of a CPA
+ * file). See wlMsqReadHeader().
+ *
+ * @param data
+ *            The data
+ * @param size
+ *            The size of the data
+ * @return The uncompressed size of the block or -1 if there is no header
+ */
+
+static int parseHeader(unsigned char *data, size_t size)
+{
+    long quantity;
+
+    if (size < HEADER_SIZE) return -1;
+    if (!(data[4] == 'm' && data[5] == 's' && data[6] == 'q'
+        && (data[7] == 0 || data[7] == 1))
+        && !(data[4] == 0x08 && data[5] == 0x67 && data[6] == 0x01
+        && data[7] == 0)) return -1;
+
+    // Each decoded byte needs at least one bit
+    quantity = data[0] | (data[1] << 8) | (data[2] << 16)
+        | ((long) data[3] << 24);
+    if (quantity > (size - HEADER_SIZE) * 8 || quantity > INT_MAX) return -1;
+    return quantity;
+}
+
+
+/**
+ * Decodes the huffman stream of a block. The huffman tree and exactly the
+ * number of bytes given in the header are decoded, so the size of the
+ * stream is known afterwards.
+ *
+ * @param block
+ *            The block. The data pointer must point behind the header and
+ *            the size must be the number of remaining bytes of the file.
+ *            The size is updated to the size of the huffman stream
+ * @return 1 on success, 0 if the data is no valid huffman stream or the
+ *         tree has only a single symbol
+ */
+
+static int decodeBlock(wlMsqBlock *block)
+{
+    FILE *stream;
+    wlHuffmanNode *rootNode;
+    unsigned char dataByte, dataMask;
+    int read;
+
+    if (!block->size || !(stream = fmemopen(block->data, block->size, "rb")))
+        return 0;
+    dataByte = 0;
+    dataMask = 0;
+    rootNode = wlHuffmanReadNode(stream, &dataByte, &dataMask);
+
+    // A tree with a single symbol consumes no bits while decoding, so the
+    // end of such a block can't be determined. The caller stops scanning
+    // there because the position of the next header is unknown
+    if (!rootNode || !rootNode->left)
+    {
+        if (rootNode) wlHuffmanFreeNode(rootNode);
+        fclose(stream);
+        return 0;
+    }
+    block->decoded = malloc(block->quantity ? block->quantity : 1);
+    read = wlHuffmanDecodeBlock(stream, block->decoded, block->quantity,
+        rootNode, &dataByte, &dataMask);
+    block->size = ftell(stream);
+    wlHuffmanFreeNode(rootNode);
+    fclose(stream);
+    if (read < block->quantity)
+    {
+        free(block->decoded);
+        return 0;
+    }
+    return 1;
+}
+
+
+/**
+ * Checks if the specified huffman stream decodes to the decoded data of the
+ * block.
+ *
+ * @param block
+ *            The block
+ * @param data
+ *            The huffman stream
+ * @param size
+ *            The size of the huffman stream
+ * @return 1 if the stream is correct, 0 if not
+ */
+
+static int verifyBlock(wlMsqBlock *block, char *data, size_t size)
+{
+    FILE *stream;
+    wlHuffmanNode *rootNode;
+    unsigned char dataByte, dataMask, *decoded;
+    int read;
+
+    if (!(stream = fmemopen(data, size, "rb"))) return 0;
+    dataByte = 0;
+    dataMask = 0;
+    read = -1;
+    decoded = malloc(block->quantity ? block->quantity : 1);
+    if ((rootNode = wlHuffmanReadNode(stream, &dataByte, &dataMask)))
+    {
+        read = wlHuffmanDecodeBlock(stream, decoded, block->quantity,
+            rootNode, &dataByte, &dataMask);
+        wlHuffmanFreeNode(rootNode);
+    }
+    fclose(stream);
+    read = read == block->quantity && !memcmp(decoded, block->decoded, read);
+    free(decoded);
+    return read;
+}
+
+
+/**
+ * Encodes the decoded data of the block with a huffman tree built for its
+ * exact histogram. The new huffman stream is kept if it decodes to the same
+ * data and is smaller than the original stream.
+ *
+ * @param block
+ *            The block
+ */
+
+static void encodeBlock(wlMsqBlock *block)
+{
+    FILE *stream;
+    wlHuffmanNode *rootNode, **nodeIndex;
+    wlHuffmanEncoder encoder;
+    unsigned char dataByte, dataMask;
+    int usage[256], result;
+
+    block->encoded = NULL;
+    block->encodedSize = 0;
+    wlHistogram256(block->decoded, block->quantity, usage);
+    rootNode = wlHuffmanBuildTreeFromUsage(usage, &nodeIndex);
+    if (!rootNode)
+    {
+        free(nodeIndex);
+        return;
+    }
+
+    // Blocks with a single symbol are kept (See decodeBlock())
+    result = 0;
+    if (rootNode->left && (stream = open_memstream(&block->encoded,
+        &block->encodedSize)))
+    {
+        dataByte = 0;
+        dataMask = 0;
+        result = wlHuffmanWriteNode(rootNode, stream, &dataByte, &dataMask);
+        encoder = wlHuffmanEncoderCreate(nodeIndex, stream, dataByte,
+            dataMask);
+        if (!wlHuffmanEncodeBlock(encoder, block->decoded, block->quantity))
+            result = 0;
+        if (!wlHuffmanEncoderFinish(encoder)) result = 0;
+        if (fclose(stream)) result = 0;
+    }
+    wlHuffmanFreeNode(rootNode);
+    free(nodeIndex);
+    if (!result || block->encodedSize >= block->size
+        || !verifyBlock(block, block->encoded, block->encodedSize))
+    {
+        free(block->encoded);
+        block->encoded = NULL;
+    }
+}
+
+
+/**
+ * The worker thread. Encodes the next block until all blocks are done.
+ *
+ * @param data
+ *            The optimizer
+ * @return Always NULL
+ */
+
+static void * worker(void *data)
+{
+    wlMsqOptimizer *optimizer;
+    int block;
+
+    optimizer = (wlMsqOptimizer *) data;
+    while (1)
+    {
+        pthread_mutex_lock(&optimizer->mutex);
+        block = optimizer->next++;
+        pthread_mutex_unlock(&optimizer->mutex);
+        if (block >= optimizer->quantity) break;
+        encodeBlock(&optimizer->blocks[block]);
+    }
+    return NULL;
+}
+
+
+/**
+ * Recompresses all huffman compressed MSQ blocks of a file (Tilesets,
+ * PICS, CPA and so on) with the optimal huffman tree for the exact
+ * histogram of each block. The blocks are read one after another until the
+ * data is no longer a valid compressed block. Such remaining data (An
+ * uncompressed file like a PIC or trailing bytes) is copied unchanged.
+ * The scan also stops at the first block whose huffman tree has only a
+ * single symbol because the end of such a block can't be determined. This
+ * block and all following blocks are copied unchanged, too, even if they
+ * could be optimized. A block is only replaced when the new huffman stream
+ * is smaller than the original one and decodes to identical data, so the
+ * written file decodes to exactly the same data and is never larger than
+ * the input. The MSQ headers are copied unchanged.
+ *
+ * The blocks are encoded in parallel by the specified number of threads.
+ * The output does not depend on the number of threads.
+ *
+ * @param input
+ *            The stream to read the file from
+ * @param output
+ *            The stream to write the optimized file to
+ * @param threads
+ *            The number of threads. 0 to use one thread per CPU
+ * @param blocks
+ *            Storage for the number of compressed blocks. May be NULL
+ * @param optimized
+ *            Storage for the number of replaced blocks. May be NULL
+ * @return 1 on success, 0 on failure. errno is set then
+ */
+
+int wlMsqOptimizeStream(FILE *input, FILE *output, int threads, int *blocks,
+    int *optimized)
+{
+    wlMsqOptimizer optimizer;
+    wlMsqBlock *block;
+    pthread_t *workers;
+    unsigned char *data;
+    size_t size, pos;
+    int quantity, replaced, i, result;
+
+    assert(input != NULL);
+    assert(output != NULL);
+    assert(threads >= 0);
+
+    if (!(data = readStream(input, &size))) return 0;
+
+    // Find and decode all compressed blocks
+    optimizer.blocks = NULL;
+    optimizer.quantity = 0;
+    pos = 0;
+    while ((quantity = parseHeader(data + pos, size - pos)) >= 0)
+    {
+        optimizer.blocks = realloc(optimizer.blocks, sizeof(wlMsqBlock)
+            * (optimizer.quantity + 1));
+        block = &optimizer.blocks[optimizer.quantity];
+        block->header = data + pos;
+        block->data = data + pos + HEADER_SIZE;
+        block->size = size - pos - HEADER_SIZE;
+        block->quantity = quantity;
+        if (!decodeBlock(block)) break;
+        optimizer.quantity++;
+        pos += HEADER_SIZE + block->size;
+    }
+
+    // Encode the blocks in parallel
+    if (!threads) threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > optimizer.quantity) threads = optimizer.quantity;
+    if (threads < 1) threads = 1;
+    optimizer.next = 0;
+    pthread_mutex_init(&optimizer.mutex, NULL);
+    workers = malloc(sizeof(pthread_t) * threads);
+    for (i = 1; i < threads; i++)
+    {
+        // With fewer threads the remaining blocks are encoded by the others
+        if (pthread_create(&workers[i], NULL, worker, &optimizer)) break;
+    }
+    quantity = i;
+    worker(&optimizer);
+    for (i = 1; i < quantity; i++) pthread_join(workers[i], NULL);
+    free(workers);
+    pthread_mutex_destroy(&optimizer.mutex);
+
+    // Write the blocks and the remaining data
+    result = 1;
+    replaced = 0;
+    for (i = 0; i < optimizer.quantity; i++)
+    {
+        block = &optimizer.blocks[i];
+        if (result && fwrite(block->header, 1, HEADER_SIZE, output)
+            != HEADER_SIZE) result = 0;
+        if (block->encoded)
+        {
+            replaced++;
+            if (result && fwrite(block->encoded, 1, block->encodedSize, output)
+                != block->encodedSize) result = 0;
+        }
+        else if (result && fwrite(block->data, 1, block->size, output)
+            != block->size) result = 0;
+        free(block->encoded);
+        free(block->decoded);
+    }
+    if (result && pos < size && fwrite(data + pos, 1, size - pos, output)
+        != size - pos) result = 0;
+    if (blocks) *blocks = optimizer.quantity;
+    if (optimized) *optimized = replaced;
+    free(optimizer.blocks);
+    free(data);
+    return result;
+}
@@ -29,11 +29,32 @@ wlPicsAnimations wlAnimationsReadFile(char *filename)
 {
     FILE *stream;
     wlPicsAnimations animations;
-    wlPicsAnimation animation;
 
     assert(filename != NULL);
     stream = fopen(filename, "rb");
     if (!stream) return NULL;
+    animations = wlAnimationsReadStream(stream);
+    fclose(stream);
+    return animations;
+}
+
+
+/**
+ * Reads all animated pictures from the specified stream until the end of
+ * the stream and returns them. The stream is not closed by this function.
+ * See wlAnimationsReadFile() for details.
+ *
+ * @param stream
+ *            The stream to read the animations from
+ * @return The animated pictures
+ */
+
+wlPicsAnimations wlAnimationsReadStream(FILE *stream)
+{
+    wlPicsAnimations animations;
+    wlPicsAnimation animation;
+
+    assert(stream != NULL);
 
     // Create the animations structure
     animations = malloc(sizeof(wlPicsAnimationsStruct));
@@ -44,8 +65,6 @@ wlPicsAnimations wlAnimationsReadFile(char *filename)
     {
         listAdd(animations->animations, animation, &animations->quantity);
     }
-
-    fclose(stream);
     return animations;
 }
 
@@ -75,21 +94,13 @@ static wlImage readBaseFrame(FILE *stream, wlHuffmanNode *rootNode,
         unsigned char *dataByte, unsigned char *dataMask)
 {
     wlImage image;
-    int x, y;
-    int b;
 
     image = wlImageCreate(96, 84);
-    for (y = 0; y < image->height; y++)
+    if (!wlImageDecodeHuffman(image, stream, rootNode, dataByte, dataMask))
     {
-        for (x = 0; x < image->width; x+= 2)
-        {
-            b = wlHuffmanReadByte(stream, rootNode, dataByte, dataMask);
-            if (b == EOF) return NULL;
-            image->pixels[y * image->width + x] = b >> 4;
-            image->pixels[y * image->width + x + 1] = b & 0x0f;
-        }
+        wlImageFree(image);
+        return NULL;
     }
-
     wlImageVXorDecode(image);
     return image;
 }
@@ -116,14 +127,21 @@ static wlPicsInstructions readInstructions(FILE *stream,
     wlPicsInstructions instructions;
     int size, i;
     unsigned char *data;
+    u_int16_t word;
     wlPicsInstruction instruction;
     wlPicsInstructionSet set;
 
     // Read the raw animation data
-    size = wlHuffmanReadWord(stream, rootNode, dataByte, dataMask);
-    if (size == -1) return NULL;
-    data = wlHuffmanReadBlock(stream, NULL, size, rootNode, dataByte, dataMask);
-    if (data == NULL) return NULL;
+    if (!wlHuffmanDecodeWords(stream, &word, 1, rootNode, dataByte, dataMask))
+        return NULL;
+    size = word;
+    data = malloc(size);
+    if (wlHuffmanDecodeBlock(stream, data, size, rootNode, dataByte, dataMask)
+        < size)
+    {
+        free(data);
+        return NULL;
+    }
 
     // Initializes instructions structure
     instructions = malloc(sizeof(wlPicsInstructionsStruct));
@@ -193,12 +211,19 @@ static wlPicsUpdates readUpdates(FILE *stream,
     wlPicsUpdate update;
     int size, i, len, tmp, j;
     unsigned char *data;
+    u_int16_t word;
 
     // Read the raw animation data
-    size = wlHuffmanReadWord(stream, rootNode, dataByte, dataMask);
-    if (size == -1) return NULL;
-    data = wlHuffmanReadBlock(stream, NULL, size, rootNode, dataByte, dataMask);
-    if (data == NULL) return NULL;
+    if (!wlHuffmanDecodeWords(stream, &word, 1, rootNode, dataByte, dataMask))
+        return NULL;
+    size = word;
+    data = malloc(size);
+    if (wlHuffmanDecodeBlock(stream, data, size, rootNode, dataByte, dataMask)
+        < size)
+    {
+        free(data);
+        return NULL;
+    }
 
     // Initializes the updates structure
     updates = malloc(sizeof(wlPicsUpdatesStruct));
@@ -281,6 +306,7 @@ wlPicsAnimation wlAnimationReadStream(FILE *stream)
     wlPicsAnimation animation;
     wlMsqHeader header;
     unsigned char dataByte, dataMask;
+    wlHuffmanDecoder decoder;
     wlHuffmanNode *rootNode;
 
     // Validate parameters
@@ -294,15 +320,17 @@ wlPicsAnimation wlAnimationReadStream(FILE *stream)
     // Initialize huffman stream for base frame
     dataByte = 0;
     dataMask = 0;
-    if (!(rootNode = wlHuffmanReadNode(stream, &dataByte, &dataMask)))
+    if (!(decoder = wlHuffmanCacheRead(stream, WL_HUFFMAN_TREE, &dataByte,
+        &dataMask)))
         return NULL;
+    rootNode = decoder->rootNode;
 
     // Initialize animation data structure and read base frame
     animation = (wlPicsAnimation) malloc(sizeof(wlPicsAnimationStruct));
     animation->baseFrame = readBaseFrame(stream, rootNode, &dataByte, &dataMask);
 
     // Free huffman data
-    wlHuffmanFreeNode(rootNode);
+    wlHuffmanCacheRelease(decoder);
 
     // Abort if no base frame was read
     if (!animation->baseFrame)
@@ -319,8 +347,10 @@ wlPicsAnimation wlAnimationReadStream(FILE *stream)
     // Initialize huffman stream for animation data
     dataByte = 0;
     dataMask = 0;
-    if (!(rootNode = wlHuffmanReadNode(stream, &dataByte, &dataMask)))
+    if (!(decoder = wlHuffmanCacheRead(stream, WL_HUFFMAN_TREE, &dataByte,
+        &dataMask)))
         return NULL;
+    rootNode = decoder->rootNode;
 
     // Read the animation instructions
     animation->instructions = readInstructions(stream, rootNode, &dataByte, &dataMask);
@@ -329,7 +359,7 @@ wlPicsAnimation wlAnimationReadStream(FILE *stream)
     animation->updates = readUpdates(stream, rootNode, &dataByte, &dataMask);
 
     // Free huffman data
-    wlHuffmanFreeNode(rootNode);
+    wlHuffmanCacheRelease(decoder);
 
     // Return the animation
     return animation;
@@ -395,28 +425,35 @@ void wlAnimationFree(wlPicsAnimation animation)
 
 
 /**
- * Applies an animation update set onto the specified image;
+ * Applies an animation update set onto the specified image. If a rectangle
+ * is specified then it is set to the bounding box of all pixels touched by
+ * the update set so callers can limit further processing to this area. The
+ * bounding box is empty (width and height are 0) if the set has no updates.
  *
  * @param image
  *            The image to apply the animation update set to
  * @param set
  *            The animation update set to apply
+ * @param dirty
+ *            Receives the changed area. NULL if not needed.
  */
 
-void wlAnimationApply(wlImage image, wlPicsUpdateSet set)
+void wlAnimationApply(wlImage image, wlPicsUpdateSet set, wlRect dirty)
 {
-    int i, j;
+    int i, j, offset;
     wlPicsUpdate update;
 
     assert(image != NULL);
     assert(set != NULL);
+    if (dirty) wlRectClear(dirty);
     for (i = 0; i < set->quantity; i++)
     {
         update = set->updates[i];
+        offset = update->x + update->y * image->width;
         for (j = 0; j < update->quantity; j++)
         {
-            image->pixels[(update->x + j) + update->y * image->width] ^=
-                update->pixelXORs[j];
+            image->pixels[offset + j] ^= update->pixelXORs[j];
         }
+        if (dirty) wlRectAddRun(dirty, image, offset, update->quantity);
     }
 }
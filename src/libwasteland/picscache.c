@@ -0,0 +1,233 @@
+/*
+ * $Id$
+ * Copyright (C) 2007  Klaus Reimer <k@ailis.de>
+ * See COPYING file for copying conditions
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include "wasteland.h"
+
+
+/**
+ * Creates a delta from the non-zero pixels of the specified XOR image. Only
+ * the specified area of the image is examined. The delta only stores the
+ * bounding rectangle of the changed pixels. If no pixel is changed then the
+ * delta is empty (Width and height are 0).
+ *
+ * @param xors
+ *            The XOR image
+ * @param area
+ *            The area of the XOR image which may contain changed pixels
+ * @return The delta
+ */
+
+static wlPicsDelta createDelta(wlImage xors, wlRect area)
+{
+    wlPicsDelta delta;
+    int x, y, minX, minY, maxX, maxY;
+
+    // Find the bounding rectangle of the changed pixels
+    minX = xors->width;
+    minY = xors->height;
+    maxX = -1;
+    maxY = -1;
+    for (y = area->y; y < area->y + area->height; y++)
+    {
+        for (x = area->x; x < area->x + area->width; x++)
+        {
+            if (!xors->pixels[y * xors->width + x]) continue;
+            if (x < minX) minX = x;
+            if (x > maxX) maxX = x;
+            if (y < minY) minY = y;
+            if (y > maxY) maxY = y;
+        }
+    }
+
+    // Copy the changed area into the delta
+    delta = malloc(sizeof(wlPicsDeltaStruct));
+    if (maxX < 0)
+    {
+        delta->x = 0;
+        delta->y = 0;
+        delta->width = 0;
+        delta->height = 0;
+        delta->xors = NULL;
+        return delta;
+    }
+    delta->x = minX;
+    delta->y = minY;
+    delta->width = maxX - minX + 1;
+    delta->height = maxY - minY + 1;
+    delta->xors = malloc(sizeof(wlPixel) * delta->width * delta->height);
+    for (y = 0; y < delta->height; y++)
+    {
+        memcpy(&delta->xors[y * delta->width],
+            &xors->pixels[(y + minY) * xors->width + minX],
+            sizeof(wlPixel) * delta->width);
+    }
+    return delta;
+}
+
+
+/**
+ * Releases the memory allocated for the specified delta.
+ *
+ * @param delta
+ *            The delta to free
+ */
+
+static void freeDelta(wlPicsDelta delta)
+{
+    free(delta->xors);
+    free(delta);
+}
+
+
+/**
+ * Creates a new frame cache for the specified picture animation. The cache
+ * materializes the frame changes of each step of each instruction set once
+ * (On first access) as a XOR delta rectangle so they can be applied
+ * over and over again without walking through the update lists. The cache
+ * can be shared by all consumers of the animation. The animation must not
+ * be freed as long as the cache is in use. You have to release the cache
+ * with wlPicsCacheFree() when you no longer need it.
+ *
+ * @param animation
+ *            The picture animation
+ * @return The frame cache
+ */
+
+wlPicsCache wlPicsCacheCreate(wlPicsAnimation animation)
+{
+    wlPicsCache cache;
+
+    assert(animation != NULL);
+    cache = malloc(sizeof(wlPicsCacheStruct));
+    cache->animation = animation;
+    cache->updates = calloc(animation->updates->quantity, sizeof(wlPicsDelta));
+    cache->resets = calloc(animation->instructions->quantity,
+        sizeof(wlPicsDelta));
+    return cache;
+}
+
+
+/**
+ * Releases all the memory allocated for the specified frame cache. The
+ * animation is not freed.
+ *
+ * @param cache
+ *            The frame cache to free
+ */
+
+void wlPicsCacheFree(wlPicsCache cache)
+{
+    int i;
+
+    assert(cache != NULL);
+    for (i = 0; i < cache->animation->updates->quantity; i++)
+    {
+        if (cache->updates[i]) freeDelta(cache->updates[i]);
+    }
+    for (i = 0; i < cache->animation->instructions->quantity; i++)
+    {
+        if (cache->resets[i]) freeDelta(cache->resets[i]);
+    }
+    free(cache->updates);
+    free(cache->resets);
+    free(cache);
+}
+
+
+/**
+ * Returns the delta which must be applied to the frame of an instruction set
+ * to get from the specified step to the next one. Step 0 is the base frame.
+ * For the last instruction of the set the returned delta leads back to the
+ * base frame so the instruction set can start over. The returned delta is
+ * owned by the cache.
+ *
+ * @param cache
+ *            The frame cache
+ * @param setNo
+ *            The instruction set index
+ * @param step
+ *            The step (The instruction index within the set)
+ * @return The delta
+ */
+
+wlPicsDelta wlPicsCacheGetDelta(wlPicsCache cache, int setNo, int step)
+{
+    wlPicsAnimation animation;
+    wlPicsInstructionSet set;
+    wlPicsDelta delta;
+    wlRectStruct area;
+    wlImage xors;
+    int update, i;
+
+    assert(cache != NULL);
+    animation = cache->animation;
+    assert(setNo >= 0 && setNo < animation->instructions->quantity);
+    set = animation->instructions->sets[setNo];
+    assert(step >= 0 && step < set->quantity);
+
+    if (step < set->quantity - 1)
+    {
+        // Materialize the delta of the update set
+        update = set->instructions[step]->update;
+        if (cache->updates[update]) return cache->updates[update];
+        xors = wlImageCreate(animation->baseFrame->width,
+            animation->baseFrame->height);
+        memset(xors->pixels, 0, sizeof(wlPixel) * xors->width * xors->height);
+        wlAnimationApply(xors, animation->updates->sets[update], &area);
+        cache->updates[update] = createDelta(xors, &area);
+        wlImageFree(xors);
+        return cache->updates[update];
+    }
+    else
+    {
+        // Materialize the delta which leads back to the base frame. This is
+        // the sum of all update sets of the instruction set.
+        if (cache->resets[setNo]) return cache->resets[setNo];
+        xors = wlImageCreate(animation->baseFrame->width,
+            animation->baseFrame->height);
+        memset(xors->pixels, 0, sizeof(wlPixel) * xors->width * xors->height);
+        wlRectClear(&area);
+        for (i = 0; i < set->quantity - 1; i++)
+        {
+            delta = wlPicsCacheGetDelta(cache, setNo, i);
+            wlPicsDeltaApply(xors, delta);
+            wlRectAdd(&area, delta->x, delta->y, delta->width, delta->height);
+        }
+        cache->resets[setNo] = createDelta(xors, &area);
+        wlImageFree(xors);
+        return cache->resets[setNo];
+    }
+}
+
+
+/**
+ * Applies the specified delta onto the specified image.
+ *
+ * @param image
+ *            The image to apply the delta to
+ * @param delta
+ *            The delta to apply
+ */
+
+void wlPicsDeltaApply(wlImage image, wlPicsDelta delta)
+{
+    int x, y;
+    wlPixel *pixels, *xors;
+
+    assert(image != NULL);
+    assert(delta != NULL);
+    for (y = 0; y < delta->height; y++)
+    {
+        pixels = &image->pixels[(delta->y + y) * image->width + delta->x];
+        xors = &delta->xors[y * delta->width];
+        for (x = 0; x < delta->width; x++) pixels[x] ^= xors[x];
+    }
+}
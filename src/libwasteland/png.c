@@ -0,0 +1,458 @@
+/*
+ * $Id$
+ * Copyright (C) 2007  Klaus Reimer <k@ailis.de>
+ * See COPYING file for copying conditions
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <zlib.h>
+#include "wasteland.h"
+
+/** The size of the buffer for compressed image data (Size of IDAT chunks) */
+#define IDAT_SIZE 32768
+
+
+/**
+ * Stores a 32 bit value in big endian byte order in the specified buffer.
+ *
+ * @param buffer
+ *            The buffer to write to
+ * @param value
+ *            The value to store
+ */
+
+static void putInt(unsigned char *buffer, unsigned long value)
+{
+    buffer[0] = (value >> 24) & 0xff;
+    buffer[1] = (value >> 16) & 0xff;
+    buffer[2] = (value >> 8) & 0xff;
+    buffer[3] = value & 0xff;
+}
+
+
+/**
+ * Writes a PNG chunk to the specified stream.
+ *
+ * @param stream
+ *            The stream to write the chunk to
+ * @param type
+ *            The four character chunk type
+ * @param data
+ *            The chunk data
+ * @param size
+ *            The size of the chunk data
+ * @return 1 on success, 0 on failure
+ */
+
+static int writeChunk(FILE *stream, char *type, unsigned char *data, int size)
+{
+    unsigned char buffer[4];
+    unsigned long crc;
+
+    putInt(buffer, size);
+    if (fwrite(buffer, 1, 4, stream) != 4) return 0;
+    if (fwrite(type, 1, 4, stream) != 4) return 0;
+    if (size && fwrite(data, 1, size, stream) != size) return 0;
+    crc = crc32(0, (unsigned char *) type, 4);
+    if (size) crc = crc32(crc, data, size);
+    putInt(buffer, crc);
+    return fwrite(buffer, 1, 4, stream) == 4;
+}
+
+
+/**
+ * Returns the Paeth predictor for the specified neighbour bytes.
+ *
+ * @param a
+ *            The left byte
+ * @param b
+ *            The upper byte
+ * @param c
+ *            The upper left byte
+ * @return The predictor
+ */
+
+static int paeth(int a, int b, int c)
+{
+    int p, pa, pb, pc;
+
+    p = a + b - c;
+    pa = abs(p - a);
+    pb = abs(p - b);
+    pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    if (pb <= pc) return b;
+    return c;
+}
+
+
+/**
+ * Filters a packed image row with the specified PNG filter type. The
+ * filtered row (Including the leading filter type byte) is written to the
+ * output buffer. Because the row is packed bytewise the left neighbour of
+ * a byte is always the previous byte.
+ *
+ * @param filter
+ *            The filter type (WL_PNG_FILTER_NONE to WL_PNG_FILTER_PAETH)
+ * @param row
+ *            The packed row
+ * @param prev
+ *            The packed previous row (All zero for the first row)
+ * @param size
+ *            The number of bytes in a packed row
+ * @param output
+ *            The output buffer. Must have room for size + 1 bytes
+ * @return The sum of the absolute (signed) filtered bytes. Lower values
+ *         usually compress better.
+ */
+
+static long filterRow(int filter, unsigned char *row, unsigned char *prev,
+    int size, unsigned char *output)
+{
+    int i, left, upperLeft, value;
+    long sum;
+
+    output[0] = filter;
+    sum = 0;
+    for (i = 0; i < size; i++)
+    {
+        left = i ? row[i - 1] : 0;
+        upperLeft = i ? prev[i - 1] : 0;
+        switch (filter)
+        {
+            case WL_PNG_FILTER_SUB:
+                value = row[i] - left;
+                break;
+
+            case WL_PNG_FILTER_UP:
+                value = row[i] - prev[i];
+                break;
+
+            case WL_PNG_FILTER_AVERAGE:
+                value = row[i] - ((left + prev[i]) >> 1);
+                break;
+
+            case WL_PNG_FILTER_PAETH:
+                value = row[i] - paeth(left, prev[i], upperLeft);
+                break;
+
+            default:
+                value = row[i];
+        }
+        output[i + 1] = value & 0xff;
+        sum += abs((signed char) (value & 0xff));
+    }
+    return sum;
+}
+
+
+/**
+ * Compresses the pending input of the specified compressor and writes every
+ * full output buffer as an IDAT chunk. When the compressor is finished
+ * then the remaining output is written as well.
+ *
+ * @param zstream
+ *            The compressor
+ * @param stream
+ *            The stream to write the chunks to
+ * @param idat
+ *            The output buffer of the compressor (IDAT_SIZE bytes)
+ * @param flush
+ *            Z_NO_FLUSH to compress the pending input, Z_FINISH to finish
+ *            the compressed data
+ * @return 1 on success, 0 on failure
+ */
+
+static int compressRows(z_stream *zstream, FILE *stream, unsigned char *idat,
+    int flush)
+{
+    int status;
+
+    do
+    {
+        status = deflate(zstream, flush);
+        if (status == Z_STREAM_ERROR) return 0;
+        if ((!zstream->avail_out || status == Z_STREAM_END)
+            && zstream->avail_out != IDAT_SIZE)
+        {
+            if (!writeChunk(stream, "IDAT", idat,
+                IDAT_SIZE - zstream->avail_out)) return 0;
+            zstream->next_out = idat;
+            zstream->avail_out = IDAT_SIZE;
+        }
+    }
+    while (flush == Z_FINISH ? status != Z_STREAM_END : zstream->avail_in);
+    return 1;
+}
+
+
+/**
+ * Writes the specified image to the specified file in PNG format. See
+ * wlPngWriteStream() for details.
+ *
+ * @param image
+ *            The image to write
+ * @param filename
+ *            The filename of the PNG file to write
+ * @param level
+ *            The zlib compression level (0-9, -1 for the default level)
+ * @param filter
+ *            The PNG row filter (One of the WL_PNG_FILTER_* constants)
+ * @return 1 on success, 0 on failure
+ */
+
+int wlPngWriteFile(wlImage image, char *filename, int level, int filter)
+{
+    return wlPngWriteScaledFile(image, filename, level, filter, 1,
+        WL_SCALE_NEAREST);
+}
+
+
+/**
+ * Writes the specified image to the specified stream in PNG format. The
+ * pixels are written as palette indices into the wasteland palette. If the
+ * image only uses the 16 palette colors then a 4 bit PNG is written.
+ * Otherwise an 8 bit PNG is written in which all pixels with a value of 16
+ * or higher use a 17th palette entry which is made fully transparent by a
+ * tRNS chunk.
+ *
+ * For paletted images WL_PNG_FILTER_NONE usually gives the best results.
+ * WL_PNG_FILTER_ADAPTIVE selects the filter with the lowest sum of absolute
+ * differences separately for each row.
+ *
+ * @param image
+ *            The image to write
+ * @param stream
+ *            The stream to write the PNG to
+ * @param level
+ *            The zlib compression level (0-9, -1 for the default level)
+ * @param filter
+ *            The PNG row filter (One of the WL_PNG_FILTER_* constants)
+ * @return 1 on success, 0 on failure
+ */
+
+int wlPngWriteStream(wlImage image, FILE *stream, int level, int filter)
+{
+    return wlPngWriteScaledStream(image, stream, level, filter, 1,
+        WL_SCALE_NEAREST);
+}
+
+
+/**
+ * Writes the specified image scaled by an integer factor to the specified
+ * file in PNG format. See wlPngWriteScaledStream() for details.
+ *
+ * @param image
+ *            The image to write
+ * @param filename
+ *            The filename of the PNG file to write
+ * @param level
+ *            The zlib compression level (0-9, -1 for the default level)
+ * @param filter
+ *            The PNG row filter (One of the WL_PNG_FILTER_* constants)
+ * @param factor
+ *            The scale factor
+ * @param method
+ *            The scale method (WL_SCALE_NEAREST or WL_SCALE_EPX)
+ * @return 1 on success, 0 on failure
+ */
+
+int wlPngWriteScaledFile(wlImage image, char *filename, int level,
+    int filter, int factor, int method)
+{
+    FILE *file;
+    int result;
+
+    assert(image != NULL);
+    assert(filename != NULL);
+    file = fopen(filename, "wb");
+    if (!file) return 0;
+    result = wlPngWriteScaledStream(image, file, level, filter, factor,
+        method);
+    if (fclose(file)) result = 0;
+    return result;
+}
+
+
+/**
+ * Writes the specified image scaled by an integer factor to the specified
+ * stream in PNG format. The image is scaled row by row while the PNG is
+ * written so no scaled copy of the whole image is needed (Except for EPX
+ * with factor 4 which is done by scaling a Scale2x copy of the image
+ * again). See wlPngWriteStream() and wlImageScale() for details.
+ *
+ * @param image
+ *            The image to write
+ * @param stream
+ *            The stream to write the PNG to
+ * @param level
+ *            The zlib compression level (0-9, -1 for the default level)
+ * @param filter
+ *            The PNG row filter (One of the WL_PNG_FILTER_* constants)
+ * @param factor
+ *            The scale factor
+ * @param method
+ *            The scale method (WL_SCALE_NEAREST or WL_SCALE_EPX)
+ * @return 1 on success, 0 on failure
+ */
+
+int wlPngWriteScaledStream(wlImage image, FILE *stream, int level,
+    int filter, int factor, int method)
+{
+    static unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    unsigned char header[13], palette[17 * 3], transparency[17];
+    unsigned char *row, *prev, *filtered, *best, *idat, *tmp;
+    wlPixel *band, *pixels;
+    wlImage half;
+    int x, y, i, size, width, depth, colors, rowFilter, result;
+    long sum, bestSum;
+    z_stream zstream;
+
+    assert(image != NULL);
+    assert(stream != NULL);
+    assert(level >= -1 && level <= 9);
+    assert(filter >= WL_PNG_FILTER_NONE && filter <= WL_PNG_FILTER_ADAPTIVE);
+    assert(factor > 0);
+    assert(method == WL_SCALE_NEAREST || (factor >= 2 && factor <= 4));
+
+    // EPX with factor 4 is Scale2x applied twice
+    if (method == WL_SCALE_EPX && factor == 4)
+    {
+        half = wlImageScale(image, 2, method);
+        result = wlPngWriteScaledStream(half, stream, level, filter, 2,
+            method);
+        wlImageFree(half);
+        return result;
+    }
+
+    // Use 4 bit pixels if transparency is not needed
+    depth = 4;
+    size = image->width * image->height;
+    for (i = 0; i < size; i++)
+    {
+        if (image->pixels[i] > 15)
+        {
+            depth = 8;
+            break;
+        }
+    }
+    colors = depth == 4 ? 16 : 17;
+
+    // Write the signature and the header chunk
+    width = image->width * factor;
+    if (fwrite(signature, 1, 8, stream) != 8) return 0;
+    putInt(header, width);
+    putInt(header + 4, image->height * factor);
+    header[8] = depth;
+    header[9] = 3;  // Color type: Palette
+    header[10] = 0; // Compression method: Deflate
+    header[11] = 0; // Filter method: Adaptive
+    header[12] = 0; // Interlace method: None
+    if (!writeChunk(stream, "IHDR", header, 13)) return 0;
+
+    // Write the palette and the transparency of the 17th color
+    for (i = 0; i < 16; i++)
+    {
+        palette[i * 3] = wlPalette[i].red;
+        palette[i * 3 + 1] = wlPalette[i].green;
+        palette[i * 3 + 2] = wlPalette[i].blue;
+        transparency[i] = 255;
+    }
+    palette[48] = palette[49] = palette[50] = 0;
+    transparency[16] = 0;
+    if (!writeChunk(stream, "PLTE", palette, colors * 3)) return 0;
+    if (colors == 17 && !writeChunk(stream, "tRNS", transparency, 17))
+        return 0;
+
+    // Initialize the compressor
+    memset(&zstream, 0, sizeof(zstream));
+    if (deflateInit2(&zstream, level, Z_DEFLATED, 15, 8,
+        filter == WL_PNG_FILTER_NONE ? Z_DEFAULT_STRATEGY : Z_FILTERED)
+        != Z_OK)
+    {
+        errno = ENOMEM;
+        return 0;
+    }
+    size = depth == 4 ? (width + 1) / 2 : width;
+    row = malloc(size);
+    prev = calloc(size, 1);
+    filtered = malloc(size + 1);
+    best = malloc(size + 1);
+    idat = malloc(IDAT_SIZE);
+    band = factor > 1 ? malloc(width * factor) : NULL;
+    zstream.next_out = idat;
+    zstream.avail_out = IDAT_SIZE;
+
+    // Scale, pack, filter and compress the rows
+    result = 1;
+    for (y = 0; y < image->height * factor && result; y++)
+    {
+        if (factor == 1)
+        {
+            pixels = &image->pixels[y * width];
+        }
+        else
+        {
+            if (!(y % factor))
+                wlImageScaleRow(image, y / factor, factor, method, band);
+            pixels = &band[(y % factor) * width];
+        }
+        if (depth == 4)
+        {
+            memset(row, 0, size);
+            for (x = 0; x < width; x++)
+                row[x >> 1] |= pixels[x] << ((x & 1) ? 0 : 4);
+        }
+        else
+        {
+            for (x = 0; x < width; x++)
+                row[x] = pixels[x] > 15 ? 16 : pixels[x];
+        }
+        if (filter == WL_PNG_FILTER_ADAPTIVE)
+        {
+            bestSum = -1;
+            for (rowFilter = WL_PNG_FILTER_NONE;
+                rowFilter <= WL_PNG_FILTER_PAETH; rowFilter++)
+            {
+                sum = filterRow(rowFilter, row, prev, size, filtered);
+                if (bestSum < 0 || sum < bestSum)
+                {
+                    bestSum = sum;
+                    tmp = best;
+                    best = filtered;
+                    filtered = tmp;
+                }
+            }
+        }
+        else
+        {
+            filterRow(filter, row, prev, size, best);
+        }
+        tmp = prev;
+        prev = row;
+        row = tmp;
+        zstream.next_in = best;
+        zstream.avail_in = size + 1;
+        result = compressRows(&zstream, stream, idat, Z_NO_FLUSH);
+    }
+    if (result)
+    {
+        zstream.next_in = NULL;
+        zstream.avail_in = 0;
+        result = compressRows(&zstream, stream, idat, Z_FINISH);
+    }
+    deflateEnd(&zstream);
+    free(row);
+    free(prev);
+    free(filtered);
+    free(best);
+    free(idat);
+    free(band);
+
+    // Write the end chunk
+    return result && writeChunk(stream, "IEND", NULL, 0);
+}
@@ -0,0 +1,335 @@
+/*
+ * $Id$
+ * Copyright (C) 2007  Klaus Reimer <k@ailis.de>
+ * See COPYING file for copying conditions
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "wasteland.h"
+
+/** The number of queued images per worker thread */
+#define JOBS_PER_THREAD 4
+
+typedef struct
+{
+    wlImage image;
+    wlDir dir;
+    char *filename;
+    char *data;
+    size_t size;
+    int error;
+    int done;
+} wlPngQueueJob;
+
+struct wlPngQueueStruct
+{
+    int level;
+    int filter;
+    int factor;
+    int method;
+    int threads;
+    pthread_t *workers;
+    int capacity;
+    wlPngQueueJob *jobs;
+    int head;
+    int next;
+    int tail;
+    int stop;
+    int error;
+    pthread_mutex_t mutex;
+    pthread_cond_t work;
+    pthread_cond_t done;
+};
+
+
+/**
+ * Compresses the image of the specified job into an in-memory PNG.
+ *
+ * @param queue
+ *            The PNG queue
+ * @param job
+ *            The job to compress
+ */
+
+static void compressJob(wlPngQueue queue, wlPngQueueJob *job)
+{
+    FILE *stream;
+
+    job->data = NULL;
+    job->size = 0;
+    job->error = 0;
+    stream = open_memstream(&job->data, &job->size);
+    if (!stream)
+    {
+        job->error = errno;
+        return;
+    }
+    if (!wlPngWriteScaledStream(job->image, stream, queue->level,
+        queue->filter, queue->factor, queue->method))
+        job->error = errno ? errno : EIO;
+    if (fclose(stream) && !job->error) job->error = errno;
+}
+
+
+/**
+ * Writes the compressed PNG of the specified job into its file and releases
+ * the resources of the job. The first error is remembered in the queue.
+ *
+ * @param queue
+ *            The PNG queue
+ * @param job
+ *            The job to write
+ */
+
+static void writeJob(wlPngQueue queue, wlPngQueueJob *job)
+{
+    if (!job->error && !wlDirWriteFile(job->dir, job->filename, job->data,
+        job->size))
+        job->error = errno ? errno : EIO;
+    if (job->error && !queue->error) queue->error = job->error;
+    free(job->data);
+    free(job->filename);
+    wlImageFree(job->image);
+}
+
+
+/**
+ * The worker thread. Takes the next queued job, compresses it and marks it
+ * as done until the queue is stopped and empty.
+ *
+ * @param data
+ *            The PNG queue
+ * @return Always NULL
+ */
+
+static void * worker(void *data)
+{
+    wlPngQueue queue;
+    wlPngQueueJob *job;
+
+    queue = (wlPngQueue) data;
+    pthread_mutex_lock(&queue->mutex);
+    while (1)
+    {
+        while (!queue->stop && queue->next == queue->tail)
+            pthread_cond_wait(&queue->work, &queue->mutex);
+        if (queue->next == queue->tail) break;
+        job = &queue->jobs[queue->next++ % queue->capacity];
+        pthread_mutex_unlock(&queue->mutex);
+        compressJob(queue, job);
+        pthread_mutex_lock(&queue->mutex);
+        job->done = 1;
+        pthread_cond_signal(&queue->done);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return NULL;
+}
+
+
+/**
+ * Waits for the oldest queued job to be compressed and writes it. Must be
+ * called with the locked mutex.
+ *
+ * @param queue
+ *            The PNG queue
+ */
+
+static void writeHead(wlPngQueue queue)
+{
+    wlPngQueueJob *job;
+
+    job = &queue->jobs[queue->head % queue->capacity];
+    while (!job->done) pthread_cond_wait(&queue->done, &queue->mutex);
+    pthread_mutex_unlock(&queue->mutex);
+    writeJob(queue, job);
+    pthread_mutex_lock(&queue->mutex);
+    queue->head++;
+}
+
+
+/**
+ * Creates a new PNG output queue. Images added to the queue with
+ * wlPngQueueAdd() are converted and compressed by a pool of worker threads
+ * while the caller continues to produce the next images. The compressed
+ * files are written by the calling thread in the order in which the
+ * images were added, so the output is identical to writing the images
+ * one after another with wlPngWriteScaledFile(). The number of queued
+ * images is bounded so the memory usage does not depend on the number of
+ * images.
+ *
+ * You have to call wlPngQueueFinish() to write the remaining images and
+ * to release the queue.
+ *
+ * @param threads
+ *            The number of worker threads. 0 to use one thread per CPU.
+ *            1 to compress and write each image directly in
+ *            wlPngQueueAdd() without starting any thread
+ * @param level
+ *            The compression level (0-9). -1 for the default level
+ * @param filter
+ *            The PNG row filter (WL_PNG_FILTER_*)
+ * @param factor
+ *            The scale factor
+ * @param method
+ *            The scale method (WL_SCALE_NEAREST or WL_SCALE_EPX)
+ * @return The PNG queue or NULL if the worker threads could not be started
+ */
+
+wlPngQueue wlPngQueueCreate(int threads, int level, int filter, int factor,
+    int method)
+{
+    wlPngQueue queue;
+    int i, error;
+
+    assert(threads >= 0);
+    if (!threads) threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+    queue = malloc(sizeof(struct wlPngQueueStruct));
+    queue->level = level;
+    queue->filter = filter;
+    queue->factor = factor;
+    queue->method = method;
+    queue->threads = threads;
+    queue->head = queue->next = queue->tail = 0;
+    queue->stop = 0;
+    queue->error = 0;
+    queue->capacity = threads * JOBS_PER_THREAD;
+    queue->jobs = malloc(sizeof(wlPngQueueJob) * queue->capacity);
+    queue->workers = NULL;
+    if (threads == 1) return queue;
+
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->work, NULL);
+    pthread_cond_init(&queue->done, NULL);
+    queue->workers = malloc(sizeof(pthread_t) * threads);
+    for (i = 0; i < threads; i++)
+    {
+        error = pthread_create(&queue->workers[i], NULL, worker, queue);
+        if (error)
+        {
+            queue->threads = i;
+            wlPngQueueFinish(queue);
+            errno = error;
+            return NULL;
+        }
+    }
+    return queue;
+}
+
+
+/**
+ * Adds an image to the PNG queue. The image is copied so the caller may
+ * modify or free it right after this call. The file is created in the
+ * specified directory (See wlDirOpen()) so the current working directory
+ * of the process is never changed and the files can also be written into
+ * a tar stream. When the queue is full then this function writes the
+ * oldest images first.
+ *
+ * If writing a previously added image has failed then 0 is returned and
+ * errno is set. The remaining images are still written.
+ *
+ * @param queue
+ *            The PNG queue
+ * @param image
+ *            The image to write
+ * @param dir
+ *            The output directory. Must stay open until the queue is
+ *            finished
+ * @param filename
+ *            The filename relative to the directory
+ * @return 1 on success, 0 if an error occurred so far
+ */
+
+int wlPngQueueAdd(wlPngQueue queue, wlImage image, wlDir dir, char *filename)
+{
+    wlPngQueueJob *job;
+
+    assert(queue != NULL);
+    assert(image != NULL);
+    assert(dir != NULL);
+    assert(filename != NULL);
+
+    // Without worker threads the image is written directly
+    if (!queue->workers)
+    {
+        job = &queue->jobs[0];
+        job->image = wlImageClone(image);
+        job->dir = dir;
+        job->filename = strdup(filename);
+        compressJob(queue, job);
+        writeJob(queue, job);
+    }
+    else
+    {
+        pthread_mutex_lock(&queue->mutex);
+
+        // Write all finished images and make room for the new one
+        while (queue->head < queue->tail
+            && (queue->tail - queue->head == queue->capacity
+            || queue->jobs[queue->head % queue->capacity].done))
+            writeHead(queue);
+
+        job = &queue->jobs[queue->tail % queue->capacity];
+        job->image = wlImageClone(image);
+        job->dir = dir;
+        job->filename = strdup(filename);
+        job->done = 0;
+        queue->tail++;
+        pthread_cond_signal(&queue->work);
+        pthread_mutex_unlock(&queue->mutex);
+    }
+
+    if (queue->error)
+    {
+        errno = queue->error;
+        return 0;
+    }
+    return 1;
+}
+
+
+/**
+ * Writes all remaining images of the PNG queue, stops the worker threads
+ * and releases the queue.
+ *
+ * @param queue
+ *            The PNG queue
+ * @return 1 if all images were written, 0 if an error occurred. errno
+ *         is set to the first error
+ */
+
+int wlPngQueueFinish(wlPngQueue queue)
+{
+    int i, error;
+
+    assert(queue != NULL);
+    if (queue->workers)
+    {
+        pthread_mutex_lock(&queue->mutex);
+        queue->stop = 1;
+        pthread_cond_broadcast(&queue->work);
+        while (queue->head < queue->tail) writeHead(queue);
+        pthread_mutex_unlock(&queue->mutex);
+        for (i = 0; i < queue->threads; i++)
+            pthread_join(queue->workers[i], NULL);
+        pthread_mutex_destroy(&queue->mutex);
+        pthread_cond_destroy(&queue->work);
+        pthread_cond_destroy(&queue->done);
+        free(queue->workers);
+    }
+    error = queue->error;
+    free(queue->jobs);
+    free(queue);
+    if (error)
+    {
+        errno = error;
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,224 @@
+/*
+ * $Id$
+ * Copyright (C) 2007  Klaus Reimer <k@ailis.de>
+ * See COPYING file for copying conditions
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include "wasteland.h"
+
+/** Marks a used slot in the exact match hash (So black can be stored) */
+#define USED 0x1000000
+
+/** 4x4 Bayer matrix for the ordered dither */
+static int bayer[4][4] = {
+    {  0,  8,  2, 10 },
+    { 12,  4, 14,  6 },
+    {  3, 11,  1,  9 },
+    { 15,  7, 13,  5 }
+};
+
+
+/**
+ * Returns the exact match hash slot for the specified 24 bit color.
+ *
+ * @param color
+ *            The color (0xRRGGBB)
+ * @return The hash slot
+ */
+
+static int hashColor(unsigned int color)
+{
+    return ((color * 2654435761u) >> 26) & (WL_QUANTIZER_HASH_SIZE - 1);
+}
+
+
+/**
+ * Returns the palette index which is nearest to the specified color.
+ *
+ * @param palette
+ *            The 16 color palette
+ * @param red
+ *            The red component
+ * @param green
+ *            The green component
+ * @param blue
+ *            The blue component
+ * @return The nearest palette index
+ */
+
+static int findNearest(wlRGB *palette, int red, int green, int blue)
+{
+    int i, best, distance, bestDistance, dr, dg, db;
+
+    best = 0;
+    bestDistance = -1;
+    for (i = 0; i < 16; i++)
+    {
+        dr = red - palette[i].red;
+        dg = green - palette[i].green;
+        db = blue - palette[i].blue;
+        distance = dr * dr + dg * dg + db * db;
+        if (bestDistance < 0 || distance < bestDistance)
+        {
+            best = i;
+            bestDistance = distance;
+        }
+    }
+    return best;
+}
+
+
+/**
+ * Creates a new quantizer which maps true color pixels onto the specified
+ * 16 color palette. Colors which exactly match a palette color are found
+ * through a small hash table. All other colors are mapped with a
+ * precomputed table which stores the nearest palette color for each
+ * 5-6-5 bit RGB value. You have to release the quantizer with
+ * wlQuantizerFree() when you no longer need it.
+ *
+ * @param palette
+ *            The 16 color palette. NULL for the default palette (wlPalette)
+ * @return The quantizer
+ */
+
+wlQuantizer wlQuantizerCreate(wlRGB *palette)
+{
+    wlQuantizer quantizer;
+    unsigned int color;
+    int i, slot, red, green, blue;
+
+    if (!palette) palette = wlPalette;
+    quantizer = malloc(sizeof(wlQuantizerStruct));
+    memcpy(quantizer->palette, palette, sizeof(wlRGB) * 16);
+
+    // Build the exact match hash. When the palette contains the same
+    // color twice then the first index wins like in the nearest color
+    // search.
+    memset(quantizer->keys, 0, sizeof(quantizer->keys));
+    for (i = 0; i < 16; i++)
+    {
+        color = (palette[i].red << 16) | (palette[i].green << 8)
+            | palette[i].blue | USED;
+        slot = hashColor(color & 0xffffff);
+        while (quantizer->keys[slot] && quantizer->keys[slot] != color)
+            slot = (slot + 1) & (WL_QUANTIZER_HASH_SIZE - 1);
+        if (quantizer->keys[slot]) continue;
+        quantizer->keys[slot] = color;
+        quantizer->values[slot] = i;
+    }
+
+    // Build the nearest color table. Each entry uses the center of the
+    // color range it represents.
+    for (i = 0; i < 65536; i++)
+    {
+        red = ((i >> 11) << 3) | 4;
+        green = (((i >> 5) & 0x3f) << 2) | 2;
+        blue = ((i & 0x1f) << 3) | 4;
+        quantizer->nearest[i] = findNearest(palette, red, green, blue);
+    }
+    return quantizer;
+}
+
+
+/**
+ * Releases the memory allocated for the specified quantizer.
+ *
+ * @param quantizer
+ *            The quantizer to free
+ */
+
+void wlQuantizerFree(wlQuantizer quantizer)
+{
+    assert(quantizer != NULL);
+    free(quantizer);
+}
+
+
+/**
+ * Maps RGBA pixels (Four bytes per pixel in the order red, green, blue,
+ * alpha) onto the palette of the quantizer and stores the palette indices
+ * in the specified image. The size of the RGBA pixel buffer must match the
+ * size of the image.
+ *
+ * Pixels which exactly match a palette color always get this palette
+ * index. All other pixels get the nearest palette color. If dithering is
+ * enabled then an ordered dither is added to these pixels before the
+ * nearest color is looked up so color gradients are approximated by
+ * patterns instead of bands.
+ *
+ * @param quantizer
+ *            The quantizer
+ * @param rgba
+ *            The RGBA pixels to map
+ * @param stride
+ *            The number of bytes from one row to the next in the RGBA
+ *            buffer. 0 for tightly packed rows (Four times the width)
+ * @param image
+ *            The image to store the palette indices in
+ * @param transparent
+ *            The pixel value to use for pixels which are more than half
+ *            transparent. -1 to ignore the alpha channel
+ * @param dither
+ *            1 to enable the ordered dither, 0 to disable it
+ */
+
+void wlQuantizerMap(wlQuantizer quantizer, unsigned char *rgba, int stride,
+    wlImage image, int transparent, int dither)
+{
+    unsigned char *pixel;
+    unsigned int color;
+    int x, y, slot, red, green, blue, bias;
+
+    assert(quantizer != NULL);
+    assert(rgba != NULL);
+    assert(image != NULL);
+    assert(stride == 0 || stride >= image->width * 4);
+    if (!stride) stride = image->width * 4;
+    for (y = 0; y < image->height; y++)
+    {
+        pixel = rgba + y * stride;
+        for (x = 0; x < image->width; x++, pixel += 4)
+        {
+            if (transparent >= 0 && pixel[3] < 128)
+            {
+                image->pixels[y * image->width + x] = transparent;
+                continue;
+            }
+
+            // Exact match fast path
+            color = (pixel[0] << 16) | (pixel[1] << 8) | pixel[2];
+            slot = hashColor(color);
+            color |= USED;
+            while (quantizer->keys[slot] && quantizer->keys[slot] != color)
+                slot = (slot + 1) & (WL_QUANTIZER_HASH_SIZE - 1);
+            if (quantizer->keys[slot])
+            {
+                image->pixels[y * image->width + x] = quantizer->values[slot];
+                continue;
+            }
+
+            // Nearest color with optional ordered dither. The dither spreads
+            // over the distance of the EGA color levels (0x55).
+            red = pixel[0];
+            green = pixel[1];
+            blue = pixel[2];
+            if (dither)
+            {
+                bias = (bayer[y & 3][x & 3] * 2 - 15) * 0x55 / 32;
+                red += bias;
+                green += bias;
+                blue += bias;
+                if (red < 0) red = 0; else if (red > 255) red = 255;
+                if (green < 0) green = 0; else if (green > 255) green = 255;
+                if (blue < 0) blue = 0; else if (blue > 255) blue = 255;
+            }
+            image->pixels[y * image->width + x] = quantizer->nearest[
+                ((red >> 3) << 11) | ((green >> 2) << 5) | (blue >> 3)];
+        }
+    }
+}
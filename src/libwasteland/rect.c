@@ -0,0 +1,102 @@
+/*
+ * $Id$
+ * Copyright (C) 2007  Klaus Reimer <k@ailis.de>
+ * See COPYING file for copying conditions
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include "wasteland.h"
+
+
+/**
+ * Resets the specified rectangle to an empty rectangle.
+ *
+ * @param rect
+ *            The rectangle to clear
+ */
+
+void wlRectClear(wlRect rect)
+{
+    assert(rect != NULL);
+    rect->x = 0;
+    rect->y = 0;
+    rect->width = 0;
+    rect->height = 0;
+}
+
+
+/**
+ * Extends the specified rectangle so it also covers the specified area.
+ *
+ * @param rect
+ *            The rectangle to extend
+ * @param x
+ *            The left edge of the area
+ * @param y
+ *            The top edge of the area
+ * @param width
+ *            The width of the area
+ * @param height
+ *            The height of the area
+ */
+
+void wlRectAdd(wlRect rect, int x, int y, int width, int height)
+{
+    int right, bottom;
+
+    assert(rect != NULL);
+    if (width <= 0 || height <= 0) return;
+    if (!rect->width || !rect->height)
+    {
+        rect->x = x;
+        rect->y = y;
+        rect->width = width;
+        rect->height = height;
+        return;
+    }
+    right = rect->x + rect->width;
+    bottom = rect->y + rect->height;
+    if (x + width > right) right = x + width;
+    if (y + height > bottom) bottom = y + height;
+    if (x < rect->x) rect->x = x;
+    if (y < rect->y) rect->y = y;
+    rect->width = right - rect->x;
+    rect->height = bottom - rect->y;
+}
+
+
+/**
+ * Extends the specified rectangle so it also covers a run of pixels in an
+ * image. The run starts at the specified pixel offset and may continue on
+ * the following rows. The area is clipped to the image.
+ *
+ * @param rect
+ *            The rectangle to extend
+ * @param image
+ *            The image
+ * @param offset
+ *            The offset of the first pixel (y * width + x)
+ * @param quantity
+ *            The number of pixels in the run
+ */
+
+void wlRectAddRun(wlRect rect, wlImage image, int offset, int quantity)
+{
+    int first, last, size;
+
+    assert(rect != NULL);
+    assert(image != NULL);
+    size = image->width * image->height;
+    if (quantity <= 0 || offset >= size) return;
+    if (offset + quantity > size) quantity = size - offset;
+    first = offset / image->width;
+    last = (offset + quantity - 1) / image->width;
+    if (first == last)
+        wlRectAdd(rect, offset % image->width, first, quantity, 1);
+    else
+        wlRectAdd(rect, 0, first, image->width, last - first + 1);
+}
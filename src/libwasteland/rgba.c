@@ -0,0 +1,245 @@
+/*
+ * $Id$
+ * Copyright (C) 2007  Klaus Reimer <k@ailis.de>
+ * See COPYING file for copying conditions
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wasteland.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define WL_RGBA_SSSE3
+#include <tmmintrin.h>
+#endif
+
+
+/**
+ * Builds the lookup table which maps all possible pixel values to RGBA
+ * colors. The first 16 entries are taken from the palette and are opaque.
+ * All other entries and the color key entry are fully transparent (All
+ * four components are 0).
+ *
+ * @param table
+ *            The table to fill (256 RGBA entries)
+ * @param palette
+ *            The 16 color palette
+ * @param transparent
+ *            The palette index which is transparent. -1 for none
+ */
+
+static void buildTable(unsigned char table[256][4], wlRGB *palette,
+    int transparent)
+{
+    int i;
+
+    memset(table, 0, 256 * 4);
+    for (i = 0; i < 16; i++)
+    {
+        if (i == transparent) continue;
+        table[i][0] = palette[i].red;
+        table[i][1] = palette[i].green;
+        table[i][2] = palette[i].blue;
+        table[i][3] = 0xff;
+    }
+}
+
+
+/**
+ * Converts a row of pixels to RGBA with the specified lookup table.
+ *
+ * @param pixels
+ *            The pixels to convert
+ * @param quantity
+ *            The number of pixels
+ * @param table
+ *            The lookup table created with buildTable()
+ * @param output
+ *            The output buffer (4 bytes per pixel)
+ */
+
+static void convertRow(wlPixel *pixels, int quantity,
+    unsigned char table[256][4], unsigned char *output)
+{
+    int i;
+
+    for (i = 0; i < quantity; i++) memcpy(output + i * 4, table[pixels[i]], 4);
+}
+
+
+#ifdef WL_RGBA_SSSE3
+
+/**
+ * Converts a row of pixels to RGBA with SSSE3 instructions. The palette
+ * lookup is done with one byte shuffle per color component for 16 pixels
+ * at once. The color key is already transparent in the shuffle tables.
+ * The remaining pixels at the end of the row are converted with the lookup
+ * table.
+ *
+ * @param pixels
+ *            The pixels to convert
+ * @param quantity
+ *            The number of pixels
+ * @param table
+ *            The lookup table created with buildTable()
+ * @param output
+ *            The output buffer (4 bytes per pixel)
+ */
+
+__attribute__((target("ssse3")))
+static void convertRowSsse3(wlPixel *pixels, int quantity,
+    unsigned char table[256][4], unsigned char *output)
+{
+    unsigned char components[4][16];
+    __m128i red, green, blue, alpha, high, indices;
+    __m128i r, g, b, a, rg, ba;
+    int i, j;
+
+    // Split the table into one shuffle table per color component
+    for (i = 0; i < 16; i++)
+    {
+        for (j = 0; j < 4; j++) components[j][i] = table[i][j];
+    }
+    red = _mm_loadu_si128((__m128i *) components[0]);
+    green = _mm_loadu_si128((__m128i *) components[1]);
+    blue = _mm_loadu_si128((__m128i *) components[2]);
+    alpha = _mm_loadu_si128((__m128i *) components[3]);
+    high = _mm_set1_epi8(0x70);
+
+    for (i = 0; i + 16 <= quantity; i += 16)
+    {
+        // The saturated add keeps the palette index in the low nibble but
+        // sets the high bit for pixels above 15 so the shuffle returns 0
+        // for them
+        indices = _mm_loadu_si128((__m128i *) (pixels + i));
+        indices = _mm_adds_epu8(indices, high);
+        r = _mm_shuffle_epi8(red, indices);
+        g = _mm_shuffle_epi8(green, indices);
+        b = _mm_shuffle_epi8(blue, indices);
+        a = _mm_shuffle_epi8(alpha, indices);
+
+        // Interleave the components into RGBA quadruples
+        rg = _mm_unpacklo_epi8(r, g);
+        ba = _mm_unpacklo_epi8(b, a);
+        _mm_storeu_si128((__m128i *) (output + i * 4),
+            _mm_unpacklo_epi16(rg, ba));
+        _mm_storeu_si128((__m128i *) (output + i * 4 + 16),
+            _mm_unpackhi_epi16(rg, ba));
+        rg = _mm_unpackhi_epi8(r, g);
+        ba = _mm_unpackhi_epi8(b, a);
+        _mm_storeu_si128((__m128i *) (output + i * 4 + 32),
+            _mm_unpacklo_epi16(rg, ba));
+        _mm_storeu_si128((__m128i *) (output + i * 4 + 48),
+            _mm_unpackhi_epi16(rg, ba));
+    }
+    convertRow(pixels + i, quantity - i, table, output + i * 4);
+}
+
+#endif
+
+
+/**
+ * Converts the specified image into 32 bit RGBA pixels (Four bytes per
+ * pixel in the order red, green, blue, alpha). Pixel values 0-15 are looked
+ * up in the palette and are opaque. Pixel values of 16 and higher (The
+ * transparent pixels of sprites, cursors and tiles) and pixels matching
+ * the color key are fully transparent and are written as four zero bytes.
+ *
+ * The pixels are written into a caller-provided buffer so they can be
+ * uploaded directly into a texture. The buffer must have room for
+ * height rows of stride bytes. On x86 CPUs supporting SSSE3 the palette
+ * lookup is vectorized.
+ *
+ * @param image
+ *            The image to convert
+ * @param palette
+ *            The 16 color palette to use. NULL for the default palette
+ *            (wlPalette)
+ * @param transparent
+ *            The palette index (color key) which is converted to
+ *            transparent pixels. -1 if all 16 colors are opaque
+ * @param buffer
+ *            The output buffer
+ * @param stride
+ *            The number of bytes from one row to the next in the output
+ *            buffer. 0 for tightly packed rows (Four times the width)
+ */
+
+void wlImageToRGBA(wlImage image, wlRGB *palette, int transparent,
+    unsigned char *buffer, int stride)
+{
+    unsigned char table[256][4];
+    int y;
+
+    assert(image != NULL);
+    assert(buffer != NULL);
+    assert(transparent >= -1 && transparent < 16);
+    assert(stride == 0 || stride >= image->width * 4);
+    if (!stride) stride = image->width * 4;
+    buildTable(table, palette ? palette : wlPalette, transparent);
+
+#ifdef WL_RGBA_SSSE3
+    if (__builtin_cpu_supports("ssse3"))
+    {
+        for (y = 0; y < image->height; y++)
+        {
+            convertRowSsse3(&image->pixels[y * image->width], image->width,
+                table, buffer + y * stride);
+        }
+        return;
+    }
+#endif
+    for (y = 0; y < image->height; y++)
+    {
+        convertRow(&image->pixels[y * image->width], image->width, table,
+            buffer + y * stride);
+    }
+}
+
+
+/**
+ * Converts all the specified images into 32 bit RGBA pixels. The images
+ * are written one below the other into the buffer, so each image is
+ * stored in the buffer like a layer of a texture array (or a vertical
+ * texture strip). See wlImageToRGBA() for details on the conversion.
+ *
+ * @param images
+ *            The images to convert
+ * @param palette
+ *            The 16 color palette to use. NULL for the default palette
+ *            (wlPalette)
+ * @param transparent
+ *            The palette index (color key) which is converted to
+ *            transparent pixels. -1 if all 16 colors are opaque
+ * @param buffer
+ *            The output buffer. Must have room for the rows of all images
+ * @param stride
+ *            The number of bytes from one row to the next in the output
+ *            buffer. 0 for tightly packed rows (Four times the width of the
+ *            widest image)
+ */
+
+void wlImagesToRGBA(wlImages images, wlRGB *palette, int transparent,
+    unsigned char *buffer, int stride)
+{
+    int i;
+
+    assert(images != NULL);
+    assert(buffer != NULL);
+    if (!stride)
+    {
+        for (i = 0; i < images->quantity; i++)
+        {
+            if (images->images[i]->width * 4 > stride)
+                stride = images->images[i]->width * 4;
+        }
+    }
+    for (i = 0; i < images->quantity; i++)
+    {
+        wlImageToRGBA(images->images[i], palette, transparent, buffer,
+            stride);
+        buffer += images->images[i]->height * stride;
+    }
+}
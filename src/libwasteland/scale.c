@@ -0,0 +1,221 @@
+/*
+ * $Id$
+ * Copyright (C) 2007  Klaus Reimer <k@ailis.de>
+ * See COPYING file for copying conditions
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include "wasteland.h"
+
+
+/**
+ * Scales a row with the EPX algorithm by factor 2 (Scale2x). Neighbours
+ * outside of the image are replaced by the edge pixels.
+ *
+ * @param above
+ *            The row above the row to scale
+ * @param row
+ *            The row to scale
+ * @param below
+ *            The row below the row to scale
+ * @param width
+ *            The width of the rows
+ * @param output
+ *            The two output rows (Each twice as wide as the input rows)
+ */
+
+static void scale2x(wlPixel *above, wlPixel *row, wlPixel *below, int width,
+    wlPixel *output)
+{
+    wlPixel *out0, *out1;
+    int x, b, d, e, f, h;
+
+    out0 = output;
+    out1 = output + width * 2;
+    for (x = 0; x < width; x++)
+    {
+        b = above[x];
+        d = row[x ? x - 1 : 0];
+        e = row[x];
+        f = row[x < width - 1 ? x + 1 : x];
+        h = below[x];
+        if (b != h && d != f)
+        {
+            out0[x * 2] = d == b ? d : e;
+            out0[x * 2 + 1] = b == f ? f : e;
+            out1[x * 2] = d == h ? d : e;
+            out1[x * 2 + 1] = h == f ? f : e;
+        }
+        else
+        {
+            out0[x * 2] = out0[x * 2 + 1] = e;
+            out1[x * 2] = out1[x * 2 + 1] = e;
+        }
+    }
+}
+
+
+/**
+ * Scales a row with the EPX algorithm by factor 3 (Scale3x). Neighbours
+ * outside of the image are replaced by the edge pixels.
+ *
+ * @param above
+ *            The row above the row to scale
+ * @param row
+ *            The row to scale
+ * @param below
+ *            The row below the row to scale
+ * @param width
+ *            The width of the rows
+ * @param output
+ *            The three output rows (Each three times as wide as the input
+ *            rows)
+ */
+
+static void scale3x(wlPixel *above, wlPixel *row, wlPixel *below, int width,
+    wlPixel *output)
+{
+    wlPixel *out0, *out1, *out2;
+    int x, left, right, a, b, c, d, e, f, g, h, i;
+
+    out0 = output;
+    out1 = output + width * 3;
+    out2 = output + width * 6;
+    for (x = 0; x < width; x++)
+    {
+        left = x ? x - 1 : 0;
+        right = x < width - 1 ? x + 1 : x;
+        a = above[left];
+        b = above[x];
+        c = above[right];
+        d = row[left];
+        e = row[x];
+        f = row[right];
+        g = below[left];
+        h = below[x];
+        i = below[right];
+        if (b != h && d != f)
+        {
+            out0[x * 3] = d == b ? d : e;
+            out0[x * 3 + 1] = (d == b && e != c) || (b == f && e != a) ? b : e;
+            out0[x * 3 + 2] = b == f ? f : e;
+            out1[x * 3] = (d == b && e != g) || (d == h && e != a) ? d : e;
+            out1[x * 3 + 1] = e;
+            out1[x * 3 + 2] = (b == f && e != i) || (h == f && e != c) ? f : e;
+            out2[x * 3] = d == h ? d : e;
+            out2[x * 3 + 1] = (d == h && e != i) || (h == f && e != g) ? h : e;
+            out2[x * 3 + 2] = h == f ? f : e;
+        }
+        else
+        {
+            out0[x * 3] = out0[x * 3 + 1] = out0[x * 3 + 2] = e;
+            out1[x * 3] = out1[x * 3 + 1] = out1[x * 3 + 2] = e;
+            out2[x * 3] = out2[x * 3 + 1] = out2[x * 3 + 2] = e;
+        }
+    }
+}
+
+
+/**
+ * Scales a single row of the specified image. The scaled row is written
+ * into the output buffer as factor rows with a width of factor times the
+ * image width. Because the algorithms only work on palette indices the
+ * transparent pixels (16 and above) are scaled like any other color.
+ *
+ * WL_SCALE_NEAREST supports all factors. WL_SCALE_EPX only supports the
+ * factors 2 (Scale2x) and 3 (Scale3x). Use wlImageScale() for factor 4.
+ *
+ * @param image
+ *            The image
+ * @param y
+ *            The row to scale
+ * @param factor
+ *            The scale factor
+ * @param method
+ *            The scale method (WL_SCALE_NEAREST or WL_SCALE_EPX)
+ * @param output
+ *            The output buffer. Must have room for factor * factor * width
+ *            pixels
+ */
+
+void wlImageScaleRow(wlImage image, int y, int factor, int method,
+    wlPixel *output)
+{
+    wlPixel *row, *above, *below, *out;
+    int x, i, width;
+
+    assert(image != NULL);
+    assert(y >= 0 && y < image->height);
+    assert(factor > 0);
+    assert(method == WL_SCALE_NEAREST || factor == 2 || factor == 3);
+    assert(output != NULL);
+    width = image->width;
+    row = &image->pixels[y * width];
+    if (method == WL_SCALE_EPX)
+    {
+        above = y ? row - width : row;
+        below = y < image->height - 1 ? row + width : row;
+        if (factor == 2)
+            scale2x(above, row, below, width, output);
+        else
+            scale3x(above, row, below, width, output);
+        return;
+    }
+
+    // Nearest neighbour: Scale the first output row and copy it
+    out = output;
+    for (x = 0; x < width; x++)
+    {
+        for (i = 0; i < factor; i++) *out++ = row[x];
+    }
+    for (i = 1; i < factor; i++)
+    {
+        memcpy(output + i * width * factor, output, width * factor);
+    }
+}
+
+
+/**
+ * Scales the specified image by an integer factor and returns the scaled
+ * image. WL_SCALE_NEAREST duplicates each pixel. WL_SCALE_EPX uses the
+ * EPX algorithm (Scale2x and Scale3x) which smoothes diagonal edges
+ * without introducing new colors. It supports the factors 2, 3 and 4
+ * (Scale2x applied twice). You have to free the returned image with
+ * wlImageFree() when you no longer need it.
+ *
+ * @param image
+ *            The image to scale
+ * @param factor
+ *            The scale factor
+ * @param method
+ *            The scale method (WL_SCALE_NEAREST or WL_SCALE_EPX)
+ * @return The scaled image
+ */
+
+wlImage wlImageScale(wlImage image, int factor, int method)
+{
+    wlImage scaled, half;
+    int y;
+
+    assert(image != NULL);
+    assert(factor > 0);
+    assert(method == WL_SCALE_NEAREST || (factor >= 2 && factor <= 4));
+    if (method == WL_SCALE_EPX && factor == 4)
+    {
+        half = wlImageScale(image, 2, method);
+        scaled = wlImageScale(half, 2, method);
+        wlImageFree(half);
+        return scaled;
+    }
+    scaled = wlImageCreate(image->width * factor, image->height * factor);
+    for (y = 0; y < image->height; y++)
+    {
+        wlImageScaleRow(image, y, factor, method,
+            &scaled->pixels[y * factor * scaled->width]);
+    }
+    return scaled;
+}
@@ -88,6 +88,7 @@ wlImages wlSpritesReadStream(FILE *spritesStream, FILE *masksStream)
     for (sprite = 0; sprite < sprites->quantity; sprite++)
     {        
         image = sprites->images[sprite];
+        memset(image->pixels, 0, image->width * image->height);
         for (bit = 0; bit < 4; bit++)
         {
             for (y = 0; y < image->height; y++)
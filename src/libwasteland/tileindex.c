@@ -0,0 +1,186 @@
+/*
+ * $Id$
+ * Copyright (C) 2007  Klaus Reimer <k@ailis.de>
+ * See COPYING file for copying conditions
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include "wasteland.h"
+
+/** The initial number of hash slots (Must be a power of two) */
+#define INITIAL_SIZE 64
+
+
+/**
+ * Searches the hash slot of the specified image. Returns the slot which
+ * contains the image or the free slot where it has to be inserted.
+ *
+ * @param index
+ *            The tile index
+ * @param image
+ *            The image to search
+ * @param hash
+ *            The hash of the image
+ * @return The slot
+ */
+
+static int findSlot(wlTileIndex index, wlImage image, u_int64_t hash)
+{
+    wlImage tile;
+    int slot;
+
+    slot = hash & (index->size - 1);
+    while (index->slots[slot] >= 0)
+    {
+        tile = index->tiles[index->slots[slot]];
+        if (index->hashes[slot] == hash && (tile == image
+            || (tile->width == image->width && tile->height == image->height
+            && !memcmp(tile->pixels, image->pixels,
+            image->width * image->height))))
+            break;
+        slot = (slot + 1) & (index->size - 1);
+    }
+    return slot;
+}
+
+
+/**
+ * Doubles the number of hash slots and rehashes all tiles.
+ *
+ * @param index
+ *            The tile index
+ */
+
+static void grow(wlTileIndex index)
+{
+    u_int64_t *hashes;
+    int *slots;
+    int i, slot, size;
+
+    hashes = index->hashes;
+    slots = index->slots;
+    size = index->size;
+    index->size = size * 2;
+    index->hashes = malloc(sizeof(u_int64_t) * index->size);
+    index->slots = malloc(sizeof(int) * index->size);
+    for (i = 0; i < index->size; i++) index->slots[i] = -1;
+    for (i = 0; i < size; i++)
+    {
+        if (slots[i] < 0) continue;
+        slot = hashes[i] & (index->size - 1);
+        while (index->slots[slot] >= 0)
+            slot = (slot + 1) & (index->size - 1);
+        index->slots[slot] = slots[i];
+        index->hashes[slot] = hashes[i];
+    }
+    index->tiles = realloc(index->tiles, sizeof(wlImage) * index->size / 2);
+    free(hashes);
+    free(slots);
+}
+
+
+/**
+ * Creates a new empty tile index. The tile index maps the content hash
+ * (See wlImageHash()) of images to canonical tile ids so duplicate tiles
+ * can be found in constant time. The canonical tile ids are numbered
+ * continuously in the order in which the tiles were added. You have to
+ * free the index with wlTileIndexFree() when you no longer need it.
+ *
+ * @return The tile index
+ */
+
+wlTileIndex wlTileIndexCreate(void)
+{
+    wlTileIndex index;
+    int i;
+
+    index = malloc(sizeof(wlTileIndexStruct));
+    index->quantity = 0;
+    index->size = INITIAL_SIZE;
+    index->tiles = malloc(sizeof(wlImage) * INITIAL_SIZE / 2);
+    index->hashes = malloc(sizeof(u_int64_t) * INITIAL_SIZE);
+    index->slots = malloc(sizeof(int) * INITIAL_SIZE);
+    for (i = 0; i < INITIAL_SIZE; i++) index->slots[i] = -1;
+    return index;
+}
+
+
+/**
+ * Releases the memory allocated for the specified tile index. The tiles
+ * are not owned by the index so they are not freed.
+ *
+ * @param index
+ *            The tile index to free
+ */
+
+void wlTileIndexFree(wlTileIndex index)
+{
+    assert(index != NULL);
+    free(index->tiles);
+    free(index->hashes);
+    free(index->slots);
+    free(index);
+}
+
+
+/**
+ * Adds the specified image to the tile index and returns its canonical tile
+ * id. If an identical image is already in the index then the id of this
+ * image is returned and the index is not modified. Otherwise the image
+ * becomes the canonical tile for its content and gets the next free id.
+ * The index only stores a reference to the image so it must not be freed
+ * while the index is in use.
+ *
+ * @param index
+ *            The tile index
+ * @param image
+ *            The image to add
+ * @return The canonical tile id
+ */
+
+int wlTileIndexAdd(wlTileIndex index, wlImage image)
+{
+    u_int64_t hash;
+    int slot;
+
+    assert(index != NULL);
+    assert(image != NULL);
+    hash = wlImageHash(image);
+    slot = findSlot(index, image, hash);
+    if (index->slots[slot] >= 0) return index->slots[slot];
+
+    // Keep the load factor at or below one half
+    if ((index->quantity + 1) * 2 > index->size)
+    {
+        grow(index);
+        slot = findSlot(index, image, hash);
+    }
+    index->tiles[index->quantity] = image;
+    index->hashes[slot] = hash;
+    index->slots[slot] = index->quantity;
+    return index->quantity++;
+}
+
+
+/**
+ * Returns the canonical tile id of the specified image or -1 if no
+ * identical image is in the tile index. The canonical image itself can be
+ * accessed with index->tiles[id].
+ *
+ * @param index
+ *            The tile index
+ * @param image
+ *            The image to search
+ * @return The canonical tile id or -1 if not found
+ */
+
+int wlTileIndexFind(wlTileIndex index, wlImage image)
+{
+    assert(index != NULL);
+    assert(image != NULL);
+    return index->slots[findSlot(index, image, wlImageHash(image))];
+}
@@ -32,7 +32,6 @@
 wlTilesets wlTilesetsReadFile(char *filename)
 {
     FILE *file;
-    wlImages tiles;
     wlTilesets tilesets;
 
     // Validate parameters
@@ -42,19 +41,46 @@ wlTilesets wlTilesetsReadFile(char *filename)
     file = fopen(filename, "rb");
     if (!file) return NULL;
 
+    // Read the tilesets
+    tilesets = wlTilesetsReadStream(file);
+
+    // Close the file stream
+    fclose(file);
+
+    // Return the tilesets
+    return tilesets;
+}
+
+
+/**
+ * Reads all tilesets from the specified stream until the end of the stream
+ * and returns them. The stream is not closed by this function. See
+ * wlTilesetsReadFile() for details.
+ *
+ * @param stream
+ *            The stream to read the tilesets from
+ * @return The tilesets
+ */
+
+wlTilesets wlTilesetsReadStream(FILE *stream)
+{
+    wlImages tiles;
+    wlTilesets tilesets;
+
+    // Validate parameters
+    assert(stream != NULL);
+
     // Create the tilesets structure
     tilesets = malloc(sizeof(wlTilesetsStruct));
+    tilesets->index = NULL;
     listCreate(tilesets->tilesets, &(tilesets->quantity));
 
     // Read the tilesets
-    while ((tiles = wlTilesReadStream(file)))
+    while ((tiles = wlTilesReadStream(stream)))
     {
         listAdd(tilesets->tilesets, tiles, &tilesets->quantity);
     }
 
-    // Close the file stream
-    fclose(file);
-
     // Return the tilesets
     return tilesets;
 }
@@ -72,14 +98,80 @@ void wlTilesetsFree(wlTilesets tilesets)
     int i;
 
     assert(tilesets != NULL);
-    for (i = 0; i < tilesets->quantity; i++)
+
+    // Deduplicated tilesets share the tile images so they are freed once
+    // through the tile index
+    if (tilesets->index)
     {
-        wlImagesFree(tilesets->tilesets[i]);
+        for (i = 0; i < tilesets->index->quantity; i++)
+        {
+            wlImageFree(tilesets->index->tiles[i]);
+        }
+        for (i = 0; i < tilesets->quantity; i++)
+        {
+            free(tilesets->tilesets[i]->images);
+            free(tilesets->tilesets[i]);
+        }
+        wlTileIndexFree(tilesets->index);
+    }
+    else
+    {
+        for (i = 0; i < tilesets->quantity; i++)
+        {
+            wlImagesFree(tilesets->tilesets[i]);
+        }
     }
     free(tilesets);
 }
 
 
+/**
+ * Deduplicates the tiles of the specified tilesets. Identical tiles (In
+ * the same tileset or in different tilesets) are replaced by a reference
+ * to the first occurrence so they share the same pixel storage. The
+ * tile index which was used to find the duplicates is stored in
+ * tilesets->index. It lists the unique tiles and can be used to map any
+ * tile to its canonical id with wlTileIndexFind().
+ *
+ * Because the tiles are shared you must not modify the pixels of a tile
+ * of deduplicated tilesets unless you want to modify all its duplicates,
+ * too. Deduplicated tilesets must still be freed with wlTilesetsFree().
+ * Calling this function again has no effect.
+ *
+ * @param tilesets
+ *            The tilesets to deduplicate
+ * @return The number of unique tiles
+ */
+
+int wlTilesetsDedupe(wlTilesets tilesets)
+{
+    wlTileIndex index;
+    wlImages tiles;
+    wlImage canonical;
+    int i, j, id;
+
+    assert(tilesets != NULL);
+    if (tilesets->index) return tilesets->index->quantity;
+    index = wlTileIndexCreate();
+    for (i = 0; i < tilesets->quantity; i++)
+    {
+        tiles = tilesets->tilesets[i];
+        for (j = 0; j < tiles->quantity; j++)
+        {
+            id = wlTileIndexAdd(index, tiles->images[j]);
+            canonical = index->tiles[id];
+            if (canonical != tiles->images[j])
+            {
+                wlImageFree(tiles->images[j]);
+                tiles->images[j] = canonical;
+            }
+        }
+    }
+    tilesets->index = index;
+    return index->quantity;
+}
+
+
 /**
  * Reads image from a huffman encoded file stream and returns it. The stream
  * must already be open and pointing to the encoded PIC data. The stream is not
@@ -106,20 +198,8 @@ void wlTilesetsFree(wlTilesets tilesets)
 static wlImage readTile(FILE *stream, wlImage image, wlHuffmanNode *rootNode,
         unsigned char *dataByte, unsigned char *dataMask)
 {
-    int x, y;
-    int b;
-
-    for (y = 0; y < image->height; y++)
-    {
-        for (x = 0; x < image->width; x+= 2)
-        {
-            b = wlHuffmanReadByte(stream, rootNode, dataByte, dataMask);
-            if (b == EOF) return NULL;
-            image->pixels[y * image->width + x] = b >> 4;
-            image->pixels[y * image->width + x + 1] = b & 0x0f;
-        }
-    }
-
+    if (!wlImageDecodeHuffman(image, stream, rootNode, dataByte, dataMask))
+        return NULL;
     wlImageVXorDecode(image);
     return image;
 }
@@ -152,6 +232,7 @@ wlImages wlTilesReadStream(FILE *stream)
     wlMsqHeader header;
     int quantity, i;
     unsigned char dataByte, dataMask;
+    wlHuffmanDecoder decoder;
     wlHuffmanNode *rootNode;
 
     // Validate parameters
@@ -175,8 +256,10 @@ wlImages wlTilesReadStream(FILE *stream)
     // Initialize huffman stream
     dataByte = 0;
     dataMask = 0;
-    if (!(rootNode = wlHuffmanReadNode(stream, &dataByte, &dataMask)))
+    if (!(decoder = wlHuffmanCacheRead(stream, WL_HUFFMAN_TREE, &dataByte,
+        &dataMask)))
         return NULL;
+    rootNode = decoder->rootNode;
 
     // Create the images structure which is going to hold the tiles
     tiles = wlImagesCreate(quantity, 16, 16);
@@ -189,7 +272,7 @@ wlImages wlTilesReadStream(FILE *stream)
     }
 
     // Free huffman data
-    wlHuffmanFreeNode(rootNode);
+    wlHuffmanCacheRelease(decoder);
 
     // Return the tiles
     return tiles;
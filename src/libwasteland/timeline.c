@@ -0,0 +1,485 @@
+/*
+ * $Id$
+ * Copyright (C) 2007  Klaus Reimer <k@ailis.de>
+ * See COPYING file for copying conditions
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include "wasteland.h"
+
+/** The maximum number of checkpoints per timeline */
+#define MAX_CHECKPOINTS 4096
+
+
+/**
+ * Checks if the event of instruction set <var>a</var> must fire before the
+ * event of instruction set <var>b</var>. Events with the same time are
+ * ordered by instruction set index so playback is deterministic.
+ *
+ * @param timeline
+ *            The timeline
+ * @param a
+ *            The first instruction set index
+ * @param b
+ *            The second instruction set index
+ * @return 1 if a fires before b, 0 otherwise
+ */
+
+static int isBefore(wlPicsTimeline timeline, int a, int b)
+{
+    if (timeline->times[a] != timeline->times[b])
+        return timeline->times[a] < timeline->times[b];
+    return a < b;
+}
+
+
+/**
+ * Moves the heap entry at the specified position down until the heap
+ * property is restored.
+ *
+ * @param timeline
+ *            The timeline
+ * @param index
+ *            The heap position to sift down
+ */
+
+static void siftDown(wlPicsTimeline timeline, int index)
+{
+    int child, tmp;
+    int *heap;
+
+    heap = timeline->heap;
+    while ((child = index * 2 + 1) < timeline->heapSize)
+    {
+        if (child + 1 < timeline->heapSize
+            && isBefore(timeline, heap[child + 1], heap[child])) child++;
+        if (!isBefore(timeline, heap[child], heap[index])) break;
+        tmp = heap[child];
+        heap[child] = heap[index];
+        heap[index] = tmp;
+        index = child;
+    }
+}
+
+
+/**
+ * Rebuilds the event heap from the next event times of all instruction
+ * sets. Instruction sets which never change the frame are not put into the
+ * heap.
+ *
+ * @param timeline
+ *            The timeline
+ */
+
+static void buildHeap(wlPicsTimeline timeline)
+{
+    int i;
+
+    timeline->heapSize = 0;
+    for (i = 0; i < timeline->animation->instructions->quantity; i++)
+    {
+        if (timeline->times[i] >= 0)
+            timeline->heap[timeline->heapSize++] = i;
+    }
+    for (i = timeline->heapSize / 2 - 1; i >= 0; i--) siftDown(timeline, i);
+}
+
+
+/**
+ * Returns the greatest common divisor of the two specified numbers.
+ *
+ * @param a
+ *            The first number
+ * @param b
+ *            The second number
+ * @return The greatest common divisor
+ */
+
+static int gcd(int a, int b)
+{
+    int tmp;
+
+    while (b)
+    {
+        tmp = a % b;
+        a = b;
+        b = tmp;
+    }
+    return a;
+}
+
+
+/**
+ * Returns the length of one cycle of the specified instruction set in
+ * animation ticks.
+ *
+ * @param set
+ *            The instruction set
+ * @return The cycle length
+ */
+
+static int getCycleLength(wlPicsInstructionSet set)
+{
+    int i, length;
+
+    length = 0;
+    for (i = 0; i < set->quantity; i++) length += set->instructions[i]->delay;
+    return length;
+}
+
+
+/**
+ * Fires the next event of the specified instruction set. All instructions
+ * except the last one apply their update set to the frame. The last
+ * instruction ends the cycle so the instruction set starts over on the
+ * base frame.
+ *
+ * @param timeline
+ *            The timeline
+ * @param setNo
+ *            The instruction set index
+ */
+
+static void fire(wlPicsTimeline timeline, int setNo)
+{
+    wlPicsInstructionSet set;
+    int position;
+
+    set = timeline->animation->instructions->sets[setNo];
+    position = timeline->positions[setNo];
+    wlPicsDeltaApply(timeline->frame,
+        wlPicsCacheGetDelta(timeline->cache, setNo, position));
+    position = position < set->quantity - 1 ? position + 1 : 0;
+    timeline->positions[setNo] = position;
+    timeline->times[setNo] += set->instructions[position]->delay;
+}
+
+
+/**
+ * Returns the time of the checkpoint which follows the specified time.
+ *
+ * @param timeline
+ *            The timeline
+ * @param time
+ *            The time
+ * @return The time of the next checkpoint
+ */
+
+static int getNextCheckpoint(wlPicsTimeline timeline, int time)
+{
+    int local, next;
+
+    local = time % timeline->period;
+    next = (local / timeline->interval + 1) * timeline->interval;
+    if (next >= timeline->period) next = timeline->period;
+    return time - local + next;
+}
+
+
+/**
+ * Records a checkpoint for the current state of the timeline if there is
+ * not already one for this position in the animation period. All times in
+ * the checkpoint are stored relative to the start of the current period.
+ *
+ * @param timeline
+ *            The timeline
+ */
+
+static void record(wlPicsTimeline timeline)
+{
+    wlPicsTimelineCheckpoint checkpoint;
+    int index, sets, size, base, i;
+
+    index = (timeline->time % timeline->period) / timeline->interval;
+    if (timeline->checkpoints[index]) return;
+
+    sets = timeline->animation->instructions->quantity;
+    size = timeline->frame->width * timeline->frame->height;
+    checkpoint = malloc(sizeof(wlPicsTimelineCheckpointStruct));
+    base = timeline->time - timeline->time % timeline->period;
+    checkpoint->time = timeline->time - base;
+    checkpoint->pixels = malloc(sizeof(wlPixel) * size);
+    memcpy(checkpoint->pixels, timeline->frame->pixels, sizeof(wlPixel) * size);
+    checkpoint->positions = malloc(sizeof(int) * sets);
+    memcpy(checkpoint->positions, timeline->positions, sizeof(int) * sets);
+    checkpoint->times = malloc(sizeof(int) * sets);
+    for (i = 0; i < sets; i++)
+    {
+        checkpoint->times[i] = timeline->times[i] < 0 ? -1 :
+            timeline->times[i] - base;
+    }
+    timeline->checkpoints[index] = checkpoint;
+}
+
+
+/**
+ * Creates a new timeline for the specified picture animation. The timeline
+ * keeps a single composited frame of all instruction sets which run
+ * concurrently and starts at time 0 with the base frame. All times are
+ * measured in animation ticks (The delay unit of the animation instructions).
+ *
+ * While advancing the timeline a snapshot of the frame is recorded every
+ * <var>interval</var> ticks (Within one period of the animation) so seeking
+ * backwards never has to replay more than <var>interval</var> ticks. Pass 0
+ * to disable checkpoints. The interval is raised for very long periods so
+ * no more than 4096 checkpoints are kept. Without memory for the
+ * checkpoint table the timeline works without checkpoints.
+ *
+ * The frame changes are taken from the specified frame cache which can be
+ * shared with other consumers of the animation. If NULL is specified then
+ * the timeline uses its own cache. The animation (and the cache) must not be
+ * freed as long as the timeline is in use. You have to release the timeline
+ * with wlTimelineFree() when you no longer need it.
+ *
+ * @param animation
+ *            The picture animation
+ * @param cache
+ *            The frame cache to use. NULL to create a private one.
+ * @param interval
+ *            The checkpoint interval in animation ticks. 0 to disable
+ *            checkpoints.
+ * @return The timeline
+ */
+
+wlPicsTimeline wlTimelineCreate(wlPicsAnimation animation, wlPicsCache cache,
+    int interval)
+{
+    wlPicsTimeline timeline;
+    wlPicsInstructionSet set;
+    int sets, i, length, factor;
+
+    assert(animation != NULL);
+    assert(interval >= 0);
+
+    sets = animation->instructions->quantity;
+    timeline = malloc(sizeof(wlPicsTimelineStruct));
+    timeline->animation = animation;
+    timeline->frame = wlImageClone(animation->baseFrame);
+    timeline->time = 0;
+    timeline->positions = malloc(sizeof(int) * sets);
+    timeline->times = malloc(sizeof(int) * sets);
+    timeline->heap = malloc(sizeof(int) * sets);
+    timeline->ownCache = !cache;
+    timeline->cache = cache ? cache : wlPicsCacheCreate(animation);
+
+    // Initialize the instruction sets and calculate the animation period
+    // (The least common multiple of all cycle lengths). Instruction sets
+    // without updates or without any delay never change the frame.
+    timeline->period = 1;
+    for (i = 0; i < sets; i++)
+    {
+        set = animation->instructions->sets[i];
+        length = getCycleLength(set);
+        timeline->positions[i] = 0;
+        if (set->quantity < 2 || !length)
+        {
+            timeline->times[i] = -1;
+            continue;
+        }
+        timeline->times[i] = set->instructions[0]->delay;
+        if (timeline->period)
+        {
+            factor = length / gcd(timeline->period, length);
+            if (timeline->period > 0x3fffffff / factor)
+                timeline->period = 0;
+            else
+                timeline->period *= factor;
+        }
+    }
+    buildHeap(timeline);
+
+    // Initialize the checkpoints. They are only possible if the animation
+    // is periodic within the range of an integer. The interval is raised
+    // for long periods so the number of checkpoints is bounded.
+    if (timeline->period && interval
+        && timeline->period / interval >= MAX_CHECKPOINTS)
+        interval = (timeline->period + MAX_CHECKPOINTS - 1) / MAX_CHECKPOINTS;
+    timeline->checkpointQuantity = timeline->period && interval ?
+        (timeline->period + interval - 1) / interval : 0;
+    timeline->checkpoints = calloc(timeline->checkpointQuantity ?
+        timeline->checkpointQuantity : 1, sizeof(wlPicsTimelineCheckpoint));
+    if (!timeline->checkpointQuantity || !timeline->checkpoints)
+    {
+        timeline->period = 0;
+        timeline->checkpointQuantity = 0;
+        interval = 0;
+    }
+    timeline->interval = interval;
+    if (interval) record(timeline);
+
+    return timeline;
+}
+
+
+/**
+ * Releases all the memory allocated for the specified timeline. The
+ * animation and a shared frame cache are not freed.
+ *
+ * @param timeline
+ *            The timeline to free
+ */
+
+void wlTimelineFree(wlPicsTimeline timeline)
+{
+    int i;
+    wlPicsTimelineCheckpoint checkpoint;
+
+    assert(timeline != NULL);
+    for (i = 0; i < timeline->checkpointQuantity; i++)
+    {
+        checkpoint = timeline->checkpoints[i];
+        if (!checkpoint) continue;
+        free(checkpoint->pixels);
+        free(checkpoint->positions);
+        free(checkpoint->times);
+        free(checkpoint);
+    }
+    free(timeline->checkpoints);
+    if (timeline->ownCache) wlPicsCacheFree(timeline->cache);
+    free(timeline->heap);
+    free(timeline->times);
+    free(timeline->positions);
+    wlImageFree(timeline->frame);
+    free(timeline);
+}
+
+
+/**
+ * Advances the timeline to the specified time. All events up to and
+ * including this time are applied to the frame of the timeline. The time
+ * must not be lower than the current time of the timeline. Use
+ * wlTimelineSeek() to jump to an arbitrary time.
+ *
+ * @param timeline
+ *            The timeline
+ * @param time
+ *            The time to advance to
+ */
+
+void wlTimelineAdvance(wlPicsTimeline timeline, int time)
+{
+    int setNo, checkpoint, eventTime;
+
+    assert(timeline != NULL);
+    assert(time >= timeline->time);
+
+    checkpoint = timeline->interval ?
+        getNextCheckpoint(timeline, timeline->time) : -1;
+    while (1)
+    {
+        eventTime = timeline->heapSize ?
+            timeline->times[timeline->heap[0]] : -1;
+        if (eventTime < 0 || eventTime > time) break;
+
+        // Record all checkpoints which are passed by this event
+        while (checkpoint >= 0 && checkpoint < eventTime)
+        {
+            timeline->time = checkpoint;
+            record(timeline);
+            checkpoint = getNextCheckpoint(timeline, checkpoint);
+        }
+
+        // Fire the event and move the instruction set to its new position
+        // in the heap
+        setNo = timeline->heap[0];
+        timeline->time = eventTime;
+        fire(timeline, setNo);
+        siftDown(timeline, 0);
+    }
+
+    // Record the checkpoints between the last event and the target time
+    while (checkpoint >= 0 && checkpoint <= time)
+    {
+        timeline->time = checkpoint;
+        record(timeline);
+        checkpoint = getNextCheckpoint(timeline, checkpoint);
+    }
+    timeline->time = time;
+}
+
+
+/**
+ * Moves the timeline to the specified time which can also be lower than the
+ * current time. When possible the nearest recorded checkpoint is restored
+ * so only the remaining ticks must be replayed. Otherwise the timeline
+ * starts over at time 0.
+ *
+ * @param timeline
+ *            The timeline
+ * @param time
+ *            The time to seek to
+ */
+
+void wlTimelineSeek(wlPicsTimeline timeline, int time)
+{
+    wlPicsTimelineCheckpoint checkpoint;
+    int sets, base, index, i;
+
+    assert(timeline != NULL);
+    assert(time >= 0);
+
+    // Simply advance if the target is not too far ahead
+    if (time >= timeline->time && (!timeline->period
+        || time - timeline->time < timeline->interval))
+    {
+        wlTimelineAdvance(timeline, time);
+        return;
+    }
+
+    sets = timeline->animation->instructions->quantity;
+    if (timeline->period)
+    {
+        // Find the nearest checkpoint before the target time. The state of
+        // the animation repeats after each period so the checkpoints of the
+        // first period are valid for all following periods.
+        base = time - time % timeline->period;
+        index = (time % timeline->period) / timeline->interval;
+        while (!timeline->checkpoints[index]) index--;
+        checkpoint = timeline->checkpoints[index];
+        memcpy(timeline->frame->pixels, checkpoint->pixels, sizeof(wlPixel)
+            * timeline->frame->width * timeline->frame->height);
+        memcpy(timeline->positions, checkpoint->positions, sizeof(int) * sets);
+        for (i = 0; i < sets; i++)
+        {
+            timeline->times[i] = checkpoint->times[i] < 0 ? -1 :
+                checkpoint->times[i] + base;
+        }
+        timeline->time = base + checkpoint->time;
+    }
+    else
+    {
+        // Without checkpoints the timeline must start over
+        memcpy(timeline->frame->pixels, timeline->animation->baseFrame->pixels,
+            sizeof(wlPixel) * timeline->frame->width * timeline->frame->height);
+        for (i = 0; i < sets; i++)
+        {
+            timeline->positions[i] = 0;
+            timeline->times[i] = timeline->times[i] < 0 ? -1 :
+                timeline->animation->instructions->sets[i]->instructions[0]->delay;
+        }
+        timeline->time = 0;
+    }
+    buildHeap(timeline);
+    wlTimelineAdvance(timeline, time);
+}
+
+
+/**
+ * Returns the time at which the frame of the timeline changes the next time.
+ * This can be used to sleep until the next frame must be displayed. Returns
+ * -1 if the animation never changes.
+ *
+ * @param timeline
+ *            The timeline
+ * @return The time of the next frame change or -1 if there is none
+ */
+
+int wlTimelineGetNextChange(wlPicsTimeline timeline)
+{
+    assert(timeline != NULL);
+    return timeline->heapSize ? timeline->times[timeline->heap[0]] : -1;
+}
@@ -27,13 +27,33 @@ typedef struct
 } wlImagesStruct;
 typedef wlImagesStruct * wlImages;
 
+typedef struct
+{
+    int quantity;
+    wlImage * tiles;
+    int size;
+    u_int64_t * hashes;
+    int * slots;
+} wlTileIndexStruct;
+typedef wlTileIndexStruct * wlTileIndex;
+
 typedef struct
 {
     int quantity;
     wlImages * tilesets;
+    wlTileIndex index;
 } wlTilesetsStruct;
 typedef wlTilesetsStruct * wlTilesets;
 
+typedef struct
+{
+    int x;
+    int y;
+    int width;
+    int height;
+} wlRectStruct;
+typedef wlRectStruct * wlRect;
+
 typedef struct
 {
     unsigned char red;
@@ -43,6 +63,60 @@ typedef struct
 
 extern wlRGB wlPalette[16];
 
+#define WL_PNG_FILTER_NONE     0
+#define WL_PNG_FILTER_SUB      1
+#define WL_PNG_FILTER_UP       2
+#define WL_PNG_FILTER_AVERAGE  3
+#define WL_PNG_FILTER_PAETH    4
+#define WL_PNG_FILTER_ADAPTIVE 5
+
+#define WL_SCALE_NEAREST 0
+#define WL_SCALE_EPX     1
+
+#define WL_QUANTIZER_HASH_SIZE 64
+
+typedef struct
+{
+    wlRGB palette[16];
+    unsigned int keys[WL_QUANTIZER_HASH_SIZE];
+    wlPixel values[WL_QUANTIZER_HASH_SIZE];
+    wlPixel nearest[65536];
+} wlQuantizerStruct;
+typedef wlQuantizerStruct * wlQuantizer;
+
+typedef struct wlPngQueueStruct * wlPngQueue;
+
+typedef struct
+{
+    char *name;
+    char *data;
+    size_t size;
+    FILE *stream;
+} wlDirEntryStruct;
+typedef wlDirEntryStruct * wlDirEntry;
+
+typedef struct
+{
+    int write;
+    int fd;
+    FILE *tar;
+    int quantity;
+    wlDirEntry * entries;
+} wlDirStruct;
+typedef wlDirStruct * wlDir;
+
+typedef struct
+{
+    wlImage image;
+    int quantity;
+    int unique;
+    int columns;
+    wlRectStruct * rects;
+    int tilesets;
+    int * offsets;
+} wlAtlasStruct;
+typedef wlAtlasStruct * wlAtlas;
+
 typedef struct wlHuffmanNode_s
 {
     struct wlHuffmanNode_s *parent;
@@ -54,6 +128,57 @@ typedef struct wlHuffmanNode_s
     int usage;
 } wlHuffmanNode;
 
+#define WL_HUFFMAN_BITS 0
+#define WL_HUFFMAN_TREE 1
+#define WL_HUFFMAN_FSM  2
+
+typedef struct
+{
+    unsigned short next;
+    unsigned char quantity;
+    unsigned char symbols[8];
+} wlHuffmanTransition;
+
+typedef struct
+{
+    int backend;
+    wlHuffmanNode * rootNode;
+    int states;
+    int * children;
+    wlHuffmanTransition * transitions;
+} wlHuffmanDecoderStruct;
+typedef wlHuffmanDecoderStruct * wlHuffmanDecoder;
+
+typedef struct
+{
+    FILE * stream;
+    u_int64_t codes[256];
+    unsigned char lengths[256];
+    u_int64_t bits;
+    int count;
+    unsigned char * buffer;
+    int size;
+} wlHuffmanEncoderStruct;
+typedef wlHuffmanEncoderStruct * wlHuffmanEncoder;
+
+typedef struct
+{
+    int output;
+    long input;
+    unsigned char dataByte;
+    unsigned char dataMask;
+} wlHuffmanCheckpoint;
+
+typedef struct
+{
+    wlHuffmanNode * rootNode;
+    int interval;
+    int size;
+    int quantity;
+    wlHuffmanCheckpoint * checkpoints;
+} wlHuffmanIndexStruct;
+typedef wlHuffmanIndexStruct * wlHuffmanIndex;
+
 typedef struct
 {
     unsigned short x;
@@ -134,6 +259,51 @@ typedef struct
 } wlPicsAnimationsStruct;
 typedef wlPicsAnimationsStruct * wlPicsAnimations;
 
+typedef struct
+{
+    int x;
+    int y;
+    int width;
+    int height;
+    wlPixel *xors;
+} wlPicsDeltaStruct;
+typedef wlPicsDeltaStruct * wlPicsDelta;
+
+typedef struct
+{
+    wlPicsAnimation animation;
+    wlPicsDelta *updates;
+    wlPicsDelta *resets;
+} wlPicsCacheStruct;
+typedef wlPicsCacheStruct * wlPicsCache;
+
+typedef struct
+{
+    int time;
+    wlPixel *pixels;
+    int *positions;
+    int *times;
+} wlPicsTimelineCheckpointStruct;
+typedef wlPicsTimelineCheckpointStruct * wlPicsTimelineCheckpoint;
+
+typedef struct
+{
+    wlPicsAnimation animation;
+    wlPicsCache cache;
+    int ownCache;
+    wlImage frame;
+    int time;
+    int period;
+    int *positions;
+    int *times;
+    int *heap;
+    int heapSize;
+    int interval;
+    int checkpointQuantity;
+    wlPicsTimelineCheckpoint *checkpoints;
+} wlPicsTimelineStruct;
+typedef wlPicsTimelineStruct * wlPicsTimeline;
+
 enum wlMsqType
 {
     UNCOMPRESSED,
@@ -179,24 +349,118 @@ extern int             wlHuffmanReadByte(FILE *file, wlHuffmanNode *rootNode,
 extern unsigned char * wlHuffmanReadBlock(FILE *stream, unsigned char *block,
     int size, wlHuffmanNode *rootNode, unsigned char *dataByte,
     unsigned char *dataMask);
+extern int             wlHuffmanDecodeBlock(FILE *stream,
+    unsigned char *block, int size, wlHuffmanNode *rootNode,
+    unsigned char *dataByte, unsigned char *dataMask);
 extern int             wlHuffmanWriteByte(unsigned char byte, FILE *file,
     wlHuffmanNode **nodeIndex, unsigned char *dataByte,
     unsigned char *dataMask);
 extern int             wlHuffmanReadWord(FILE *stream, wlHuffmanNode *rootNode,
     unsigned char *dataByte, unsigned char *dataMask);
+extern int             wlHuffmanDecodeWords(FILE *stream, u_int16_t *words,
+    int quantity, wlHuffmanNode *rootNode, unsigned char *dataByte,
+    unsigned char *dataMask);
 extern int             wlHuffmanWriteWord(u_int16_t word, FILE *stream,
     wlHuffmanNode **nodeIndex, unsigned char *dataByte,
     unsigned char *dataMask);
 extern wlHuffmanNode * wlHuffmanBuildTree(unsigned char *data, int size,
     wlHuffmanNode ***index);
+extern void            wlHistogram256(unsigned char *data, size_t size,
+    int *usage);
+extern wlHuffmanNode * wlHuffmanBuildTreeFromUsage(int *usage,
+    wlHuffmanNode ***index);
+extern wlHuffmanNode * wlHuffmanBuildLimitedTree(int *usage, int maxBits,
+    wlHuffmanNode ***index);
 extern void            wlHuffmanDumpNode(wlHuffmanNode *node, int indent);
 
+/* Huffman decoder functions */
+extern wlHuffmanDecoder wlHuffmanDecoderCreate(wlHuffmanNode *rootNode,
+    int backend);
+extern void             wlHuffmanDecoderFree(wlHuffmanDecoder decoder);
+extern int              wlHuffmanDecoderDecode(wlHuffmanDecoder decoder,
+    FILE *stream, unsigned char *block, int size, unsigned char *dataByte,
+    unsigned char *dataMask);
+
+/* Huffman cache functions */
+extern wlHuffmanDecoder wlHuffmanCacheRead(FILE *stream, int backend,
+    unsigned char *dataByte, unsigned char *dataMask);
+extern void             wlHuffmanCacheRelease(wlHuffmanDecoder decoder);
+extern void             wlHuffmanCacheClear(void);
+extern void             wlHuffmanCacheStats(int *cached, int *hitCount,
+    int *missCount);
+
+/* Huffman encoder functions */
+extern wlHuffmanEncoder wlHuffmanEncoderCreate(wlHuffmanNode **nodeIndex,
+    FILE *stream, unsigned char dataByte, unsigned char dataMask);
+extern int              wlHuffmanEncodeBlock(wlHuffmanEncoder encoder,
+    unsigned char *data, size_t size);
+extern int              wlHuffmanEncoderFinish(wlHuffmanEncoder encoder);
+
+/* Huffman index functions */
+extern wlHuffmanIndex wlHuffmanIndexCreate(FILE *stream,
+    wlHuffmanNode *rootNode, unsigned char *block, int size, int interval,
+    unsigned char *dataByte, unsigned char *dataMask);
+extern void           wlHuffmanIndexFree(wlHuffmanIndex index);
+extern int            wlHuffmanIndexRead(wlHuffmanIndex index, FILE *stream,
+    int offset, unsigned char *block, int size);
+
+/* Parallel huffman functions */
+extern int wlHuffmanDecodeParallel(unsigned char *data, size_t size,
+    int bitOffset, wlHuffmanNode *rootNode, unsigned char *block,
+    int quantity, int threads);
+
 /* Image functions */
 extern wlImage wlImageCreate(int width, int height);
 extern void    wlImageFree(wlImage image);
 extern wlImage wlImageClone(wlImage image);
 extern void    wlImageVXorEncode(wlImage image);
 extern void    wlImageVXorDecode(wlImage image);
+extern int     wlImageDecodeHuffman(wlImage image, FILE *stream,
+    wlHuffmanNode *rootNode, unsigned char *dataByte,
+    unsigned char *dataMask);
+extern u_int64_t wlImageHash(wlImage image);
+
+/* Scale functions */
+extern void    wlImageScaleRow(wlImage image, int y, int factor, int method,
+    wlPixel *output);
+extern wlImage wlImageScale(wlImage image, int factor, int method);
+
+/* RGBA conversion functions */
+extern void wlImageToRGBA(wlImage image, wlRGB *palette, int transparent,
+    unsigned char *buffer, int stride);
+extern void wlImagesToRGBA(wlImages images, wlRGB *palette, int transparent,
+    unsigned char *buffer, int stride);
+
+/* Quantizer functions */
+extern wlQuantizer wlQuantizerCreate(wlRGB *palette);
+extern void        wlQuantizerFree(wlQuantizer quantizer);
+extern void        wlQuantizerMap(wlQuantizer quantizer, unsigned char *rgba,
+    int stride, wlImage image, int transparent, int dither);
+
+/* Atlas functions */
+extern wlAtlas wlAtlasBuild(wlImages images, int columns, int dedupe);
+extern wlAtlas wlAtlasBuildTilesets(wlTilesets tilesets, int columns,
+    int dedupe);
+extern void    wlAtlasFree(wlAtlas atlas);
+extern wlRect  wlAtlasGetRect(wlAtlas atlas, int index);
+extern wlRect  wlAtlasGetTileRect(wlAtlas atlas, int tileset, int tile);
+extern int     wlAtlasWriteJsonFile(wlAtlas atlas, char *filename,
+    char *imageName, int scale);
+extern int     wlAtlasWriteJsonStream(wlAtlas atlas, FILE *stream,
+    char *imageName, int scale);
+extern int     wlAtlasWriteTableFile(wlAtlas atlas, char *filename, int scale);
+extern int     wlAtlasWriteTableStream(wlAtlas atlas, FILE *stream, int scale);
+
+/* Tile index functions */
+extern wlTileIndex wlTileIndexCreate(void);
+extern void        wlTileIndexFree(wlTileIndex index);
+extern int         wlTileIndexAdd(wlTileIndex index, wlImage image);
+extern int         wlTileIndexFind(wlTileIndex index, wlImage image);
+
+/* Rectangle functions */
+extern void wlRectClear(wlRect rect);
+extern void wlRectAdd(wlRect rect, int x, int y, int width, int height);
+extern void wlRectAddRun(wlRect rect, wlImage image, int offset, int quantity);
 
 /* PIC functions */
 extern wlImage wlPicReadFile(char *filename);
@@ -204,6 +468,34 @@ extern wlImage wlPicReadStream(FILE *stream);
 extern int     wlPicWriteFile(wlImage pixels, char *filename);
 extern int     wlPicWriteStream(wlImage pixels, FILE *stream);
 
+/* PNG functions */
+extern int wlPngWriteFile(wlImage image, char *filename, int level,
+    int filter);
+extern int wlPngWriteStream(wlImage image, FILE *stream, int level,
+    int filter);
+extern int wlPngWriteScaledFile(wlImage image, char *filename, int level,
+    int filter, int factor, int method);
+extern int wlPngWriteScaledStream(wlImage image, FILE *stream, int level,
+    int filter, int factor, int method);
+
+/* PNG queue functions */
+extern wlPngQueue wlPngQueueCreate(int threads, int level, int filter,
+    int factor, int method);
+extern int        wlPngQueueAdd(wlPngQueue queue, wlImage image, wlDir dir,
+    char *filename);
+extern int        wlPngQueueFinish(wlPngQueue queue);
+
+/* Directory functions */
+extern wlDir  wlDirOpen(char *path, int write);
+extern int    wlDirClose(wlDir dir);
+extern char **wlDirList(wlDir dir, char *suffix, int *quantity);
+extern FILE * wlDirOpenFile(wlDir dir, char *filename);
+extern int    wlDirWriteFile(wlDir dir, char *filename, void *data,
+    size_t size);
+extern FILE * wlDirCreateFile(wlDir dir, char *filename);
+extern int    wlDirCloseFile(wlDir dir, FILE *stream);
+extern int    wlDirMkdir(wlDir dir, char *name);
+
 /* Images functions */
 extern wlImages wlImagesCreate(int quantity, int width, int height);
 extern void     wlImagesFree(wlImages images);
@@ -218,7 +510,9 @@ extern int      wlSpritesWriteStream(wlImages sprites, FILE *spritesStream,
 
 /* Tiles functions */
 extern wlTilesets wlTilesetsReadFile(char *filename);
+extern wlTilesets wlTilesetsReadStream(FILE *stream);
 extern void       wlTilesetsFree(wlTilesets tileSets);
+extern int        wlTilesetsDedupe(wlTilesets tilesets);
 extern wlImages   wlTilesReadStream(FILE *stream);
 
 /* Cursors functions */
@@ -236,7 +530,8 @@ extern int      wlFontWriteStream(wlImages font, FILE *stream);
 /* CPA functions */
 extern wlCpaAnimation * wlCpaCreate(int width, int height);
 extern void             wlCpaFree(wlCpaAnimation *animation);
-extern void             wlCpaApplyFrame(wlImage image, wlCpaFrame *frame);
+extern void             wlCpaApplyFrame(wlImage image, wlCpaFrame *frame,
+    wlRect dirty);
 extern wlCpaAnimation * wlCpaReadFile(char *filename);
 extern wlCpaAnimation * wlCpaReadStream(FILE *stream);
 extern void             wlCpaAddFrame(wlCpaAnimation *animation, wlImage frame,
@@ -248,12 +543,30 @@ extern int              wlCpaWriteStream(wlCpaAnimation *animation,
 
 /* MSQ functions */
 extern wlMsqHeader wlMsqReadHeader(FILE *stream);
+extern int wlMsqOptimizeStream(FILE *input, FILE *output, int threads,
+    int *blocks, int *optimized);
 
 /* PICS animation functions */
 extern wlPicsAnimations wlAnimationsReadFile(char *filename);
+extern wlPicsAnimations wlAnimationsReadStream(FILE *stream);
 extern wlPicsAnimation  wlAnimationReadStream(FILE *stream);
 extern void wlAnimationFree(wlPicsAnimation animations);
 extern void wlAnimationsFree(wlPicsAnimations animations);
-extern void wlAnimationApply(wlImage image, wlPicsUpdateSet set);
+extern void wlAnimationApply(wlImage image, wlPicsUpdateSet set,
+    wlRect dirty);
+
+/* PICS frame cache functions */
+extern wlPicsCache wlPicsCacheCreate(wlPicsAnimation animation);
+extern void        wlPicsCacheFree(wlPicsCache cache);
+extern wlPicsDelta wlPicsCacheGetDelta(wlPicsCache cache, int setNo, int step);
+extern void        wlPicsDeltaApply(wlImage image, wlPicsDelta delta);
+
+/* PICS timeline functions */
+extern wlPicsTimeline wlTimelineCreate(wlPicsAnimation animation,
+    wlPicsCache cache, int interval);
+extern void           wlTimelineFree(wlPicsTimeline timeline);
+extern void           wlTimelineAdvance(wlPicsTimeline timeline, int time);
+extern void           wlTimelineSeek(wlPicsTimeline timeline, int time);
+extern int            wlTimelineGetNextChange(wlPicsTimeline timeline);
 
 #endif
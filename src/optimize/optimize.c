@@ -0,0 +1,260 @@
+/*
+ * $Id$
+ * Copyright (C) 2007  Klaus Reimer <k@ailis.de>
+ * See COPYING file for copying conditions
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "../libwasteland/wasteland.h"
+#include "../common/stream.h"
+#include "config.h"
+
+/** The number of threads which encode the blocks. 0 for one per CPU */
+static int jobs = 0;
+
+/** If a summary is printed to stderr */
+static int verbose = 0;
+
+
+/**
+ * Displays the usage text.
+ */
+
+static void display_usage(void)
+{
+    printf("Usage: wl_optimize [OPTION]... INPUT [OUTPUT]\n");
+    printf("Recompresses the huffman compressed MSQ blocks of a wasteland file\n");
+    printf("(Tilesets, PICS, CPA) with optimal huffman trees. A block is only\n");
+    printf("replaced if it gets smaller, so the decoded data stays identical and\n");
+    printf("the file never grows. Without OUTPUT the input file is replaced.\n");
+    printf("Use - as INPUT to read from stdin and - as OUTPUT to write to stdout.\n");
+    printf("\nOptions\n");
+    printf("  -j, --jobs=N         Encode the blocks with N threads (Default: One\n");
+    printf("                       per CPU)\n");
+    printf("  -v, --verbose        Print the number of blocks and the sizes to\n");
+    printf("                       stderr\n");
+    printf("  -h, --help           Display help and exit\n");
+    printf("  -V, --version        Display version and exit\n");
+    printf("\nReport bugs to %s <%s>\n", AUTHOR, EMAIL);
+}
+
+
+/**
+ * Displays the version information.
+ */
+
+static void display_version(void)
+{
+    printf("wl_optimize %s\n", VERSION);
+    printf("\n%s\n", COPYRIGHT);
+    printf("This is free software; see the source for copying conditions. ");
+    printf("There is NO\nwarranty; not even for MERCHANTABILITY or FITNESS ");
+    printf("FOR A PARTICULAR PURPOSE.\n\nWritten by %s <%s>\n", AUTHOR, EMAIL);
+}
+
+
+/**
+ * Terminate the program with code 1 and the specified error message.
+ *
+ * @param message
+ *            The error message
+ */
+
+static void die(char *message, ...)
+{
+    va_list args;
+
+    va_start(args, message);
+    vfprintf(stderr, message, args);
+    va_end(args);
+    exit(1);
+}
+
+
+/**
+ * Check options.
+ *
+ * @param argc
+ *            The number of arguments
+ * @param argv
+ *            The argument array
+ */
+
+static void check_options(int argc, char *argv[])
+{
+    char opt;
+    int index;
+    static struct option options[]={
+        {"jobs", 1, NULL, 'j'},
+        {"verbose", 0, NULL, 'v'},
+        {"help", 0, NULL, 'h'},
+        {"version", 0, NULL, 'V'},
+        {NULL, 0, NULL, 0}
+    };
+
+    opterr = 0;
+    while((opt = getopt_long(argc, argv, "j:vhV", options, &index)) != -1)
+    {
+        switch(opt)
+        {
+            case 'j':
+                jobs = atoi(optarg);
+                break;
+
+            case 'v':
+                verbose = 1;
+                break;
+
+            case 'V':
+                display_version();
+                exit(1);
+                break;
+
+            case 'h':
+                display_usage();
+                exit(1);
+                break;
+
+            default:
+                die("Unknown option: %s\nUse --help to show valid options.\n",
+                        argv[optind - 1]);
+                break;
+        }
+    }
+    if (jobs < 0) die("Invalid number of jobs: %i\n", jobs);
+}
+
+
+/**
+ * Checks if the two specified files are the same file, for example because
+ * they are hard links or because the same file is given with different
+ * paths. The standard input and output are never the same file.
+ *
+ * @param filename1
+ *            The first filename
+ * @param filename2
+ *            The second filename
+ * @return 1 if both names refer to the same existing file, 0 if not
+ */
+
+static int isSameFile(char *filename1, char *filename2)
+{
+    struct stat status1, status2;
+
+    if (!strcmp(filename1, "-") || !strcmp(filename2, "-")) return 0;
+    if (stat(filename1, &status1) || stat(filename2, &status2)) return 0;
+    return status1.st_dev == status2.st_dev
+        && status1.st_ino == status2.st_ino;
+}
+
+
+/**
+ * Main method of wl_optimize. Called by the wl multi-call program.
+ *
+ * @param argc
+ *            The number of arguments
+ * @param argv
+ *            The argument array
+ * @return Exit value
+ */
+
+int optimize_main(int argc, char *argv[])
+{
+    char *source, *dest, *temp;
+    FILE *input, *output;
+    struct stat status;
+    int blocks, optimized, replace, fd;
+    long inputSize, outputSize;
+
+    /* Process options and reset argument pointer */
+    check_options(argc, argv);
+    argc -= optind;
+    argv += optind;
+
+    /* Terminate if wrong number of parameters are specified */
+    if (argc < 1 || argc > 2)
+        die("Wrong number of parameters.\nUse --help to show syntax.\n");
+
+    /* Process parameters */
+    source = argv[0];
+    dest = argc == 2 ? argv[1] : source;
+    replace = dest == source || isSameFile(source, dest);
+    if (!strcmp(source, "-") && replace)
+        die("An output file is needed when reading from stdin\n");
+
+    /* Open the input file */
+    input = streamOpenInput(source);
+    if (!input) die("Unable to open %s: %s\n", source, strerror(errno));
+
+    /* Open the output file. When the input file is replaced then a
+       temporary file with the permissions of the input file is written and
+       renamed afterwards */
+    temp = NULL;
+    if (replace)
+    {
+        temp = malloc(strlen(dest) + 8);
+        sprintf(temp, "%s.XXXXXX", dest);
+        if ((fd = mkstemp(temp)) == -1)
+            die("Unable to create temporary file %s: %s\n", temp,
+                strerror(errno));
+        if (fstat(fileno(input), &status)
+            || fchmod(fd, status.st_mode & 07777)
+            || !(output = fdopen(fd, "wb")))
+        {
+            unlink(temp);
+            die("Unable to create temporary file %s: %s\n", temp,
+                strerror(errno));
+        }
+    }
+    else
+    {
+        output = streamOpenOutput(dest);
+        if (!output) die("Unable to open %s: %s\n", dest, strerror(errno));
+    }
+
+    /* Optimize the file */
+    if (!wlMsqOptimizeStream(input, output, jobs, &blocks, &optimized))
+    {
+        if (temp) unlink(temp);
+        die("Unable to optimize %s: %s\n", source, strerror(errno));
+    }
+    inputSize = ftell(input);
+    outputSize = ftell(output);
+    streamCloseInput(input);
+    if (!streamCloseOutput(output))
+    {
+        if (temp) unlink(temp);
+        die("Unable to write %s: %s\n", dest, strerror(errno));
+    }
+    if (temp)
+    {
+        if (rename(temp, dest))
+        {
+            unlink(temp);
+            die("Unable to replace %s: %s\n", dest, strerror(errno));
+        }
+        free(temp);
+    }
+
+    /* Print the summary */
+    if (verbose)
+    {
+        fprintf(stderr, "%s: %i of %i blocks optimized", source, optimized,
+            blocks);
+        if (inputSize >= 0 && outputSize >= 0)
+            fprintf(stderr, ", %li -> %li bytes (%li bytes saved)",
+                inputSize, outputSize, inputSize - outputSize);
+        fprintf(stderr, "\n");
+    }
+
+    /* Success */
+    return 0;
+}
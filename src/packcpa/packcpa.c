@@ -12,12 +12,15 @@
 #include <string.h>
 #include <gd.h>
 #include <errno.h>
-#include <dirent.h>
 #include "../libwasteland/wasteland.h"
 #include "../common/str.h"
 #include "../common/list.h"
+#include "../common/stream.h"
 #include "config.h"
 
+/** If colors which are not in the palette are dithered */
+static int dither = 0;
+
 
 /**
  * Displays the usage text.
@@ -30,7 +33,10 @@ static void display_usage(void)
     printf("\nThe first 8 PNG files found in INPUTDIR are used "
             "(Alphabetically sorted).\nSize and colors doesn't matter because "
             "the images are automatically converted.\n");
+    printf("Use - as INPUTDIR to read a tar archive from stdin and - as\n");
+    printf("CPAFILE to write to stdout.\n");
     printf("\nOptions\n");
+    printf("  -d, --dither            Dither colors which are not in the palette\n");
     printf("  -h, --help              Display help and exit\n");
     printf("  -V, --version           Display version and exit\n");
     printf("\nReport bugs to %s <%s>\n", AUTHOR, EMAIL);
@@ -83,15 +89,21 @@ static void check_options(int argc, char *argv[])
     char opt;
     int index;
     static struct option options[]={
+        {"dither", 0, NULL, 'd'},
         {"help", 0, NULL, 'h'},
-        {"version", 0, NULL, 'V'}
+        {"version", 0, NULL, 'V'},
+        {NULL, 0, NULL, 0}
     };
     
     opterr = 0;
-    while((opt = getopt_long(argc, argv, "hV", options, &index)) != -1)
+    while((opt = getopt_long(argc, argv, "dhV", options, &index)) != -1)
     {
         switch(opt) 
         {
+            case 'd':
+                dither = 1;
+                break;
+
             case 'V':
                 display_version();
                 exit(1);
@@ -111,25 +123,89 @@ static void check_options(int argc, char *argv[])
 }
 
 
+/**
+ * Converts the specified GD image into RGBA pixels (Four bytes per pixel) of
+ * the specified size. The image is only resampled if its size differs from
+ * the requested size. The returned buffer must be freed by the caller.
+ *
+ * @param image
+ *            The GD image
+ * @param width
+ *            The width of the RGBA pixels
+ * @param height
+ *            The height of the RGBA pixels
+ * @return The RGBA pixels
+ */
+
+static unsigned char * createRGBA(gdImagePtr image, int width, int height)
+{
+    gdImagePtr scaled;
+    unsigned char *rgba, *pixel;
+    int x, y, color, alpha;
+
+    // Resample the image to the requested size if needed
+    scaled = NULL;
+    if (gdImageSX(image) != width || gdImageSY(image) != height)
+    {
+        scaled = gdImageCreateTrueColor(width, height);
+        gdImageAlphaBlending(scaled, 0);
+        gdImageSaveAlpha(scaled, 1);
+        gdImageCopyResampled(scaled, image, 0, 0, 0, 0, width, height,
+                gdImageSX(image), gdImageSY(image));
+        image = scaled;
+    }
+
+    // Read the pixels directly from the pixel rows of the image
+    rgba = (unsigned char *) malloc(width * height * 4);
+    pixel = rgba;
+    for (y = 0; y < height; y++)
+    {
+        for (x = 0; x < width; x++, pixel += 4)
+        {
+            if (gdImageTrueColor(image))
+            {
+                color = gdImageTrueColorPixel(image, x, y);
+                alpha = gdTrueColorGetAlpha(color);
+            }
+            else
+            {
+                color = gdImagePalettePixel(image, x, y);
+                alpha = color == gdImageGetTransparent(image) ?
+                        gdAlphaTransparent : gdImageAlpha(image, color);
+            }
+            pixel[0] = gdImageRed(image, color);
+            pixel[1] = gdImageGreen(image, color);
+            pixel[2] = gdImageBlue(image, color);
+            pixel[3] = (gdAlphaMax - alpha) * 255 / gdAlphaMax;
+        }
+    }
+    if (scaled) gdImageDestroy(scaled);
+    return rgba;
+}
+
+
 /**
  * Reads GD image from the specified PNG and converts it into a wasteland
  * image.
  * 
+ * @param dir
+ *            The input directory
  * @param filename
  *            The PNG filename
+ * @param quantizer
+ *            The quantizer which maps the colors onto the palette
  * return The wasteland image
  */
 
-static wlImage readImage(char *filename)
+static wlImage readImage(wlDir dir, char *filename, wlQuantizer quantizer)
 {
     gdImagePtr image;
-    gdImagePtr output;
     wlImage result;
-    int x, y, i;
+    unsigned char *rgba;
     FILE *file;
         
     // Read base frame
-    file = fopen(filename, "rb");
+    file = wlDirOpenFile(dir, filename);
     if (!file)
     {
         die("Unable to read PNG from %s: %s\n", filename, strerror(errno));
@@ -137,59 +213,31 @@ static wlImage readImage(char *filename)
     image = gdImageCreateFromPng(file);
     fclose(file);
 
-    // Create a temporary second image for palette conversion
-    output = gdImageCreate(288, 128);
-    for (i = 0; i < 16; i++)
-    {
-        gdImageColorAllocate(output, wlPalette[i].red, wlPalette[i].green,
-                wlPalette[i].blue);
-    }
-    for (i = 16; i < 256; i++) gdImageColorAllocate(output, 0, 0, 0);
-    gdImageCopyResampled(output, image, 0, 0, 0, 0, 288, 128, gdImageSX(image),
-            gdImageSY(image));
-    
-    // Copy pixels from image to pic
-    result = (wlImage) malloc(sizeof(wlPixel) * 288 * 128);
-    for (y = 0; y < 128; y++)       
-    {
-        for (x = 0; x < 288; x++)
-        {
-            result->pixels[y * 288 + x] = gdImageGetPixel(output, x, y);
-        }
-    }
+    // Map the pixels onto the palette
+    rgba = createRGBA(image, 288, 128);
+    result = wlImageCreate(288, 128);
+    wlQuantizerMap(quantizer, rgba, 0, result, -1, dither);
     
     // Free resources and return result image
+    free(rgba);
     gdImageDestroy(image);
-    gdImageDestroy(output);
     return result;
 }
 
 
-/**
- * Used by qsort for sorting filenames.
- */
- 
-static int sortFilenames(const void *p1, const void *p2)
-{
-    return strcmp(* (char * const *) p1, * (char * const *) p2);
-}
-
-
 /**
  * Reads all animation frames (All PNG files in alphabetical order) from the
  * specified input directory, converts them into wasteland CPA animation and
  * returns the animation container.
  * 
  * @param inputDir
- *            The input directory
+ *            The input directory or "-" for a tar archive on stdin
  * @return The wasteland CPA animation container 
  */
 
 static wlCpaAnimation *readAnimation(char *inputDir)
 {
-    char *oldDir;
-    DIR *dir;
-    struct dirent *entry;
+    wlDir dir;
     char **filenames;
     int quantity;
     wlCpaAnimation *animation;
@@ -199,37 +247,27 @@ static wlCpaAnimation *readAnimation(char *inputDir)
     char buffer[256];
     char *line;
     int delay;
+    wlQuantizer quantizer;
 
-    // Change to input directory but remember current directory
-    oldDir = getcwd(NULL, 0);
-    if (chdir(inputDir))
-    {
-        die("Unable to change to input directory %s: %s\n", inputDir,
-                strerror(errno));
-        return NULL;
-    }
-    
     // Build list of PNG files found in directory
-    listCreate(filenames, &quantity);
-    dir = opendir(inputDir);
-    while ((entry = readdir(dir)))
+    dir = wlDirOpen(inputDir, 0);
+    if (!dir)
     {
-        if (strEndsWithIgnoreCase(entry->d_name, ".png"))
-        {
-            listAdd(filenames, strdup(entry->d_name), &quantity);
-        }
+        die("Unable to open input directory %s: %s\n", inputDir,
+                strerror(errno));
     }
-    closedir(dir);
-    qsort(filenames, quantity, sizeof(char *), sortFilenames);
+    filenames = wlDirList(dir, ".png", &quantity);
     
-    delays = fopen("delays.txt", "rt");
+    delays = wlDirOpenFile(dir, "delays.txt");
     if (!delays) die("Unable to read delays.txt file: %s\n", strerror(errno));
     
     // Build the animation container
     animation = wlCpaCreate(288, 128);
-    baseFrame = readImage(filenames[0]);
-    lastFrame = readImage(filenames[quantity - 1]);
-    memcpy(animation->baseFrame, baseFrame, 288 * 128 * sizeof(wlPixel));
+    quantizer = wlQuantizerCreate(NULL);
+    baseFrame = readImage(dir, filenames[0], quantizer);
+    lastFrame = readImage(dir, filenames[quantity - 1], quantizer);
+    memcpy(animation->baseFrame->pixels, baseFrame->pixels,
+            288 * 128 * sizeof(wlPixel));
     for (i = 1; i < quantity; i++)
     {
         // Read delay from delay.txt
@@ -254,30 +292,24 @@ static wlCpaAnimation *readAnimation(char *inputDir)
         }        
         
         frame = i == quantity - 1 ? lastFrame 
-                : readImage(filenames[i]);
+                : readImage(dir, filenames[i], quantizer);
         wlCpaAddFrame(animation, frame, baseFrame, i == 11 ? lastFrame : NULL,
                 delay);
-        free(baseFrame);
+        wlImageFree(baseFrame);
         baseFrame = frame;
     }
-    free(baseFrame);
+    wlImageFree(baseFrame);
+    wlQuantizerFree(quantizer);
     listFreeWithItems(filenames, &quantity);
     fclose(delays);
     
-    // Go back to previous directory and then return the animation
-    if (chdir(oldDir))
-    {
-        die("Unable to change to directory %s: %s\n", oldDir,
-                strerror(errno));
-        return NULL;
-    }
-    free(oldDir);
+    wlDirClose(dir);
     return animation;
 }
 
 
 /**
- * Main method
+ * Main method of wl_packcpa. Called by the wl multi-call program.
  *
  * @param argc
  *            The number of arguments
@@ -286,9 +318,10 @@ static wlCpaAnimation *readAnimation(char *inputDir)
  * @return Exit value
  */
 
-int main(int argc, char *argv[])
+int packcpa_main(int argc, char *argv[])
 {  
     char *filename, *inputDir;
+    FILE *file;
     wlCpaAnimation *animation;
     
     /* Process options and reset argument pointer */
@@ -307,7 +340,8 @@ int main(int argc, char *argv[])
     animation = readAnimation(inputDir);
     
     /* Write the animation */
-    if (!wlCpaWriteFile(animation, filename))
+    file = streamOpenOutput(filename);
+    if (!file || !wlCpaWriteStream(animation, file) || !streamCloseOutput(file))
     {
         die("Write to animation file %s failed: %s\n", filename, strerror(errno));
     }
@@ -12,10 +12,10 @@
 #include <string.h>
 #include <gd.h>
 #include <errno.h>
-#include <dirent.h>
 #include "../libwasteland/wasteland.h"
 #include "../common/str.h"
 #include "../common/list.h"
+#include "../common/stream.h"
 #include "config.h"
 
 #ifdef WIN32
@@ -24,6 +24,9 @@
 #define SEPARATOR '/'
 #endif
 
+/** If colors which are not in the palette are dithered */
+static int dither = 0;
+
 
 /**
  * Displays the usage text.
@@ -36,7 +39,10 @@ static void display_usage(void)
     printf("\nThe first 172 PNG files found in INPUTDIR are used "
             "(Alphabetically sorted).\nSize and colors doesn't matter because "
             "the images are automatically converted.\n");
+    printf("Use - as INPUTDIR to read a tar archive from stdin and - as\n");
+    printf("FONTFILE to write to stdout.\n");
     printf("\nOptions\n");
+    printf("  -d, --dither            Dither colors which are not in the palette\n");
     printf("  -h, --help              Display help and exit\n");
     printf("  -V, --version           Display version and exit\n");
     printf("\nReport bugs to %s <%s>\n", AUTHOR, EMAIL);
@@ -89,15 +95,21 @@ static void check_options(int argc, char *argv[])
     char opt;
     int index;
     static struct option options[]={
+        {"dither", 0, NULL, 'd'},
         {"help", 0, NULL, 'h'},
-        {"version", 0, NULL, 'V'}
+        {"version", 0, NULL, 'V'},
+        {NULL, 0, NULL, 0}
     };
     
     opterr = 0;
-    while((opt = getopt_long(argc, argv, "hV", options, &index)) != -1)
+    while((opt = getopt_long(argc, argv, "dhV", options, &index)) != -1)
     {
         switch(opt) 
         {
+            case 'd':
+                dither = 1;
+                break;
+
             case 'V':
                 display_version();
                 exit(1);
@@ -118,59 +130,88 @@ static void check_options(int argc, char *argv[])
 
 
 /**
- * Converts image into a wasteland font glyph and stores it in the specified
- * font at the specified index.
- * 
- * @param font
- *            The font
- * @param index
- *            The glyph index
+ * Converts the specified GD image into RGBA pixels (Four bytes per pixel) of
+ * the specified size. The image is only resampled if its size differs from
+ * the requested size. The returned buffer must be freed by the caller.
+ *
  * @param image
- *            The image
+ *            The GD image
+ * @param width
+ *            The width of the RGBA pixels
+ * @param height
+ *            The height of the RGBA pixels
+ * @return The RGBA pixels
  */
 
-static void storeFontGlyph(wlImages font, int index, gdImagePtr image)
+static unsigned char * createRGBA(gdImagePtr image, int width, int height)
 {
-    gdImagePtr output;
-    int x, y, i;
-    int transparency, color;
-    
-    /* Create a temporary second image for palette conversion */
-    output = gdImageCreate(8, 8);
-    for (i = 0; i < 16; i++)
+    gdImagePtr scaled;
+    unsigned char *rgba, *pixel;
+    int x, y, color, alpha;
+
+    // Resample the image to the requested size if needed
+    scaled = NULL;
+    if (gdImageSX(image) != width || gdImageSY(image) != height)
     {
-        gdImageColorAllocate(output, wlPalette[i].red,
-                wlPalette[i].green, wlPalette[i].blue);
+        scaled = gdImageCreateTrueColor(width, height);
+        gdImageAlphaBlending(scaled, 0);
+        gdImageSaveAlpha(scaled, 1);
+        gdImageCopyResampled(scaled, image, 0, 0, 0, 0, width, height,
+                gdImageSX(image), gdImageSY(image));
+        image = scaled;
     }
-    transparency = gdImageColorAllocate(output, 0, 0, 0);
-    gdImageColorTransparent(output, transparency);
-    for (i = 17; i < 256; i++) gdImageColorAllocate(output, 0, 0, 0);
-    gdImageFilledRectangle(output, 0, 0, 8, 8, transparency);
-    gdImageCopyResampled(output, image, 0, 0, 0, 0, 8, 8, gdImageSX(image),
-            gdImageSY(image));
-
-    /* Copy pixels from image to pic */
-    for (y = 0; y < 8; y++)       
+
+    // Read the pixels directly from the pixel rows of the image
+    rgba = (unsigned char *) malloc(width * height * 4);
+    pixel = rgba;
+    for (y = 0; y < height; y++)
     {
-        for (x = 0; x < 8; x++)
+        for (x = 0; x < width; x++, pixel += 4)
         {
-           color = gdImageGetPixel(output, x, y);
-           font->images[index]->pixels[y * 8 + x] = color < 16 ? color : color | 0xf0;
+            if (gdImageTrueColor(image))
+            {
+                color = gdImageTrueColorPixel(image, x, y);
+                alpha = gdTrueColorGetAlpha(color);
+            }
+            else
+            {
+                color = gdImagePalettePixel(image, x, y);
+                alpha = color == gdImageGetTransparent(image) ?
+                        gdAlphaTransparent : gdImageAlpha(image, color);
+            }
+            pixel[0] = gdImageRed(image, color);
+            pixel[1] = gdImageGreen(image, color);
+            pixel[2] = gdImageBlue(image, color);
+            pixel[3] = (gdAlphaMax - alpha) * 255 / gdAlphaMax;
         }
     }
-    
-    /* Free resources */
-    gdImageDestroy(output);
+    if (scaled) gdImageDestroy(scaled);
+    return rgba;
 }
 
 
 /**
- * Used by qsort for sorting filenames.
+ * Converts image into a wasteland font glyph and stores it in the specified
+ * font at the specified index.
+ * 
+ * @param font
+ *            The font
+ * @param index
+ *            The glyph index
+ * @param image
+ *            The image
+ * @param quantizer
+ *            The quantizer which maps the colors onto the palette
  */
- 
-static int sortFilenames(const void *p1, const void *p2)
+
+static void storeFontGlyph(wlImages font, int index, gdImagePtr image,
+    wlQuantizer quantizer)
 {
-    return strcmp(* (char * const *) p1, * (char * const *) p2);
+    unsigned char *rgba;
+
+    rgba = createRGBA(image, 8, 8);
+    wlQuantizerMap(quantizer, rgba, 0, font->images[index], 0xf0, dither);
+    free(rgba);
 }
 
 
@@ -180,51 +221,38 @@ static int sortFilenames(const void *p1, const void *p2)
  * font.
  * 
  * @param inputDir
- *            The input directory
+ *            The input directory or "-" for a tar archive on stdin
  * @return The wasteland font 
  */
 
 static wlImages readFont(char *inputDir)
 {
-    char *oldDir;
-    DIR *dir;
-    struct dirent *entry;
+    wlDir dir;
     char **filenames;
     int quantity;
     wlImages font;
     int i;
     gdImagePtr image;
     FILE *file;
+    wlQuantizer quantizer;
 
-    // Change to input directory but remember current directory
-    oldDir = getcwd(NULL, 0);
-    if (chdir(inputDir))
-    {
-        die("Unable to change to input directory %s: %s\n", inputDir,
-                strerror(errno));
-        return NULL;
-    }
-    
     // Build list of PNG files found in directory
-    listCreate(filenames, &quantity);
-    dir = opendir(inputDir);
-    while ((entry = readdir(dir)))
+    dir = wlDirOpen(inputDir, 0);
+    if (!dir)
     {
-        if (strEndsWithIgnoreCase(entry->d_name, ".png"))
-        {
-            listAdd(filenames, strdup(entry->d_name), &quantity);
-        }
+        die("Unable to open input directory %s: %s\n", inputDir,
+                strerror(errno));
     }
-    closedir(dir);
-    qsort(filenames, quantity, sizeof(char *), sortFilenames);
+    filenames = wlDirList(dir, ".png", &quantity);
     
     // Build the font
     font = wlImagesCreate(172, 8, 8);
+    quantizer = wlQuantizerCreate(NULL);
     for (i = 0; i < 172; i++)
     {
         if (i < quantity)
         {
-            file = fopen(filenames[i], "rb");
+            file = wlDirOpenFile(dir, filenames[i]);
             if (!file)
             {
                 die("Unable to read PNG from %s: %s\n", filenames[i],
@@ -232,26 +260,20 @@ static wlImages readFont(char *inputDir)
             }
             image = gdImageCreateFromPng(file);
             fclose(file);
-            storeFontGlyph(font, i, image);
+            storeFontGlyph(font, i, image, quantizer);
             gdImageDestroy(image);
         }
     }
+    wlQuantizerFree(quantizer);
     listFreeWithItems(filenames, &quantity);
     
-    // Go back to previous directory and then return the font
-    if (chdir(oldDir))
-    {
-        die("Unable to change to directory %s: %s\n", oldDir,
-                strerror(errno));
-        return NULL;
-    }
-    free(oldDir);
+    wlDirClose(dir);
     return font;
 }
 
 
 /**
- * Main method
+ * Main method of wl_packfont. Called by the wl multi-call program.
  *
  * @param argc
  *            The number of arguments
@@ -260,9 +282,10 @@ static wlImages readFont(char *inputDir)
  * @return Exit value
  */
 
-int main(int argc, char *argv[])
+int packfont_main(int argc, char *argv[])
 {  
     char *filename, *inputDir;
+    FILE *file;
     wlImages font;
     
     /* Process options and reset argument pointer */
@@ -281,7 +304,11 @@ int main(int argc, char *argv[])
     font = readFont(inputDir);
     
     /* Write the font */
-    wlFontWriteFile(font, filename);
+    file = streamOpenOutput(filename);
+    if (!file || !wlFontWriteStream(font, file) || !streamCloseOutput(file))
+    {
+        die("Unable to write font to %s: %s\n", filename, strerror(errno));
+    }
     
     /* Free memory */
     wlImagesFree(font);
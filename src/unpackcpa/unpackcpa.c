@@ -12,9 +12,9 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
-#include <gd.h>
 #include <errno.h>
 #include "../libwasteland/wasteland.h"
+#include "../common/stream.h"
 #include "config.h"
 
 #ifdef WIN32
@@ -23,6 +23,15 @@
 #define SEPARATOR '/'
 #endif
 
+/** The factor by which the written PNG images are scaled */
+static int scale = 1;
+
+/** The scale method (WL_SCALE_NEAREST or WL_SCALE_EPX) */
+static int scaleMethod = WL_SCALE_NEAREST;
+
+/** The number of threads writing the PNG files. 0 for one per CPU */
+static int jobs = 0;
+
 
 /**
  * Displays the usage text.
@@ -32,7 +41,14 @@ static void display_usage(void)
 {
     printf("Usage: wl_unpackcpa [OPTION]... CPAFILE OUTPUTDIR\n");
     printf("Unpacks CPA animation file into PNG images.\n");
+    printf("Use - as CPAFILE to read from stdin and - as OUTPUTDIR to write\n");
+    printf("a tar archive to stdout.\n");
     printf("\nOptions\n");
+    printf("  -s, --scale=FACTOR      Scale the images by an integer FACTOR\n");
+    printf("  -e, --epx               Scale with EPX (Scale2x/3x/4x) instead of\n");
+    printf("                          nearest neighbour\n");
+    printf("  -j, --jobs=N            Compress the PNG files with N threads\n");
+    printf("                          (Default: One per CPU)\n");
     printf("  -h, --help              Display help and exit\n");
     printf("  -V, --version           Display version and exit\n");
     printf("\nReport bugs to %s <%s>\n", AUTHOR, EMAIL);
@@ -85,15 +101,31 @@ static void check_options(int argc, char *argv[])
     char opt;
     int index;
     static struct option options[]={
+        {"scale", 1, NULL, 's'},
+        {"epx", 0, NULL, 'e'},
+        {"jobs", 1, NULL, 'j'},
         {"help", 0, NULL, 'h'},
-        {"version", 0, NULL, 'V'}
+        {"version", 0, NULL, 'V'},
+        {NULL, 0, NULL, 0}
     };
     
     opterr = 0;
-    while((opt = getopt_long(argc, argv, "hV", options, &index)) != -1)
+    while((opt = getopt_long(argc, argv, "s:ej:hV", options, &index)) != -1)
     {
         switch(opt) 
         {
+            case 's':
+                scale = atoi(optarg);
+                break;
+
+            case 'e':
+                scaleMethod = WL_SCALE_EPX;
+                break;
+
+            case 'j':
+                jobs = atoi(optarg);
+                break;
+
             case 'V':
                 display_version();
                 exit(1);
@@ -110,45 +142,10 @@ static void check_options(int argc, char *argv[])
                 break;
         }
     }
-}
-
-
-/**
- * Writes a single image into the specified file in PNG format.
- * 
- * @param filename
- *            The output filename
- * @param image
- *            The image to write
- */
-
-static void writePng(char *filename, wlImage image)
-{    
-    gdImagePtr output;
-    int x, y, i;
-    FILE *file;
-
-    output = gdImageCreate(288, 128);
-    for (i = 0; i < 16; i++)
-    {
-        gdImageColorAllocate(output, wlPalette[i].red,
-                wlPalette[i].green, wlPalette[i].blue);
-    }
-    for (y = 0; y < 128; y++)       
-    {
-        for (x = 0; x < 288; x++)
-        {
-            gdImageSetPixel(output, x, y, image->pixels[y * 288 + x]);
-        }
-    }    
-    file = fopen(filename, "wb");
-    if (!file)
-    {
-        die("Unable to write PNG to %s: %s\n", filename, strerror(errno));
-    }
-    gdImagePng(output, file);
-    gdImageDestroy(output);
-    fclose(file);    
+    if (scale < 1) die("Invalid scale factor: %i\n", scale);
+    if (scaleMethod == WL_SCALE_EPX && (scale < 2 || scale > 4))
+        die("EPX only supports the scale factors 2, 3 and 4\n");
+    if (jobs < 0) die("Invalid number of jobs: %i\n", jobs);
 }
 
 
@@ -156,7 +153,7 @@ static void writePng(char *filename, wlImage image)
  * Writes animation data into the specified output directory.
  * 
  * @param outputDir
- *            The output directory
+ *            The output directory or "-" for a tar archive on stdout
  * @param animation
  *            The CPA animation
  */
@@ -164,58 +161,74 @@ static void writePng(char *filename, wlImage image)
 static void writePngs(char *outputDir, wlCpaAnimation *animation)
 {
     int i;
-    char *oldDir;
-    char filename[6];
+    wlDir dir;
+    char filename[16];
     wlImage frame;
+    wlPngQueue queue;
     FILE *delays;
     
-    // Remember current directory and then switch to output directory
-    oldDir = getcwd(NULL, 0);
-    if (chdir(outputDir))
+    // Open the output directory and start the PNG queue
+    dir = wlDirOpen(outputDir, 1);
+    if (!dir)
     {
-        die("Unable to change to output directory %s: %s\n", outputDir,
+        die("Unable to open output directory %s: %s\n", outputDir,
                 strerror(errno));
-        return;
-    }    
+    }
+    queue = wlPngQueueCreate(jobs, -1, WL_PNG_FILTER_NONE, scale,
+        scaleMethod);
+    if (!queue) die("Unable to start PNG threads: %s\n", strerror(errno));
     
     // Create a copy of the base frame
-    frame = (wlImage) malloc(sizeof(wlPixel) * 288 * 128);
-    memcpy(frame, animation->baseFrame, sizeof(wlPixel) * 288 * 128);
+    frame = wlImageClone(animation->baseFrame);
     
     // Write the base frame PNG
-    writePng("00.png", frame);
+    if (!wlPngQueueAdd(queue, frame, dir, "00.png"))
+    {
+        die("Unable to write PNGs to %s: %s\n", outputDir, strerror(errno));
+    }
     
-    delays = fopen("delays.txt", "wt");
+    delays = wlDirCreateFile(dir, "delays.txt");
+    if (!delays)
+    {
+        die("Unable to write delays.txt to %s: %s\n", outputDir,
+                strerror(errno));
+    }
     fprintf(delays, "# The delays between the animation frames (0-65534)\n\n");
     
     // Cycle through all animation frames, apply the frame updates to our frame
-    // and then write the frame PNG
+    // and then queue the frame PNG. The queue copies the frame so it can be
+    // updated right away.
     for (i = 0; i < animation->quantity; i++)
     {
-        wlCpaApplyFrame(frame, animation->frames[i]);
-        sprintf(filename, "%02i.png", i + 1);
-        writePng(filename, frame);
+        wlCpaApplyFrame(frame, animation->frames[i], NULL);
+        snprintf(filename, sizeof(filename), "%02i.png", i + 1);
+        if (!wlPngQueueAdd(queue, frame, dir, filename)) break;
         fprintf(delays, "%5i\n", animation->frames[i]->delay);
     }
     
-    fclose(delays);
-        
-    // Go back to old directorry
-    if (chdir(oldDir))
+    if (!wlDirCloseFile(dir, delays))
     {
-        die("Unable to change to directory %s: %s\n", oldDir,
+        die("Unable to write delays.txt to %s: %s\n", outputDir,
                 strerror(errno));
-        return;
-    }    
+    }
+        
+    // Write the remaining PNGs
+    if (!wlPngQueueFinish(queue))
+    {
+        die("Unable to write PNGs to %s: %s\n", outputDir, strerror(errno));
+    }
     
     // Free resources
-    free(frame);
-    free(oldDir);
+    wlImageFree(frame);
+    if (!wlDirClose(dir))
+    {
+        die("Unable to write to %s: %s\n", outputDir, strerror(errno));
+    }
 }
 
 
 /**
- * Main method
+ * Main method of wl_unpackcpa. Called by the wl multi-call program.
  *
  * @param argc
  *            The number of arguments
@@ -224,9 +237,10 @@ static void writePngs(char *outputDir, wlCpaAnimation *animation)
  * @return Exit value
  */
 
-int main(int argc, char *argv[])
+int unpackcpa_main(int argc, char *argv[])
 {  
     char *filename, *outputDir;
+    FILE *file;
     wlCpaAnimation *animation;
     
     /* Process options and reset argument pointer */
@@ -242,7 +256,13 @@ int main(int argc, char *argv[])
     outputDir = argv[1];
     
     /* Read the animation */
-    animation = wlCpaReadFile(filename);
+    file = streamOpenInput(filename);
+    if (!file)
+    {
+        die("Unable to open CPA file %s: %s\n", filename, strerror(errno));
+    }
+    animation = wlCpaReadStream(file);
+    streamCloseInput(file);
     if (!animation)
     {
         die("Unable to read CPA animation from %s: %s\n", filename,
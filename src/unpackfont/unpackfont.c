@@ -12,9 +12,9 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
-#include <gd.h>
 #include <errno.h>
 #include "../libwasteland/wasteland.h"
+#include "../common/stream.h"
 #include "config.h"
 
 #ifdef WIN32
@@ -23,6 +23,18 @@
 #define SEPARATOR '/'
 #endif
 
+/** The factor by which the written PNG images are scaled */
+static int scale = 1;
+
+/** The scale method (WL_SCALE_NEAREST or WL_SCALE_EPX) */
+static int scaleMethod = WL_SCALE_NEAREST;
+
+/** The number of threads writing the PNG files. 0 for one per CPU */
+static int jobs = 0;
+
+/** If the images are written into a single atlas image */
+static int useAtlas = 0;
+
 
 /**
  * Displays the usage text.
@@ -32,7 +44,16 @@ static void display_usage(void)
 {
     printf("Usage: wl_unpackfont [OPTION]... FONTFILE OUTPUTDIR\n");
     printf("Unpacks font into PNG images.\n");
+    printf("Use - as FONTFILE to read from stdin and - as OUTPUTDIR to write\n");
+    printf("a tar archive to stdout.\n");
     printf("\nOptions\n");
+    printf("  -s, --scale=FACTOR      Scale the images by an integer FACTOR\n");
+    printf("  -e, --epx               Scale with EPX (Scale2x/3x/4x) instead of\n");
+    printf("                          nearest neighbour\n");
+    printf("  -a, --atlas             Write a single atlas image with a JSON and\n");
+    printf("                          a binary coordinate table\n");
+    printf("  -j, --jobs=N            Compress the PNG files with N threads\n");
+    printf("                          (Default: One per CPU)\n");
     printf("  -h, --help              Display help and exit\n");
     printf("  -V, --version           Display version and exit\n");
     printf("\nReport bugs to %s <%s>\n", AUTHOR, EMAIL);
@@ -85,15 +106,36 @@ static void check_options(int argc, char *argv[])
     char opt;
     int index;
     static struct option options[]={
+        {"scale", 1, NULL, 's'},
+        {"epx", 0, NULL, 'e'},
+        {"atlas", 0, NULL, 'a'},
+        {"jobs", 1, NULL, 'j'},
         {"help", 0, NULL, 'h'},
-        {"version", 0, NULL, 'V'}
+        {"version", 0, NULL, 'V'},
+        {NULL, 0, NULL, 0}
     };
     
     opterr = 0;
-    while((opt = getopt_long(argc, argv, "hV", options, &index)) != -1)
+    while((opt = getopt_long(argc, argv, "s:eaj:hV", options, &index)) != -1)
     {
         switch(opt) 
         {
+            case 's':
+                scale = atoi(optarg);
+                break;
+
+            case 'e':
+                scaleMethod = WL_SCALE_EPX;
+                break;
+
+            case 'a':
+                useAtlas = 1;
+                break;
+
+            case 'j':
+                jobs = atoi(optarg);
+                break;
+
             case 'V':
                 display_version();
                 exit(1);
@@ -110,98 +152,103 @@ static void check_options(int argc, char *argv[])
                 break;
         }
     }
+    if (scale < 1) die("Invalid scale factor: %i\n", scale);
+    if (scaleMethod == WL_SCALE_EPX && (scale < 2 || scale > 4))
+        die("EPX only supports the scale factors 2, 3 and 4\n");
+    if (jobs < 0) die("Invalid number of jobs: %i\n", jobs);
 }
 
 
 /**
- * Writes a single font glyph into the specified file in PNG format.
+ * Writes all the font into the specified output directory.
  * 
- * @param filename
- *            The output filename
+ * @param outputDir
+ *            The output directory or "-" for a tar archive on stdout
  * @param font
- *            The font
- * @param glyph
- *            The glyph number to write
+ *            The font to write
  */
 
-static void writePng(char *filename, wlImages font, int glyph)
+static void writePngs(char *outputDir, wlImages font)
 {
-    gdImagePtr output;
-    int x, y, i;
-    int palette[17];
-    int transparent;
-    int color;
-    FILE *file;
-    wlImage image;
-    
-    image = font->images[glyph];
+    wlPngQueue queue;
+    char filename[8];
+    int i;
+    wlDir dir;
 
-    output = gdImageCreate(image->width, image->height);
-    for (i = 0; i < 16; i++)
+    dir = wlDirOpen(outputDir, 1);
+    if (!dir)
     {
-        palette[i] = gdImageColorAllocate(output, wlPalette[i].red,
-                wlPalette[i].green, wlPalette[i].blue);
+        die("Unable to open output directory %s: %s\n", outputDir,
+                strerror(errno));
     }
-    transparent = gdImageColorAllocate(output, 0, 0, 0);
-    gdImageColorTransparent(output, transparent);
-    for (y = 0; y < image->height; y++)       
+    queue = wlPngQueueCreate(jobs, -1, WL_PNG_FILTER_NONE, scale,
+        scaleMethod);
+    if (!queue) die("Unable to start PNG threads: %s\n", strerror(errno));
+    for (i = 0; i < 172; i++)
     {
-        for (x = 0; x < image->width; x++)
-        {
-            color = image->pixels[y * image->width + x];
-            gdImageSetPixel(output, x, y, color < 16 ? palette[color] : transparent);
-        }
-    }    
-    file = fopen(filename, "wb");
-    if (!file)
+        sprintf(filename, "%03i.png", i);
+        if (!wlPngQueueAdd(queue, font->images[i], dir, filename)) break;
+    }
+    if (!wlPngQueueFinish(queue))
     {
-        die("Unable to write PNG to %s: %s\n", filename, strerror(errno));
+        die("Unable to write PNGs to %s: %s\n", outputDir, strerror(errno));
+    }
+    if (!wlDirClose(dir))
+    {
+        die("Unable to write to %s: %s\n", outputDir, strerror(errno));
     }
-    gdImagePng(output, file);
-    gdImageDestroy(output);
-    fclose(file);    
 }
 
 
 /**
- * Writes all the font into the specified output directory.
- * 
+ * Writes all images into a single atlas image in the specified output
+ * directory. Duplicate images are only stored once. The positions of the
+ * images in the atlas are written into a JSON file and into a binary table.
+ *
  * @param outputDir
- *            The output directory
- * @param font
- *            The font to write
+ *            The output directory or "-" for a tar archive on stdout
+ * @param atlas
+ *            The atlas to write
  */
 
-static void writePngs(char *outputDir, wlImages font)
+static void writeAtlas(char *outputDir, wlAtlas atlas)
 {
-    int i;
-    char *oldDir;
-    char filename[8];
-    
-    oldDir = getcwd(NULL, 0);
-    if (chdir(outputDir))
+    wlDir dir;
+    FILE *file;
+
+    dir = wlDirOpen(outputDir, 1);
+    if (!dir)
     {
-        die("Unable to change to output directory %s: %s\n", outputDir,
+        die("Unable to open output directory %s: %s\n", outputDir,
                 strerror(errno));
-        return;
     }
-    for (i = 0; i < 172; i++)
+    file = wlDirCreateFile(dir, "atlas.png");
+    if (!file || !wlPngWriteScaledStream(atlas->image, file, -1,
+        WL_PNG_FILTER_NONE, scale, scaleMethod) || !wlDirCloseFile(dir, file))
     {
-        sprintf(filename, "%03i.png", i);
-        writePng(filename, font, i); 
+        die("Unable to write atlas.png: %s\n", strerror(errno));
     }
-    if (chdir(oldDir))
+    file = wlDirCreateFile(dir, "atlas.json");
+    if (!file || !wlAtlasWriteJsonStream(atlas, file, "atlas.png", scale)
+        || !wlDirCloseFile(dir, file))
     {
-        die("Unable to change to directory %s: %s\n", oldDir,
-                strerror(errno));
-        return;
+        die("Unable to write atlas.json: %s\n", strerror(errno));
+    }
+    file = wlDirCreateFile(dir, "atlas.bin");
+    if (!file || !wlAtlasWriteTableStream(atlas, file, scale)
+        || !wlDirCloseFile(dir, file))
+    {
+        die("Unable to write atlas.bin: %s\n", strerror(errno));
+    }
+    if (!wlDirClose(dir))
+    {
+        die("Unable to write to %s: %s\n", outputDir, strerror(errno));
     }
-    free(oldDir);
 }
 
 
 /**
- * Main method
+ * Main method of wl_unpackfont. Called by the wl multi-call program.
  *
  * @param argc
  *            The number of arguments
@@ -210,10 +257,12 @@ static void writePngs(char *outputDir, wlImages font)
  * @return Exit value
  */
 
-int main(int argc, char *argv[])
+int unpackfont_main(int argc, char *argv[])
 {  
     char *filename, *outputDir;
+    FILE *file;
     wlImages font;
+    wlAtlas atlas;
     
     /* Process options and reset argument pointer */
     check_options(argc, argv);
@@ -228,7 +277,13 @@ int main(int argc, char *argv[])
     outputDir = argv[1];
     
     /* Read the pic file */
-    font = wlFontReadFile(filename);
+    file = streamOpenInput(filename);
+    if (!file)
+    {
+        die("Unable to open font file %s: %s\n", filename, strerror(errno));
+    }
+    font = wlFontReadStream(file);
+    streamCloseInput(file);
     if (!font)
     {
         die("Unable to read font from %s: %s\n", filename,
@@ -236,7 +291,14 @@ int main(int argc, char *argv[])
     }
 
     /* Write the PNG files */
-    writePngs(outputDir, font);
+    if (useAtlas)
+    {
+        atlas = wlAtlasBuild(font, 0, 1);
+        writeAtlas(outputDir, atlas);
+        wlAtlasFree(atlas);
+    }
+    else
+        writePngs(outputDir, font);
     
     /* Free resources */
     wlImagesFree(font);
@@ -15,6 +15,7 @@
 #include <gd.h>
 #include <errno.h>
 #include "../libwasteland/wasteland.h"
+#include "../common/stream.h"
 #include <math.h>
 #include "config.h"
 
@@ -33,6 +34,8 @@ static void display_usage(void)
 {
     printf("Usage: wl_unpackpics [OPTION]... PICSFILE OUTPUTDIR\n");
     printf("Unpacks animated pictures into PNG images.\n");
+    printf("Use - as PICSFILE to read from stdin and - as OUTPUTDIR to write\n");
+    printf("a tar archive to stdout.\n");
     printf("\nOptions\n");
     printf("  -h, --help              Display help and exit\n");
     printf("  -V, --version           Display version and exit\n");
@@ -150,58 +153,122 @@ static gdImagePtr createImage(wlImage image)
 
 
 /**
- * Writes a single picture animation to the specified output directory.
+ * Creates a GD image from the area of the specified wasteland image which
+ * was changed by the specified delta. Pixels within this area which were
+ * not changed by the delta are transparent. An empty delta results in a
+ * single transparent pixel.
  *
- * @param outputDir
- *            The output directory
+ * @param image
+ *            The wasteland image
+ * @param delta
+ *            The delta which was applied to the image
+ * @return The GD image
+ */
+
+static gdImagePtr createDeltaImage(wlImage image, wlPicsDelta delta)
+{
+    gdImagePtr output;
+    int x, y, i;
+    int palette[17];
+    int color;
+
+    if (!delta->width)
+    {
+        output = gdImageCreate(1, 1);
+        gdImageColorTransparent(output, gdImageColorAllocate(output, 0, 0, 0));
+        return output;
+    }
+    output = gdImageCreate(delta->width, delta->height);
+    for (i = 0; i < 16; i++)
+    {
+        palette[i] = gdImageColorAllocate(output, wlPalette[i].red,
+                wlPalette[i].green, wlPalette[i].blue);
+    }
+    palette[16] = gdImageColorAllocate(output, 0, 0, 0);
+    gdImageColorTransparent(output, palette[16]);
+    for (y = 0; y < delta->height; y++)
+    {
+        for (x = 0; x < delta->width; x++)
+        {
+            color = delta->xors[y * delta->width + x] ? image->pixels[
+                (delta->y + y) * image->width + delta->x + x] : 16;
+            gdImageSetPixel(output, x, y, palette[color]);
+        }
+    }
+    return output;
+}
+
+
+/**
+ * Writes the HTML page which stacks the base frame and the animated layers
+ * of a picture animation. The page references the files written by
+ * writeAnimation().
+ *
+ * This function is also used by the convert-all command of the wl program.
+ *
+ * @param file
+ *            The stream to write the HTML page to
  * @param animation
- *            The animatin to write
+ *            The picture animation
+ * @return 1 on success, 0 on failure
  */
 
-static void writeAnimation(char *outputDir, wlPicsAnimation animation)
+int unpackpics_writeIndex(FILE *file, wlPicsAnimation animation)
 {
-    gdImagePtr baseImage, transpImage, prevImage;
-    gdImagePtr frameImage;
-    wlImage frame, transp;
-    FILE *file, *htmlFile;
-    char *oldDir;
-    char filename[8];
-    char format[8];
-    int i, j, x,y;
-    wlPicsInstructionSet set;
-    wlPicsInstruction instruction;
+    char filename[32];
+    char format[32];
+    int i;
 
-    // Remember current directory and then go to output directory
-    oldDir = getcwd(NULL, 0);
-    if (chdir(outputDir))
+    snprintf(format, sizeof(format), "%%0%ii.%%s", (int) log10(animation->instructions->quantity) + 1);
+    fprintf(file, "<html>\n");
+    fprintf(file, "  <body>\n");
+    fprintf(file, "    <div style=\"position:relative;width:96px;height:84px\">\n");
+    for (i = 0; i <= animation->instructions->quantity; i++)
     {
-        die("Unable to change to output directory %s: %s\n", outputDir,
-                strerror(errno));
-        return;
+        snprintf(filename, sizeof(filename), format, i, i ? "gif" : "png");
+        fprintf(file, "      <img src=\"%s\" style=\"position:absolute;width:100%%;height:100%%\" />\n", filename);
     }
+    fprintf(file, "    </div>\n");
+    fprintf(file, "  </body>\n");
+    fprintf(file, "</html>\n");
+    return !ferror(file);
+}
 
-    // Initialize HTML file
-    htmlFile = fopen("index.html", "wt");
-    if (!htmlFile)
-        die("Unable to write index.html: %s\n", strerror(errno));
-    fprintf(htmlFile, "<html>\n");
-    fprintf(htmlFile, "  <body>\n");
-    fprintf(htmlFile, "    <div style=\"position:relative;width:96px;height:84px\">\n");
 
-    // Determine the filename format for all written files of this animation
-    sprintf(format, "%%0%ii.%%s", (int) log10(animation->instructions->quantity) + 1);
+/**
+ * Writes a single animation layer (An instruction set) of a picture
+ * animation as an animated GIF. Only the changed area of each frame is
+ * written.
+ *
+ * The deltas are taken from the specified frame cache. When the deltas of
+ * the layer are already materialized in the cache then the cache is only
+ * read so several layers can be written by different threads at the same
+ * time. This function is also used by the convert-all command of the wl
+ * program.
+ *
+ * @param file
+ *            The stream to write the GIF to
+ * @param animation
+ *            The picture animation
+ * @param cache
+ *            The frame cache of the animation
+ * @param layer
+ *            The index of the instruction set
+ * @return 1 on success, 0 on failure
+ */
 
-    // Write the base frame
-    sprintf(filename, format, 0, "png");
-    fprintf(htmlFile, "      <img src=\"%s\" style=\"position:absolute;width:100%%;height:100%%\" />\n", filename);
-    baseImage = createImage(animation->baseFrame);
-    file = fopen(filename, "wb");
-    if (!file)
-        die("Unable to write base PNG to %s: %s\n", filename, strerror(errno));
-    gdImagePng(baseImage, file);
-    fclose(file);
+int unpackpics_writeLayer(FILE *file, wlPicsAnimation animation,
+    wlPicsCache cache, int layer)
+{
+    gdImagePtr transpImage;
+    gdImagePtr frameImage;
+    wlImage frame, transp;
+    int j, x, y;
+    wlPicsInstructionSet set;
+    wlPicsInstruction instruction;
+    wlPicsDelta delta;
 
-    // Create a transparent image which builds the base for the animated GIFs
+    // Create a transparent image which builds the base for the animated GIF
     transp = wlImageCreate(96, 84);
     for (x = 0; x < 96; x++)
     {
@@ -213,64 +280,95 @@ static void writeAnimation(char *outputDir, wlPicsAnimation animation)
     transpImage = createImage(transp);
     wlImageFree(transp);
 
-    // Write the animated layers
-    for (i = 0; i < animation->instructions->quantity; i++)
+    frame = wlImageClone(animation->baseFrame);
+    set = animation->instructions->sets[layer];
+    gdImageGifAnimBegin(transpImage, file, 1, 0);
+    gdImageGifAnimAdd(transpImage, file, 0, 0, 0, set->instructions[0]->delay * 6, gdDisposalNone, NULL);
+    for (j = 0; j < set->quantity - 1; j++)
     {
-        frame = wlImageClone(animation->baseFrame);
-        set = animation->instructions->sets[i];
-
-        // Initialize the animated GIF for this animation layer
-        sprintf(filename, format, i + 1, "gif");
-        fprintf(htmlFile, "      <img src=\"%s\" style=\"position:absolute;width:100%%;height:100%%\" />\n", filename);
-        file = fopen(filename, "wb");
-        if (!file) die("Unable to write animation layer to %s: %s\n",
-                filename, strerror(errno));
-        gdImageGifAnimBegin(transpImage, file, 1, 0);
-        gdImageGifAnimAdd(transpImage, file, 0, 0, 0, set->instructions[0]->delay * 6, gdDisposalNone, NULL);
-        prevImage = NULL;
-        for (j = 0; j < set->quantity - 1; j++)
-        {
-            instruction = set->instructions[j];
-
-            // There is one empty update frame in allpics2 picture 22. We
-            // simply ignore it
-            if (animation->updates->sets[instruction->update]->quantity == 0)
-                continue;
-
-            wlAnimationApply(frame, animation->updates->sets[instruction->update]);
-            frameImage = createImage(frame);
-            gdImageGifAnimAdd(frameImage, file, 0, 0, 0,
-                    set->instructions[j + 1]->delay * 6,
-                    gdDisposalNone, prevImage ? prevImage : baseImage);
-            if (prevImage) gdImageDestroy(prevImage);
-            prevImage = frameImage;
-        }
-        gdImageDestroy(prevImage);
-        gdImageGifAnimEnd(file);
-        fclose(file);
-
-        // Free the image
-        wlImageFree(frame);
+        instruction = set->instructions[j];
+
+        // There is one empty update frame in allpics2 picture 22. We
+        // simply ignore it
+        if (animation->updates->sets[instruction->update]->quantity == 0)
+            continue;
+
+        // Apply the update and only write the changed area of the frame
+        delta = wlPicsCacheGetDelta(cache, layer, j);
+        wlPicsDeltaApply(frame, delta);
+        frameImage = createDeltaImage(frame, delta);
+        gdImageGifAnimAdd(frameImage, file, 0, delta->x, delta->y,
+                set->instructions[j + 1]->delay * 6,
+                gdDisposalNone, NULL);
+        gdImageDestroy(frameImage);
     }
+    gdImageGifAnimEnd(file);
 
-    // Finish HTML file
-    fprintf(htmlFile, "    </div>\n");
-    fprintf(htmlFile, "  </body>\n");
-    fprintf(htmlFile, "</html>\n");
-    fclose(htmlFile);
-
-    // Release the base image and the transparent images
-    gdImageDestroy(baseImage);
+    // Release the frame and the transparent image
+    wlImageFree(frame);
     gdImageDestroy(transpImage);
+    return !ferror(file);
+}
+
 
-    // Switch back to old current directory
-    if (chdir(oldDir))
+/**
+ * Writes a single picture animation to the specified sub directory of the
+ * output directory.
+ *
+ * @param dir
+ *            The output directory
+ * @param animationDir
+ *            The sub directory of the animation
+ * @param animation
+ *            The animatin to write
+ */
+
+static void writeAnimation(wlDir dir, char *animationDir,
+    wlPicsAnimation animation)
+{
+    FILE *file;
+    char filename[32];
+    char path[64];
+    char format[32];
+    int i;
+    wlPicsCache cache;
+
+    // Determine the filename format for all written files of this animation
+    snprintf(format, sizeof(format), "%%0%ii.%%s", (int) log10(animation->instructions->quantity) + 1);
+
+    // Write the base frame
+    snprintf(filename, sizeof(filename), format, 0, "png");
+    snprintf(path, sizeof(path), "%s/%s", animationDir, filename);
+    file = wlDirCreateFile(dir, path);
+    if (!file || !wlPngWriteStream(animation->baseFrame, file, -1,
+        WL_PNG_FILTER_NONE) || !wlDirCloseFile(dir, file))
+        die("Unable to write base PNG to %s: %s\n", path, strerror(errno));
+
+    // Create the frame cache so the updates of each layer are only
+    // materialized once
+    cache = wlPicsCacheCreate(animation);
+
+    // Write the animated layers
+    for (i = 0; i < animation->instructions->quantity; i++)
     {
-        die("Unable to change to directory %s: %s\n", oldDir,
+        snprintf(filename, sizeof(filename), format, i + 1, "gif");
+        snprintf(path, sizeof(path), "%s/%s", animationDir, filename);
+        file = wlDirCreateFile(dir, path);
+        if (!file || !unpackpics_writeLayer(file, animation, cache, i)
+            || !wlDirCloseFile(dir, file))
+            die("Unable to write animation layer to %s: %s\n", path,
                 strerror(errno));
-        return;
     }
-    free(oldDir);
+
+    // Write the HTML file
+    snprintf(path, sizeof(path), "%s/index.html", animationDir);
+    file = wlDirCreateFile(dir, path);
+    if (!file || !unpackpics_writeIndex(file, animation)
+        || !wlDirCloseFile(dir, file))
+        die("Unable to write %s: %s\n", path, strerror(errno));
+
+    // Release the frame cache
+    wlPicsCacheFree(cache);
 }
 
 
@@ -278,7 +376,7 @@ static void writeAnimation(char *outputDir, wlPicsAnimation animation)
  * Writes all the picture animations into the specified output directory.
  *
  * @param outputDir
- *            The output directory
+ *            The output directory or "-" for a tar archive on stdout
  * @param animations
  *            The animations to write
  */
@@ -286,37 +384,37 @@ static void writeAnimation(char *outputDir, wlPicsAnimation animation)
 static void writeAnimations(char *outputDir, wlPicsAnimations animations)
 {
     int i;
-    char *oldDir;
-    char filename[5];
-    char format[5];
+    wlDir dir;
+    char filename[16];
+    char format[16];
 
-    oldDir = getcwd(NULL, 0);
-    if (chdir(outputDir))
+    dir = wlDirOpen(outputDir, 1);
+    if (!dir)
     {
-        die("Unable to change to output directory %s: %s\n", outputDir,
+        die("Unable to open output directory %s: %s\n", outputDir,
                 strerror(errno));
-        return;
     }
-    
-    sprintf(format, "%%0%ii", (int) log10(animations->quantity) + 1);
+
+    snprintf(format, sizeof(format), "%%0%ii", (int) log10(animations->quantity) + 1);
     for (i = 0; i < animations->quantity; i++)
     {
-        sprintf(filename, format, i);
-        mkdir(filename, 0755);
-        writeAnimation(filename, animations->animations[i]);
+        snprintf(filename, sizeof(filename), format, i);
+        if (!wlDirMkdir(dir, filename))
+        {
+            die("Unable to create directory %s: %s\n", filename,
+                strerror(errno));
+        }
+        writeAnimation(dir, filename, animations->animations[i]);
     }
-    if (chdir(oldDir))
+    if (!wlDirClose(dir))
     {
-        die("Unable to change to directory %s: %s\n", oldDir,
-                strerror(errno));
-        return;
+        die("Unable to write to %s: %s\n", outputDir, strerror(errno));
     }
-    free(oldDir);
 }
 
 
 /**
- * Main method
+ * Main method of wl_unpackpics. Called by the wl multi-call program.
  *
  * @param argc
  *            The number of arguments
@@ -325,10 +423,11 @@ static void writeAnimations(char *outputDir, wlPicsAnimations animations)
  * @return Exit value
  */
 
-int main(int argc, char *argv[])
+int unpackpics_main(int argc, char *argv[])
 {
     char *filename, *outputDir;
     wlPicsAnimations animations;
+    FILE *file;
 
     /* Process options and reset argument pointer */
     check_options(argc, argv);
@@ -343,7 +442,13 @@ int main(int argc, char *argv[])
     outputDir = argv[1];
 
     /* Read the picture animations file */
-    animations = wlAnimationsReadFile(filename);
+    file = streamOpenInput(filename);
+    if (!file)
+    {
+        die("Unable to open pics file %s: %s\n", filename, strerror(errno));
+    }
+    animations = wlAnimationsReadStream(file);
+    streamCloseInput(file);
     if (!animations)
     {
         die("Unable to read picture animations from %s: %s\n", filename,
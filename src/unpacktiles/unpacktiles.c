@@ -12,9 +12,9 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
-#include <gd.h>
 #include <errno.h>
 #include "../libwasteland/wasteland.h"
+#include "../common/stream.h"
 #include <math.h>
 #include "config.h"
 
@@ -24,6 +24,18 @@
 #define SEPARATOR '/'
 #endif
 
+/** The factor by which the written PNG images are scaled */
+static int scale = 1;
+
+/** The scale method (WL_SCALE_NEAREST or WL_SCALE_EPX) */
+static int scaleMethod = WL_SCALE_NEAREST;
+
+/** The number of threads writing the PNG files. 0 for one per CPU */
+static int jobs = 0;
+
+/** If the images are written into a single atlas image */
+static int useAtlas = 0;
+
 
 /**
  * Displays the usage text.
@@ -33,9 +45,18 @@ static void display_usage(void)
 {
     printf("Usage: wl_unpacktiles [OPTION]... HTDS-FILE OUTPUTDIR\n");
     printf("Unpacks the tiles into PNG images.\n");
+    printf("Use - as HTDS-FILE to read from stdin and - as OUTPUTDIR to write\n");
+    printf("a tar archive to stdout.\n");
     printf("\nOptions\n");
-    printf("  -h, --help      Display help and exit\n");
-    printf("  -V, --version   Display version and exit\n");
+    printf("  -s, --scale=FACTOR      Scale the images by an integer FACTOR\n");
+    printf("  -e, --epx               Scale with EPX (Scale2x/3x/4x) instead of\n");
+    printf("                          nearest neighbour\n");
+    printf("  -a, --atlas             Write a single atlas image with a JSON and\n");
+    printf("                          a binary coordinate table\n");
+    printf("  -j, --jobs=N            Compress the PNG files with N threads\n");
+    printf("                          (Default: One per CPU)\n");
+    printf("  -h, --help              Display help and exit\n");
+    printf("  -V, --version           Display version and exit\n");
     printf("\nReport bugs to %s <%s>\n", AUTHOR, EMAIL);
 }
 
@@ -86,15 +107,36 @@ static void check_options(int argc, char *argv[])
     char opt;
     int index;
     static struct option options[]={
+        {"scale", 1, NULL, 's'},
+        {"epx", 0, NULL, 'e'},
+        {"atlas", 0, NULL, 'a'},
+        {"jobs", 1, NULL, 'j'},
         {"help", 0, NULL, 'h'},
-        {"version", 0, NULL, 'V'}
+        {"version", 0, NULL, 'V'},
+        {NULL, 0, NULL, 0}
     };
 
     opterr = 0;
-    while((opt = getopt_long(argc, argv, "hV", options, &index)) != -1)
+    while((opt = getopt_long(argc, argv, "s:eaj:hV", options, &index)) != -1)
     {
         switch(opt)
         {
+            case 's':
+                scale = atoi(optarg);
+                break;
+
+            case 'e':
+                scaleMethod = WL_SCALE_EPX;
+                break;
+
+            case 'a':
+                useAtlas = 1;
+                break;
+
+            case 'j':
+                jobs = atoi(optarg);
+                break;
+
             case 'V':
                 display_version();
                 exit(1);
@@ -111,141 +153,142 @@ static void check_options(int argc, char *argv[])
                 break;
         }
     }
+    if (scale < 1) die("Invalid scale factor: %i\n", scale);
+    if (scaleMethod == WL_SCALE_EPX && (scale < 2 || scale > 4))
+        die("EPX only supports the scale factors 2, 3 and 4\n");
+    if (jobs < 0) die("Invalid number of jobs: %i\n", jobs);
 }
 
 
 /**
- * Writes a single tile into the specified file in PNG format.
+ * Queues all the tiles of a tileset for writing into the specified
+ * tileset directory.
  *
- * @param filename
- *            The output filename
+ * @param queue
+ *            The PNG queue
+ * @param dir
+ *            The output directory
+ * @param tilesetDir
+ *            The tileset directory relative to the output directory
  * @param tiles
- *            The tiles
- * @param tileNo
- *            The tile number to write
+ *            The tiles to write
+ * @return 1 on success, 0 if writing a PNG failed
  */
 
-static void writePng(char *filename, wlImages tiles, int tileNo)
+static int writePngs(wlPngQueue queue, wlDir dir, char *tilesetDir,
+    wlImages tiles)
 {
-    gdImagePtr output;
-    int x, y, i;
-    int palette[17];
-    int transparent;
-    int color;
-    FILE *file;
-    wlImage image;
+    int i;
+    char filename[32];
+    char format[32];
 
-    image = tiles->images[tileNo];
-    output = gdImageCreate(image->width, image->height);
-    for (i = 0; i < 16; i++)
-    {
-        palette[i] = gdImageColorAllocate(output, wlPalette[i].red,
-                wlPalette[i].green, wlPalette[i].blue);
-    }
-    transparent = gdImageColorAllocate(output, 0, 0, 0);
-    gdImageColorTransparent(output, transparent);
-    for (y = 0; y < image->height; y++)
-    {
-        for (x = 0; x < image->width; x++)
-        {
-            color = image->pixels[y * image->width + x];
-            gdImageSetPixel(output, x, y, color < 16 ? palette[color] : transparent);
-        }
-    }
-    file = fopen(filename, "wb");
-    if (!file)
+    snprintf(format, sizeof(format), "%%s%%c%%0%ii.png", (int) log10(tiles->quantity) + 1);
+    for (i = 0; i < tiles->quantity; i++)
     {
-        die("Unable to write PNG to %s: %s\n", filename, strerror(errno));
+        snprintf(filename, sizeof(filename), format, tilesetDir, SEPARATOR, i);
+        if (!wlPngQueueAdd(queue, tiles->images[i], dir, filename)) return 0;
     }
-    gdImagePng(output, file);
-    gdImageDestroy(output);
-    fclose(file);
+    return 1;
 }
 
 
 /**
- * Writes all the tiles into the specified output directory.
+ * Writes all the tilesets into the specified output directory.
  *
  * @param outputDir
- *            The output directory
- * @param tiles
- *            The tiles to write
+ *            The output directory or "-" for a tar archive on stdout
+ * @param tilesets
+ *            The tilesets to write
  */
 
-static void writePngs(char *outputDir, wlImages tiles)
+static void writeTilesets(char *outputDir, wlTilesets tilesets)
 {
+    wlPngQueue queue;
+    wlDir dir;
     int i;
-    char *oldDir;
-    char filename[8];
-    char format[9];
+    char filename[16];
+    char format[16];
 
-    oldDir = getcwd(NULL, 0);
-    if (chdir(outputDir))
+    dir = wlDirOpen(outputDir, 1);
+    if (!dir)
     {
-        die("Unable to change to output directory %s: %s\n", outputDir,
+        die("Unable to open output directory %s: %s\n", outputDir,
                 strerror(errno));
-        return;
     }
-    sprintf(format, "%%0%ii.png", (int) log10(tiles->quantity) + 1);
-    for (i = 0; i < tiles->quantity; i++)
+    queue = wlPngQueueCreate(jobs, -1, WL_PNG_FILTER_NONE, scale,
+        scaleMethod);
+    if (!queue) die("Unable to start PNG threads: %s\n", strerror(errno));
+    snprintf(format, sizeof(format), "%%0%ii", (int) log10(tilesets->quantity) + 1);
+    for (i = 0; i < tilesets->quantity; i++)
     {
-        sprintf(filename, format, i);
-        writePng(filename, tiles, i);
+        snprintf(filename, sizeof(filename), format, i);
+        if (!wlDirMkdir(dir, filename))
+        {
+            die("Unable to create directory %s: %s\n", filename,
+                strerror(errno));
+        }
+        if (!writePngs(queue, dir, filename, tilesets->tilesets[i])) break;
     }
-    if (chdir(oldDir))
+    if (!wlPngQueueFinish(queue))
     {
-        die("Unable to change to directory %s: %s\n", oldDir,
-                strerror(errno));
-        return;
+        die("Unable to write PNGs to %s: %s\n", outputDir, strerror(errno));
+    }
+    if (!wlDirClose(dir))
+    {
+        die("Unable to write to %s: %s\n", outputDir, strerror(errno));
     }
-    free(oldDir);
 }
 
 
-
-
 /**
- * Writes all the tilesets into the specified output directory.
+ * Writes all images into a single atlas image in the specified output
+ * directory. Duplicate images are only stored once. The positions of the
+ * images in the atlas are written into a JSON file and into a binary table.
  *
  * @param outputDir
- *            The output directory
- * @param tilesets
- *            The tilesets to write
+ *            The output directory or "-" for a tar archive on stdout
+ * @param atlas
+ *            The atlas to write
  */
 
-static void writeTilesets(char *outputDir, wlTilesets tilesets)
+static void writeAtlas(char *outputDir, wlAtlas atlas)
 {
-    int i;
-    char *oldDir;
-    char filename[5];
-    char format[5];
+    wlDir dir;
+    FILE *file;
 
-    oldDir = getcwd(NULL, 0);
-    if (chdir(outputDir))
+    dir = wlDirOpen(outputDir, 1);
+    if (!dir)
     {
-        die("Unable to change to output directory %s: %s\n", outputDir,
+        die("Unable to open output directory %s: %s\n", outputDir,
                 strerror(errno));
-        return;
     }
-    sprintf(format, "%%0%ii", (int) log10(tilesets->quantity) + 1);
-    for (i = 0; i < tilesets->quantity; i++)
+    file = wlDirCreateFile(dir, "atlas.png");
+    if (!file || !wlPngWriteScaledStream(atlas->image, file, -1,
+        WL_PNG_FILTER_NONE, scale, scaleMethod) || !wlDirCloseFile(dir, file))
     {
-        sprintf(filename, format, i);
-        mkdir(filename, 0755);
-        writePngs(filename, tilesets->tilesets[i]);
+        die("Unable to write atlas.png: %s\n", strerror(errno));
     }
-    if (chdir(oldDir))
+    file = wlDirCreateFile(dir, "atlas.json");
+    if (!file || !wlAtlasWriteJsonStream(atlas, file, "atlas.png", scale)
+        || !wlDirCloseFile(dir, file))
     {
-        die("Unable to change to directory %s: %s\n", oldDir,
-                strerror(errno));
-        return;
+        die("Unable to write atlas.json: %s\n", strerror(errno));
+    }
+    file = wlDirCreateFile(dir, "atlas.bin");
+    if (!file || !wlAtlasWriteTableStream(atlas, file, scale)
+        || !wlDirCloseFile(dir, file))
+    {
+        die("Unable to write atlas.bin: %s\n", strerror(errno));
+    }
+    if (!wlDirClose(dir))
+    {
+        die("Unable to write to %s: %s\n", outputDir, strerror(errno));
     }
-    free(oldDir);
 }
 
 
 /**
- * Main method
+ * Main method of wl_unpacktiles. Called by the wl multi-call program.
  *
  * @param argc
  *            The number of arguments
@@ -254,10 +297,12 @@ static void writeTilesets(char *outputDir, wlTilesets tilesets)
  * @return Exit value
  */
 
-int main(int argc, char *argv[])
+int unpacktiles_main(int argc, char *argv[])
 {
     char *filename, *outputDir;
+    FILE *file;
     wlTilesets tilesets;
+    wlAtlas atlas;
 
     /* Process options and reset argument pointer */
     check_options(argc, argv);
@@ -272,14 +317,28 @@ int main(int argc, char *argv[])
     outputDir = argv[1];
 
     /* Read the tilesets */
-    tilesets = wlTilesetsReadFile(filename);
+    file = streamOpenInput(filename);
+    if (!file)
+    {
+        die("Unable to open tiles file %s: %s\n", filename, strerror(errno));
+    }
+    tilesets = wlTilesetsReadStream(file);
+    streamCloseInput(file);
     if (!tilesets)
     {
-        die("Unable to read tilesets from %s\n", filename, strerror(errno));
+        die("Unable to read tilesets from %s: %s\n", filename, strerror(errno));
     }
 
     /* Write the PNG files */
-    writeTilesets(outputDir, tilesets);
+    if (useAtlas)
+    {
+        wlTilesetsDedupe(tilesets);
+        atlas = wlAtlasBuildTilesets(tilesets, 0, 1);
+        writeAtlas(outputDir, atlas);
+        wlAtlasFree(atlas);
+    }
+    else
+        writeTilesets(outputDir, tilesets);
 
     /* Free resources */
     wlTilesetsFree(tilesets);
@@ -0,0 +1,1229 @@
+/*
+ * $Id$
+ * Copyright (C) 2007  Klaus Reimer <k@ailis.de>
+ * See COPYING file for copying conditions
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../libwasteland/wasteland.h"
+#include "../common/list.h"
+#include "config.h"
+
+#ifdef WIN32
+#define SEPARATOR '\\'
+#else
+#define SEPARATOR '/'
+#endif
+
+/** The maximum length of an output filename of convert-all */
+#define FILENAME_SIZE 64
+
+/** The factor by which the written PNG images are scaled */
+static int scale = 1;
+
+/** The scale method (WL_SCALE_NEAREST or WL_SCALE_EPX) */
+static int scaleMethod = WL_SCALE_NEAREST;
+
+/** The number of worker threads of convert-all. 0 for one per CPU */
+static int jobs = 0;
+
+extern int decodehuffman_main(int argc, char *argv[]);
+extern int encodehuffman_main(int argc, char *argv[]);
+extern int decodepic_main(int argc, char *argv[]);
+extern int encodepic_main(int argc, char *argv[]);
+extern int unpacksprites_main(int argc, char *argv[]);
+extern int packsprites_main(int argc, char *argv[]);
+extern int unpackcursors_main(int argc, char *argv[]);
+extern int packcursors_main(int argc, char *argv[]);
+extern int unpackfont_main(int argc, char *argv[]);
+extern int packfont_main(int argc, char *argv[]);
+extern int unpackcpa_main(int argc, char *argv[]);
+extern int packcpa_main(int argc, char *argv[]);
+extern int decodecpa_main(int argc, char *argv[]);
+extern int unpacktiles_main(int argc, char *argv[]);
+extern int unpackpics_main(int argc, char *argv[]);
+extern int optimize_main(int argc, char *argv[]);
+extern int unpackpics_writeIndex(FILE *file, wlPicsAnimation animation);
+extern int unpackpics_writeLayer(FILE *file, wlPicsAnimation animation,
+    wlPicsCache cache, int layer);
+
+typedef struct
+{
+    char *name;
+    int (*main)(int argc, char *argv[]);
+} Tool;
+
+/** The tools of the multi-call program. wl_TOOL is an alias of wl TOOL */
+static Tool tools[] = {
+    { "decodehuffman", decodehuffman_main },
+    { "encodehuffman", encodehuffman_main },
+    { "decodepic", decodepic_main },
+    { "encodepic", encodepic_main },
+    { "unpacksprites", unpacksprites_main },
+    { "packsprites", packsprites_main },
+    { "unpackcursors", unpackcursors_main },
+    { "packcursors", packcursors_main },
+    { "unpackfont", unpackfont_main },
+    { "packfont", packfont_main },
+    { "unpackcpa", unpackcpa_main },
+    { "packcpa", packcpa_main },
+    { "decodecpa", decodecpa_main },
+    { "unpacktiles", unpacktiles_main },
+    { "unpackpics", unpackpics_main },
+    { "optimize", optimize_main },
+    { NULL, NULL }
+};
+
+typedef struct ConversionStruct * Conversion;
+
+typedef struct
+{
+    char *files[2];
+    char *outputDir;
+    int (*decode)(Conversion conversion);
+} ConvertJob;
+
+/**
+ * A file or directory written by convert-all. Files with an image or an
+ * animation layer are encoded by an export task, all other entries are
+ * complete when they are added to their conversion.
+ */
+typedef struct
+{
+    char *filename;
+    int directory;
+    wlImage image;
+    wlPicsAnimation animation;
+    wlPicsCache cache;
+    int layer;
+    char *data;
+    size_t size;
+    int error;
+    int done;
+} Output;
+
+/**
+ * The conversion of a single game file. The decode task adds the output
+ * entries in the order in which they are written.
+ */
+struct ConversionStruct
+{
+    ConvertJob *job;
+    char *files[2];
+    FILE *streams[2];
+    Output **outputs;
+    int quantity;
+    int decoded;
+    int error;
+    wlPicsAnimations animations;
+    wlPicsCache *caches;
+};
+
+/**
+ * A task of the thread pool. Either decodes the game file of a conversion
+ * or exports a single output entry.
+ */
+typedef struct TaskStruct
+{
+    Conversion conversion;
+    Output *output;
+    struct TaskStruct *next;
+} Task;
+
+/** The queued tasks of the thread pool */
+static Task *head = NULL, *tail = NULL;
+
+/** Set when the worker threads should stop after the queued tasks */
+static int stop = 0;
+
+/** Guards the task queue and the conversions */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Signaled when a task was queued */
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+
+/** Signaled when an output entry is complete or a file was decoded */
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+
+static int convertTiles(Conversion conversion);
+static int convertPics(Conversion conversion);
+static int convertCpa(Conversion conversion);
+static int convertSprites(Conversion conversion);
+static int convertFont(Conversion conversion);
+static int convertCursors(Conversion conversion);
+static int convertPic(Conversion conversion);
+
+/**
+ * The conversion jobs of convert-all. All files are decoded in parallel and
+ * their images are exported by the same thread pool.
+ */
+static ConvertJob convertJobs[] = {
+    { { "ALLHTDS1", NULL }, "tiles1", convertTiles },
+    { { "ALLHTDS2", NULL }, "tiles2", convertTiles },
+    { { "ALLPICS1", NULL }, "pics1", convertPics },
+    { { "ALLPICS2", NULL }, "pics2", convertPics },
+    { { "END.CPA", NULL }, "end", convertCpa },
+    { { "IC0_9.WLF", "MASKS.WLF" }, "sprites", convertSprites },
+    { { "COLORF.FNT", NULL }, "font", convertFont },
+    { { "CURS", NULL }, "cursors", convertCursors },
+    { { "TITLE.PIC", NULL }, "title", convertPic },
+    { { NULL, NULL }, NULL, NULL }
+};
+
+/**
+ * Displays the usage text.
+ */
+
+static void display_usage(void)
+{
+    int i;
+
+    printf("Usage: wl COMMAND [ARGUMENT]...\n");
+    printf("Converts Wasteland game files.\n");
+    printf("\nCommands\n");
+    printf("  convert-all [OPTION]... GAMEDIR OUTPUTDIR\n");
+    printf("      Converts all known files of a game installation\n");
+    printf("  TOOL [ARGUMENT]...\n");
+    printf("      Runs the tool wl_TOOL. The wl_TOOL programs are aliases of\n");
+    printf("      wl. Known tools:\n");
+    printf("     ");
+    for (i = 0; tools[i].name; i++)
+    {
+        if (i && !(i % 5)) printf("\n     ");
+        printf(" %s", tools[i].name);
+    }
+    printf("\n\nOptions of convert-all\n");
+    printf("  -s, --scale=FACTOR      Scale the images by an integer FACTOR\n");
+    printf("  -e, --epx               Scale with EPX (Scale2x/3x/4x) instead of\n");
+    printf("                          nearest neighbour\n");
+    printf("  -j, --jobs=N            Decode and export the files with N threads\n");
+    printf("                          (Default: One per CPU)\n");
+    printf("  -h, --help              Display help and exit\n");
+    printf("  -V, --version           Display version and exit\n");
+    printf("\nReport bugs to %s <%s>\n", AUTHOR, EMAIL);
+}
+
+
+/**
+ * Displays the version information.
+ */
+
+static void display_version(void)
+{
+    printf("wl %s\n", VERSION);
+    printf("\n%s\n", COPYRIGHT);
+    printf("This is free software; see the source for copying conditions. ");
+    printf("There is NO\nwarranty; not even for MERCHANTABILITY or FITNESS ");
+    printf("FOR A PARTICULAR PURPOSE.\n\nWritten by %s <%s>\n", AUTHOR, EMAIL);
+}
+
+
+/**
+ * Terminate the program with code 1 and the specified error message.
+ *
+ * @param message
+ *            The error message
+ */
+
+static void die(char *message, ...)
+{
+    va_list args;
+
+    va_start(args, message);
+    vfprintf(stderr, message, args);
+    va_end(args);
+    exit(1);
+}
+
+
+/**
+ * Check options.
+ *
+ * @param argc
+ *            The number of arguments
+ * @param argv
+ *            The argument array
+ */
+
+static void check_options(int argc, char *argv[])
+{
+    char opt;
+    int index;
+    static struct option options[]={
+        {"scale", 1, NULL, 's'},
+        {"epx", 0, NULL, 'e'},
+        {"jobs", 1, NULL, 'j'},
+        {"help", 0, NULL, 'h'},
+        {"version", 0, NULL, 'V'},
+        {NULL, 0, NULL, 0}
+    };
+
+    opterr = 0;
+    while((opt = getopt_long(argc, argv, "s:ej:hV", options, &index)) != -1)
+    {
+        switch(opt)
+        {
+            case 's':
+                scale = atoi(optarg);
+                break;
+
+            case 'e':
+                scaleMethod = WL_SCALE_EPX;
+                break;
+
+            case 'j':
+                jobs = atoi(optarg);
+                break;
+
+            case 'V':
+                display_version();
+                exit(1);
+                break;
+
+            case 'h':
+                display_usage();
+                exit(1);
+                break;
+
+            default:
+                die("Unknown option: %s\nUse --help to show valid options.\n",
+                        argv[optind - 1]);
+                break;
+        }
+    }
+    if (scale < 1) die("Invalid scale factor: %i\n", scale);
+    if (scaleMethod == WL_SCALE_EPX && (scale < 2 || scale > 4))
+        die("EPX only supports the scale factors 2, 3 and 4\n");
+    if (jobs < 0) die("Invalid number of jobs: %i\n", jobs);
+}
+
+
+/**
+ * Searches the tool with the specified name. Only the part of the name up
+ * to the first dot is used so wl_TOOL.exe aliases work, too.
+ *
+ * @param name
+ *            The tool name without the wl_ prefix
+ * @return The tool or NULL if not found
+ */
+
+static Tool * findTool(char *name)
+{
+    Tool *tool;
+    size_t length;
+
+    length = strcspn(name, ".");
+    for (tool = tools; tool->name; tool++)
+        if (strlen(tool->name) == length && !strncmp(tool->name, name, length))
+            return tool;
+    return NULL;
+}
+
+
+/**
+ * Searches a file in the specified list of filenames. The case of the
+ * filename is ignored because game installations copied from other file
+ * systems often have lower case filenames.
+ *
+ * @param names
+ *            The filenames of the game directory
+ * @param quantity
+ *            The number of filenames
+ * @param filename
+ *            The filename to search
+ * @return The real filename or NULL if not found
+ */
+
+static char * findFile(char **names, int quantity, char *filename)
+{
+    int i;
+
+    for (i = 0; i < quantity; i++)
+        if (!strcasecmp(names[i], filename)) return names[i];
+    return NULL;
+}
+
+
+/**
+ * Returns the number of decimal digits of the specified number. Used to
+ * build the same filenames as the individual tools.
+ *
+ * @param quantity
+ *            The number of items
+ * @return The number of digits
+ */
+
+static int digits(int quantity)
+{
+    int digits;
+
+    for (digits = 1; quantity >= 10; quantity /= 10) digits++;
+    return digits;
+}
+
+
+/**
+ * Queues a task for the worker threads. Must be called with the locked
+ * mutex.
+ *
+ * @param conversion
+ *            The conversion of the task
+ * @param output
+ *            The output entry to export or NULL to decode the game file
+ */
+
+static void schedule(Conversion conversion, Output *output)
+{
+    Task *task;
+
+    task = malloc(sizeof(Task));
+    task->conversion = conversion;
+    task->output = output;
+    task->next = NULL;
+    if (tail) tail->next = task; else head = task;
+    tail = task;
+    pthread_cond_signal(&work);
+}
+
+
+/**
+ * Adds an output entry to the specified conversion. Entries with an image
+ * or an animation layer are scheduled for export, all other entries can be
+ * written right away.
+ *
+ * @param conversion
+ *            The conversion
+ * @param output
+ *            The output entry
+ */
+
+static void publish(Conversion conversion, Output *output)
+{
+    pthread_mutex_lock(&mutex);
+    listAdd(conversion->outputs, output, &conversion->quantity);
+    if (output->image || output->animation)
+        schedule(conversion, output);
+    else
+    {
+        output->done = 1;
+        pthread_cond_broadcast(&done);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+
+/**
+ * Creates an empty output entry.
+ *
+ * @param filename
+ *            The filename relative to the output directory
+ * @return The output entry
+ */
+
+static Output * createOutput(char *filename)
+{
+    Output *output;
+
+    output = malloc(sizeof(Output));
+    output->filename = strdup(filename);
+    output->directory = 0;
+    output->image = NULL;
+    output->animation = NULL;
+    output->cache = NULL;
+    output->layer = -1;
+    output->data = NULL;
+    output->size = 0;
+    output->error = 0;
+    output->done = 0;
+    return output;
+}
+
+
+/**
+ * Releases an output entry.
+ *
+ * @param output
+ *            The output entry to free
+ */
+
+static void freeOutput(Output *output)
+{
+    if (output->image) wlImageFree(output->image);
+    free(output->data);
+    free(output->filename);
+    free(output);
+}
+
+
+/**
+ * Adds a sub directory to the output of the specified conversion.
+ *
+ * @param conversion
+ *            The conversion
+ * @param name
+ *            The directory name relative to the output directory
+ */
+
+static void addDirectory(Conversion conversion, char *name)
+{
+    Output *output;
+
+    output = createOutput(name);
+    output->directory = 1;
+    publish(conversion, output);
+}
+
+
+/**
+ * Adds a file with the content of a memory stream to the output of the
+ * specified conversion. The stream is closed and its buffer is owned by
+ * the output entry.
+ *
+ * @param conversion
+ *            The conversion
+ * @param filename
+ *            The filename relative to the output directory
+ * @param stream
+ *            The memory stream with the content
+ * @param data
+ *            The buffer of the memory stream
+ * @param size
+ *            The size of the memory stream
+ * @return 1 on success, 0 on failure
+ */
+
+static int addData(Conversion conversion, char *filename, FILE *stream,
+    char **data, size_t *size)
+{
+    Output *output;
+
+    if (fclose(stream))
+    {
+        free(*data);
+        return 0;
+    }
+    output = createOutput(filename);
+    output->data = *data;
+    output->size = *size;
+    publish(conversion, output);
+    return 1;
+}
+
+
+/**
+ * Adds an image as a numbered PNG file to the output of the specified
+ * conversion. The image is copied so the caller may modify or free it
+ * right after this call.
+ *
+ * @param conversion
+ *            The conversion
+ * @param prefix
+ *            The sub directory of the file
+ * @param width
+ *            The minimum number of digits of the filename
+ * @param index
+ *            The index to use as filename
+ * @param image
+ *            The image to write
+ * @return 1 on success, 0 on failure
+ */
+
+static int addPng(Conversion conversion, char *prefix, int width, int index,
+    wlImage image)
+{
+    Output *output;
+    char filename[FILENAME_SIZE];
+
+    if (snprintf(filename, sizeof(filename), "%s/%0*i.png", prefix, width,
+        index) >= sizeof(filename))
+    {
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+    output = createOutput(filename);
+    output->image = wlImageClone(image);
+    publish(conversion, output);
+    return 1;
+}
+
+
+/**
+ * Adds all the specified images as numbered PNG files to the output of the
+ * specified conversion.
+ *
+ * @param conversion
+ *            The conversion
+ * @param prefix
+ *            The sub directory of the files
+ * @param width
+ *            The minimum number of digits of the filenames
+ * @param images
+ *            The images to write
+ * @return 1 on success, 0 on failure
+ */
+
+static int addPngs(Conversion conversion, char *prefix, int width,
+    wlImages images)
+{
+    int i;
+
+    for (i = 0; i < images->quantity; i++)
+    {
+        if (!addPng(conversion, prefix, width, i, images->images[i]))
+            return 0;
+    }
+    return 1;
+}
+
+
+/**
+ * Exports an output entry into an in-memory PNG or GIF file. Called by the
+ * worker threads.
+ *
+ * @param output
+ *            The output entry to export
+ */
+
+static void exportOutput(Output *output)
+{
+    FILE *stream;
+    int result;
+
+    stream = open_memstream(&output->data, &output->size);
+    if (!stream)
+    {
+        output->error = errno;
+        return;
+    }
+    errno = 0;
+    if (output->image)
+        result = wlPngWriteScaledStream(output->image, stream, -1,
+            WL_PNG_FILTER_NONE, scale, scaleMethod);
+    else
+        result = unpackpics_writeLayer(stream, output->animation,
+            output->cache, output->layer);
+    if (!result) output->error = errno ? errno : EIO;
+    if (fclose(stream) && !output->error) output->error = errno;
+    if (output->image) wlImageFree(output->image);
+    output->image = NULL;
+}
+
+
+/**
+ * Decodes the game file of a conversion. The sub directory of the job is
+ * the first output entry. Called by the worker threads.
+ *
+ * @param conversion
+ *            The conversion to decode
+ */
+
+static void decode(Conversion conversion)
+{
+    int i, error;
+
+    addDirectory(conversion, conversion->job->outputDir);
+    errno = 0;
+    error = conversion->job->decode(conversion) ? 0 : errno ? errno : EINVAL;
+    for (i = 0; i < 2; i++)
+        if (conversion->streams[i]) fclose(conversion->streams[i]);
+    pthread_mutex_lock(&mutex);
+    conversion->error = error;
+    conversion->decoded = 1;
+    pthread_cond_broadcast(&done);
+    pthread_mutex_unlock(&mutex);
+}
+
+
+/**
+ * The worker thread. Runs the queued decode and export tasks until the
+ * pool is stopped and no task is left.
+ *
+ * @param data
+ *            Not used
+ * @return Always NULL
+ */
+
+static void * worker(void *data)
+{
+    Task *task;
+
+    pthread_mutex_lock(&mutex);
+    while (1)
+    {
+        while (!stop && !head) pthread_cond_wait(&work, &mutex);
+        if (!head) break;
+        task = head;
+        head = task->next;
+        if (!head) tail = NULL;
+        pthread_mutex_unlock(&mutex);
+        if (task->output)
+            exportOutput(task->output);
+        else
+            decode(task->conversion);
+        pthread_mutex_lock(&mutex);
+        if (task->output)
+        {
+            task->output->done = 1;
+            pthread_cond_broadcast(&done);
+        }
+        free(task);
+    }
+    pthread_mutex_unlock(&mutex);
+    return NULL;
+}
+
+
+/**
+ * Converts a tiles file into one directory per tileset.
+ *
+ * @param conversion
+ *            The conversion
+ * @return 1 on success, 0 on failure
+ */
+
+static int convertTiles(Conversion conversion)
+{
+    wlTilesets tilesets;
+    char tilesetDir[FILENAME_SIZE];
+    int i, result;
+
+    tilesets = wlTilesetsReadStream(conversion->streams[0]);
+    if (!tilesets) return 0;
+    result = 1;
+    for (i = 0; result && i < tilesets->quantity; i++)
+    {
+        if (snprintf(tilesetDir, sizeof(tilesetDir), "%s/%0*i",
+            conversion->job->outputDir, digits(tilesets->quantity), i)
+            >= sizeof(tilesetDir))
+        {
+            errno = ENAMETOOLONG;
+            result = 0;
+        }
+        else
+        {
+            addDirectory(conversion, tilesetDir);
+            result = addPngs(conversion, tilesetDir,
+                digits(tilesets->tilesets[i]->quantity),
+                tilesets->tilesets[i]);
+        }
+    }
+    wlTilesetsFree(tilesets);
+    return result;
+}
+
+
+/**
+ * Converts a PICS file into one directory per animation with the same
+ * files as wl_unpackpics: The base frame, one animated GIF per animation
+ * layer and an HTML page which stacks them. The frame deltas are
+ * materialized while decoding so the layers can be exported in parallel.
+ *
+ * @param conversion
+ *            The conversion
+ * @return 1 on success, 0 on failure
+ */
+
+static int convertPics(Conversion conversion)
+{
+    wlPicsAnimations animations;
+    wlPicsAnimation animation;
+    wlPicsInstructionSet set;
+    Output *output;
+    FILE *index;
+    char *data;
+    size_t size;
+    char animationDir[FILENAME_SIZE];
+    char filename[FILENAME_SIZE];
+    int i, layer, j, width;
+
+    animations = wlAnimationsReadStream(conversion->streams[0]);
+    if (!animations) return 0;
+
+    // The animations and caches are released when all files are written
+    conversion->animations = animations;
+    conversion->caches = calloc(animations->quantity, sizeof(wlPicsCache));
+
+    for (i = 0; i < animations->quantity; i++)
+    {
+        animation = animations->animations[i];
+        width = digits(animation->instructions->quantity);
+        if (snprintf(animationDir, sizeof(animationDir), "%s/%0*i",
+            conversion->job->outputDir, digits(animations->quantity), i)
+            >= sizeof(animationDir))
+        {
+            errno = ENAMETOOLONG;
+            return 0;
+        }
+        addDirectory(conversion, animationDir);
+        if (!addPng(conversion, animationDir, width, 0, animation->baseFrame))
+            return 0;
+
+        // Materialize the deltas of all layers
+        conversion->caches[i] = wlPicsCacheCreate(animation);
+        for (layer = 0; layer < animation->instructions->quantity; layer++)
+        {
+            set = animation->instructions->sets[layer];
+            for (j = 0; j < set->quantity - 1; j++)
+                wlPicsCacheGetDelta(conversion->caches[i], layer, j);
+        }
+
+        // Export the animation layers
+        for (layer = 0; layer < animation->instructions->quantity; layer++)
+        {
+            if (snprintf(filename, sizeof(filename), "%s/%0*i.gif",
+                animationDir, width, layer + 1) >= sizeof(filename))
+            {
+                errno = ENAMETOOLONG;
+                return 0;
+            }
+            output = createOutput(filename);
+            output->animation = animation;
+            output->cache = conversion->caches[i];
+            output->layer = layer;
+            publish(conversion, output);
+        }
+
+        // Write the HTML page
+        if (snprintf(filename, sizeof(filename), "%s/index.html",
+            animationDir) >= sizeof(filename))
+        {
+            errno = ENAMETOOLONG;
+            return 0;
+        }
+        index = open_memstream(&data, &size);
+        if (!index) return 0;
+        unpackpics_writeIndex(index, animation);
+        if (!addData(conversion, filename, index, &data, &size)) return 0;
+    }
+    return 1;
+}
+
+
+/**
+ * Converts a CPA animation into the base frame, all animation frames and
+ * a text file with the frame delays.
+ *
+ * @param conversion
+ *            The conversion
+ * @return 1 on success, 0 on failure
+ */
+
+static int convertCpa(Conversion conversion)
+{
+    wlCpaAnimation *animation;
+    wlImage frame;
+    FILE *delays;
+    char *data;
+    size_t size;
+    char filename[FILENAME_SIZE];
+    int i, result;
+
+    animation = wlCpaReadStream(conversion->streams[0]);
+    if (!animation) return 0;
+    delays = open_memstream(&data, &size);
+    if (!delays)
+    {
+        wlCpaFree(animation);
+        return 0;
+    }
+    fprintf(delays, "# The delays between the animation frames (0-65534)\n\n");
+
+    // The frames are copied when they are added so it can be updated
+    // right away
+    frame = wlImageClone(animation->baseFrame);
+    result = addPng(conversion, conversion->job->outputDir, 2, 0, frame);
+    for (i = 0; result && i < animation->quantity; i++)
+    {
+        wlCpaApplyFrame(frame, animation->frames[i], NULL);
+        result = addPng(conversion, conversion->job->outputDir, 2, i + 1,
+            frame);
+        fprintf(delays, "%5i\n", animation->frames[i]->delay);
+    }
+    snprintf(filename, sizeof(filename), "%s/delays.txt",
+        conversion->job->outputDir);
+    if (result)
+        result = addData(conversion, filename, delays, &data, &size);
+    else
+    {
+        fclose(delays);
+        free(data);
+    }
+    wlImageFree(frame);
+    wlCpaFree(animation);
+    return result;
+}
+
+
+/**
+ * Converts the sprites and their masks.
+ *
+ * @param conversion
+ *            The conversion
+ * @return 1 on success, 0 on failure
+ */
+
+static int convertSprites(Conversion conversion)
+{
+    wlImages sprites;
+    int result;
+
+    sprites = wlSpritesReadStream(conversion->streams[0],
+        conversion->streams[1]);
+    if (!sprites) return 0;
+    result = addPngs(conversion, conversion->job->outputDir, 1, sprites);
+    wlImagesFree(sprites);
+    return result;
+}
+
+
+/**
+ * Converts the font.
+ *
+ * @param conversion
+ *            The conversion
+ * @return 1 on success, 0 on failure
+ */
+
+static int convertFont(Conversion conversion)
+{
+    wlImages font;
+    int result;
+
+    font = wlFontReadStream(conversion->streams[0]);
+    if (!font) return 0;
+    result = addPngs(conversion, conversion->job->outputDir, 3, font);
+    wlImagesFree(font);
+    return result;
+}
+
+
+/**
+ * Converts the mouse cursors.
+ *
+ * @param conversion
+ *            The conversion
+ * @return 1 on success, 0 on failure
+ */
+
+static int convertCursors(Conversion conversion)
+{
+    wlImages cursors;
+    int result;
+
+    cursors = wlCursorsReadStream(conversion->streams[0]);
+    if (!cursors) return 0;
+    result = addPngs(conversion, conversion->job->outputDir, 1, cursors);
+    wlImagesFree(cursors);
+    return result;
+}
+
+
+/**
+ * Converts a PIC image.
+ *
+ * @param conversion
+ *            The conversion
+ * @return 1 on success, 0 on failure
+ */
+
+static int convertPic(Conversion conversion)
+{
+    wlImage image;
+    int result;
+
+    image = wlPicReadStream(conversion->streams[0]);
+    if (!image) return 0;
+    result = addPng(conversion, conversion->job->outputDir, 1, 0, image);
+    wlImageFree(image);
+    return result;
+}
+
+
+/**
+ * Writes the output entries of a conversion in the order in which they
+ * were added. Waits for the entries which are still exported and for the
+ * end of the decode task. Writing stops at the first error but the
+ * remaining entries are still released.
+ *
+ * @param conversion
+ *            The conversion
+ * @param dir
+ *            The output directory
+ * @return 1 on success, 0 on failure. errno is set then
+ */
+
+static int writeConversion(Conversion conversion, wlDir dir)
+{
+    Output *output;
+    int i, error;
+
+    error = 0;
+    pthread_mutex_lock(&mutex);
+    for (i = 0; ; i++)
+    {
+        while (i == conversion->quantity ? !conversion->decoded
+            : !conversion->outputs[i]->done)
+            pthread_cond_wait(&done, &mutex);
+        if (i == conversion->quantity) break;
+        output = conversion->outputs[i];
+        pthread_mutex_unlock(&mutex);
+        if (!error) error = output->error;
+        if (!error && !(output->directory ? wlDirMkdir(dir, output->filename)
+            : wlDirWriteFile(dir, output->filename, output->data,
+            output->size)))
+            error = errno ? errno : EIO;
+        freeOutput(output);
+        pthread_mutex_lock(&mutex);
+    }
+    pthread_mutex_unlock(&mutex);
+    if (conversion->error) error = conversion->error;
+    if (error)
+    {
+        errno = error;
+        return 0;
+    }
+    return 1;
+}
+
+
+/**
+ * Releases a conversion and the resources of its decoded file.
+ *
+ * @param conversion
+ *            The conversion to free
+ */
+
+static void freeConversion(Conversion conversion)
+{
+    int i;
+
+    if (conversion->animations)
+    {
+        for (i = 0; i < conversion->animations->quantity; i++)
+            if (conversion->caches[i]) wlPicsCacheFree(conversion->caches[i]);
+        free(conversion->caches);
+        wlAnimationsFree(conversion->animations);
+    }
+    listFree(conversion->outputs);
+    free(conversion);
+}
+
+
+/**
+ * Opens the input files of a conversion job and schedules the decode task.
+ * The input files are opened by the calling thread because the game
+ * directory can only be used by one thread.
+ *
+ * @param job
+ *            The conversion job
+ * @param input
+ *            The game directory
+ * @param files
+ *            The real filenames of the input files
+ * @return The conversion or NULL if an input file could not be opened.
+ *         errno is set then
+ */
+
+static Conversion startConversion(ConvertJob *job, wlDir input, char **files)
+{
+    Conversion conversion;
+    int i;
+
+    conversion = malloc(sizeof(struct ConversionStruct));
+    conversion->job = job;
+    conversion->streams[0] = conversion->streams[1] = NULL;
+    for (i = 0; i < 2; i++)
+    {
+        conversion->files[i] = job->files[i] ? files[i] : NULL;
+        if (job->files[i]
+            && !(conversion->streams[i] = wlDirOpenFile(input, files[i])))
+        {
+            if (i) fclose(conversion->streams[0]);
+            free(conversion);
+            return NULL;
+        }
+    }
+    listCreate(conversion->outputs, &conversion->quantity);
+    conversion->decoded = 0;
+    conversion->error = 0;
+    conversion->animations = NULL;
+    conversion->caches = NULL;
+    pthread_mutex_lock(&mutex);
+    schedule(conversion, NULL);
+    pthread_mutex_unlock(&mutex);
+    return conversion;
+}
+
+
+/**
+ * Converts all known files of a game installation. The conversion is one
+ * job graph on a pool of worker threads: A decode task per game file reads
+ * the file and schedules an export task per PNG image or GIF animation
+ * layer on the same pool. The calling thread writes the exported files in
+ * a fixed order so the output does not depend on the number of threads.
+ * The game directory and the output directory can be "-" to read a tar
+ * archive from stdin or to write a tar archive to stdout (See wlDirOpen()).
+ * Files which are not found are skipped.
+ *
+ * @param argc
+ *            The number of arguments
+ * @param argv
+ *            The argument array (Starting with the command name)
+ * @return Exit value
+ */
+
+static int convertAll(int argc, char *argv[])
+{
+    char *gameDir, *outputDir, **names, *files[2];
+    ConvertJob *job;
+    Conversion *conversions;
+    wlDir input, output;
+    pthread_t *workers;
+    FILE *report;
+    int i, quantity, found, failed, threads, started, error;
+
+    /* Process options and reset argument pointer */
+    check_options(argc, argv);
+    argc -= optind;
+    argv += optind;
+    if (argc != 2) die("Wrong number of parameters.\nUse --help to show syntax.\n");
+    gameDir = argv[0];
+    outputDir = argv[1];
+
+    /* Open the game directory and the output directory */
+    input = wlDirOpen(gameDir, 0);
+    if (!input)
+        die("Unable to open game directory %s: %s\n", gameDir,
+            strerror(errno));
+    names = wlDirList(input, "", &quantity);
+    if (strcmp(outputDir, "-")) mkdir(outputDir, 0755);
+    output = wlDirOpen(outputDir, 1);
+    if (!output)
+        die("Unable to open output directory %s: %s\n", outputDir,
+            strerror(errno));
+
+    /* The report goes to stderr when the tar archive is written to stdout */
+    report = strcmp(outputDir, "-") ? stdout : stderr;
+
+    /* Open the found game files and schedule their decode tasks */
+    conversions = calloc(sizeof(convertJobs) / sizeof(ConvertJob),
+        sizeof(Conversion));
+    found = 0;
+    failed = 0;
+    for (job = convertJobs; job->decode; job++)
+    {
+        for (i = 0; i < 2 && job->files[i]; i++)
+            if (!(files[i] = findFile(names, quantity, job->files[i]))) break;
+        if (i < 2 && job->files[i]) continue;
+        found++;
+        if (!(conversions[job - convertJobs] = startConversion(job, input,
+            files)))
+        {
+            fprintf(stderr, "Unable to convert %s%c%s: %s\n", gameDir,
+                SEPARATOR, files[0], strerror(errno));
+            failed = 1;
+        }
+    }
+
+    /* Start the worker threads */
+    threads = jobs ? jobs : sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+    workers = malloc(sizeof(pthread_t) * threads);
+    for (started = 0; started < threads; started++)
+    {
+        error = pthread_create(&workers[started], NULL, worker, NULL);
+        if (error)
+        {
+            if (started) break;
+            die("Unable to start worker threads: %s\n", strerror(error));
+        }
+    }
+
+    /* Write the converted files in the order of the jobs */
+    for (i = 0; convertJobs[i].decode; i++)
+    {
+        if (!conversions[i]) continue;
+        if (!writeConversion(conversions[i], output))
+        {
+            fprintf(stderr, "Unable to convert %s%c%s: %s\n", gameDir,
+                SEPARATOR, conversions[i]->files[0], strerror(errno));
+            failed = 1;
+        }
+        else
+            fprintf(report, "%s%c%s -> %s%c%s\n", gameDir, SEPARATOR,
+                conversions[i]->files[0], outputDir, SEPARATOR,
+                convertJobs[i].outputDir);
+        freeConversion(conversions[i]);
+    }
+
+    /* Stop the worker threads */
+    pthread_mutex_lock(&mutex);
+    stop = 1;
+    pthread_cond_broadcast(&work);
+    pthread_mutex_unlock(&mutex);
+    for (i = 0; i < started; i++) pthread_join(workers[i], NULL);
+    free(workers);
+    free(conversions);
+
+    listFreeWithItems(names, &quantity);
+    if (!wlDirClose(output))
+    {
+        fprintf(stderr, "Unable to write %s: %s\n", outputDir,
+            strerror(errno));
+        failed = 1;
+    }
+    wlDirClose(input);
+    if (!found) die("No game files found in %s\n", gameDir);
+    return failed;
+}
+
+
+/**
+ * Main method. When the program is started through an alias like
+ * wl_unpackpics then the tool of the alias is run. Otherwise the first
+ * argument is the command.
+ *
+ * @param argc
+ *            The number of arguments
+ * @param argv
+ *            The argument array
+ * @return Exit value
+ */
+
+int main(int argc, char *argv[])
+{
+    Tool *tool;
+    char *name;
+
+    /* Run the tool of the alias */
+    name = strrchr(argv[0], SEPARATOR);
+    name = name ? name + 1 : argv[0];
+    if (!strncmp(name, "wl_", 3))
+    {
+        if (!(tool = findTool(name + 3))) die("Unknown tool: %s\n", name);
+        return tool->main(argc, argv);
+    }
+
+    /* Run the command */
+    if (argc < 2) die("No command specified.\nUse --help to show syntax.\n");
+    if (!strcmp(argv[1], "convert-all")) return convertAll(argc - 1, argv + 1);
+    if (argv[1][0] == '-')
+    {
+        check_options(argc, argv);
+        die("No command specified.\nUse --help to show syntax.\n");
+    }
+    if (!(tool = findTool(argv[1])))
+        die("Unknown command: %s\nUse --help to show valid commands.\n",
+            argv[1]);
+    return tool->main(argc - 1, argv + 1);
+}